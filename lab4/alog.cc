@@ -0,0 +1,193 @@
+// asynchronous leveled logging.
+
+#include "alog.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define RING_SLOTS  256
+#define RECORD_LEN  240
+#define DRAIN_USEC  20000
+
+struct log_record {
+  int level;
+  long ms;
+  int len;
+  char text[RECORD_LEN];
+};
+
+// Filled by the thread owning it, emptied by whoever drains. head
+// and tail only grow; the slot of n is recs[n % RING_SLOTS].
+struct log_ring {
+  log_record recs[RING_SLOTS];
+  std::atomic<unsigned> head;
+  std::atomic<unsigned> tail;
+  std::atomic<unsigned> dropped;
+  std::atomic<bool> owned;
+};
+
+// Rings are never freed, nor is the list of them, since the writer
+// may still be draining while the process exits. A thread gives its
+// ring up when it exits and a new thread takes it over, records still
+// in it and all.
+static pthread_mutex_t rings_m = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<log_ring *> &rings = *new std::vector<log_ring *>;
+static pthread_mutex_t drain_m = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+
+static int
+initial_level()
+{
+  const char *s = getenv("ALOG_LEVEL");
+  return s != NULL ? atoi(s) : JSL_DBG_3;
+}
+
+int alog_level = initial_level();
+
+struct ring_owner {
+  log_ring *r;
+  ring_owner() : r(NULL) {}
+  ~ring_owner() { if (r != NULL) r->owned = false; }
+};
+static thread_local ring_owner mine;
+
+static void
+write_all(int fd, const std::string &s)
+{
+  size_t done = 0;
+  while (done < s.size()) {
+    ssize_t n = write(fd, s.data() + done, s.size() - done);
+    if (n <= 0)
+      return;
+    done += n;
+  }
+}
+
+static bool
+earlier(const log_record *a, const log_record *b)
+{
+  return a->ms < b->ms;
+}
+
+// Write out every ring, oldest record first.
+static void
+drain()
+{
+  pthread_mutex_lock(&drain_m);
+  pthread_mutex_lock(&rings_m);
+  std::vector<log_ring *> all(rings);
+  pthread_mutex_unlock(&rings_m);
+
+  std::vector<const log_record *> recs;
+  std::vector<unsigned> heads(all.size());
+  std::string out, err;
+  for (size_t i = 0; i < all.size(); i++) {
+    heads[i] = all[i]->head.load(std::memory_order_acquire);
+    for (unsigned t = all[i]->tail.load(std::memory_order_relaxed); t != heads[i]; t++)
+      recs.push_back(&all[i]->recs[t % RING_SLOTS]);
+    unsigned dropped = all[i]->dropped.exchange(0);
+    if (dropped > 0) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "alog: %u records dropped\n", dropped);
+      err += buf;
+    }
+  }
+  std::stable_sort(recs.begin(), recs.end(), earlier);
+
+  for (size_t i = 0; i < recs.size(); i++) {
+    char stamp[32];
+    int n = snprintf(stamp, sizeof(stamp), "%ld:\t", recs[i]->ms);
+    std::string &o = recs[i]->level <= JSL_DBG_2 ? err : out;
+    o.append(stamp, n);
+    o.append(recs[i]->text, recs[i]->len);
+  }
+  for (size_t i = 0; i < all.size(); i++)
+    all[i]->tail.store(heads[i], std::memory_order_release);
+
+  write_all(1, out);
+  write_all(2, err);
+  pthread_mutex_unlock(&drain_m);
+}
+
+static void *
+writer(void *)
+{
+  while (true) {
+    drain();
+    usleep(DRAIN_USEC);
+  }
+  return NULL;
+}
+
+static void
+start_writer()
+{
+  pthread_t th;
+  pthread_create(&th, NULL, writer, NULL);
+  pthread_detach(th);
+  atexit(alog_flush);
+}
+
+static log_ring *
+my_ring()
+{
+  if (mine.r != NULL)
+    return mine.r;
+
+  pthread_once(&writer_once, start_writer);
+  pthread_mutex_lock(&rings_m);
+  for (size_t i = 0; i < rings.size() && mine.r == NULL; i++) {
+    bool free = false;
+    if (rings[i]->owned.compare_exchange_strong(free, true))
+      mine.r = rings[i];
+  }
+  if (mine.r == NULL) {
+    log_ring *r = new log_ring();
+    r->head = 0;
+    r->tail = 0;
+    r->dropped = 0;
+    r->owned = true;
+    rings.push_back(r);
+    mine.r = r;
+  }
+  pthread_mutex_unlock(&rings_m);
+  return mine.r;
+}
+
+void
+alog_write(int level, const char *fmt, ...)
+{
+  log_ring *r = my_ring();
+  unsigned h = r->head.load(std::memory_order_relaxed);
+  if (h - r->tail.load(std::memory_order_acquire) >= RING_SLOTS) {
+    r->dropped++;
+    return;
+  }
+
+  log_record &rec = r->recs[h % RING_SLOTS];
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  rec.level = level;
+  rec.ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(rec.text, RECORD_LEN, fmt, ap);
+  va_end(ap);
+  rec.len = n < 0 ? 0 : std::min(n, RECORD_LEN - 1);
+  if (n >= RECORD_LEN)
+    rec.text[rec.len - 1] = '\n';
+  r->head.store(h + 1, std::memory_order_release);
+}
+
+void
+alog_flush()
+{
+  drain();
+}
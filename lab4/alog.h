@@ -0,0 +1,35 @@
+// asynchronous leveled logging.
+
+#ifndef alog_h
+#define alog_h
+
+#include "jsl_log.h"
+
+// Levels are jsl_log's, JSL_DBG_1 (critical) to JSL_DBG_4 (debugging).
+// Calls above ALOG_MAX_LEVEL compile to nothing; build with
+// -DALOG_MAX_LEVEL=4 to keep the per-operation traces. Of the rest,
+// those above alog_level are skipped at run time. alog_level starts
+// at ALOG_LEVEL from the environment, or JSL_DBG_3.
+#ifndef ALOG_MAX_LEVEL
+#define ALOG_MAX_LEVEL JSL_DBG_3
+#endif
+
+extern int alog_level;
+
+#define alog(level, ...)                                      \
+  do {                                                        \
+    if ((level) <= ALOG_MAX_LEVEL && (level) <= alog_level)   \
+      alog_write((level), __VA_ARGS__);                       \
+  } while (0)
+
+// Format a record into the calling thread's ring buffer. A background
+// thread writes the records out with tprintf's millisecond stamp,
+// errors and worse to stderr and the rest to stdout. A record that
+// finds the ring full is dropped, and the drops are reported.
+void alog_write(int level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+// Write out everything logged so far; also run at exit.
+void alog_flush();
+
+#endif
@@ -10,6 +10,10 @@ using namespace std;
 int DataNode::init(const string &extent_dst, const string &namenode, const struct sockaddr_in *bindaddr) {
   
   ec = new extent_client(extent_dst);
+  // a block read from a replica can miss a write made through another
+  // datanode moments ago, so this is only for read-mostly setups.
+  if (getenv("EXTENT_STALE_READS") != NULL)
+    ec->allow_stale_reads(true);
 
   // Generate ID based on listen address
   id.set_ipaddr(inet_ntoa(bindaddr->sin_addr));
@@ -55,24 +59,23 @@ void DataNode::heart(){
 
 bool DataNode::ReadBlock(blockid_t bid, uint64_t offset, uint64_t len, string &buf) {
 
-  string raw_buf;
-  int r;
-  r = ec->read_block(bid, raw_buf);
-  if (offset > raw_buf.size())
+  if (offset > BLOCK_SIZE) {
     buf = "";
-  else
-    buf = raw_buf.substr(offset, len);
-  
+    return true;
+  }
+  if (len > BLOCK_SIZE)
+    len = BLOCK_SIZE;
+  if (ec->read_block_range(bid, offset, len, buf) != extent_protocol::OK)
+    return false;
+
   /* Your lab4 part 2 code */
   return true;
 }
 
 bool DataNode::WriteBlock(blockid_t bid, uint64_t offset, uint64_t len, const string &buf) {
 
-  string wbuf;
-  ec->read_block(bid, wbuf);
-  wbuf = wbuf.substr(0, offset) + buf + wbuf.substr(offset + len);
-  ec->write_block(bid, wbuf);
+  if (ec->write_block_range(bid, offset, buf.substr(0, len)) != extent_protocol::OK)
+    return false;
 
   return true;
 }
@@ -0,0 +1,73 @@
+// Throughput of inode_manager as the number of concurrent callers
+// grows, without the RPC layer in the way.
+//
+// usage: extent_bench [ops-per-thread]
+//
+// For 1, 2, 4, 8 and 16 threads, every thread works on files of its
+// own: it creates one, writes, appends, reads and stats it, truncates
+// it every few rounds and finally removes it.
+
+#include "inode_manager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <string>
+
+static inode_manager *im;
+static int ops_per_thread = 2000;
+
+static void *
+worker(void *)
+{
+  std::string data(4096, 'x');
+  std::string tail(512, 'y');
+  extent_protocol::attr a;
+  char *buf;
+  int size;
+
+  uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+  for (int i = 0; i < ops_per_thread; i += 4) {
+    if (i % 64 == 0)
+      im->write_file(inum, data.data(), data.size());
+    im->append_file(inum, tail.data(), tail.size());
+    im->read_file(inum, &buf, &size);
+    free(buf);
+    im->getattr(inum, a);
+    if (i % 32 == 0)
+      im->truncate_file(inum, data.size());
+  }
+  im->remove_file(inum);
+  return NULL;
+}
+
+static double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc > 1)
+    ops_per_thread = atoi(argv[1]);
+
+  im = new inode_manager();
+
+  printf("threads\tops/s\n");
+  for (int nthreads = 1; nthreads <= 16; nthreads *= 2) {
+    pthread_t th[16];
+    double start = now();
+    for (int i = 0; i < nthreads; i++)
+      pthread_create(&th[i], NULL, worker, NULL);
+    for (int i = 0; i < nthreads; i++)
+      pthread_join(th[i], NULL);
+    double secs = now() - start;
+    printf("%d\t%.0f\n", nthreads, nthreads * ops_per_thread / secs);
+  }
+  return 0;
+}
@@ -6,16 +6,97 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include <map>
+#include <memory>
+#include "lang/verify.h"
+#include "alog.h"
 
-extent_client::extent_client(std::string dst) {
+extent_client::extent_client(std::string dst)
+  : shards(EXTENT_MAX_SHARDS, (rpcc *)NULL), replicas(EXTENT_MAX_SHARDS),
+    next_create(0), stale_reads(false), next_read(0) {
+    VERIFY(pthread_mutex_init(&create_m, NULL) == 0);
+
+    std::vector<extent_config_line> lines;
+    if (!read_extent_config(dst, lines)) {
+        extent_config_line l = { 0, false, dst };
+        lines.push_back(l);
+    }
+    for (size_t i = 0; i < lines.size(); i++) {
+        unsigned shard = lines[i].shard;
+        VERIFY(shard < EXTENT_MAX_SHARDS);
+        if (lines[i].replica) {
+            replicas[shard].push_back(bind_to(lines[i].dst));
+        } else {
+            VERIFY(shards[shard] == NULL);
+            shards[shard] = bind_to(lines[i].dst);
+            shard_ids.push_back(shard);
+        }
+    }
+    VERIFY(!shard_ids.empty());
+    for (unsigned shard = 0; shard < EXTENT_MAX_SHARDS; shard++)
+        VERIFY(replicas[shard].empty() || shards[shard] != NULL);
+}
+
+rpcc *
+extent_client::bind_to(const std::string &dst) {
     sockaddr_in dstsock;
 
     make_sockaddr(dst.c_str(), &dstsock);
-    cl = new rpcc(dstsock);
+    rpcc *cl = new rpcc(dstsock);
 
     if (cl->bind() != 0) {
-        printf("extent_client: bind failed\n");
+        alog(JSL_DBG_2, "extent_client: bind %s failed\n", dst.c_str());
     }
+    return cl;
+}
+
+bool
+read_extent_config(const std::string &path, std::vector<extent_config_line> &lines) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == NULL)
+        return false;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *hash = strchr(line, '#');
+        if (hash != NULL)
+            *hash = '\0';
+        extent_config_line l;
+        char dst[200];
+        l.replica = false;
+        if (sscanf(line, "replica %u %199s", &l.shard, dst) == 2)
+            l.replica = true;
+        else if (sscanf(line, "%u %199s", &l.shard, dst) != 2)
+            continue;
+        l.dst = dst;
+        lines.push_back(l);
+    }
+    fclose(f);
+    return true;
+}
+
+rpcc *
+extent_client::route(unsigned long long id) {
+    rpcc *cl = shards[EXTENT_SHARD(id)];
+    if (cl == NULL)
+        alog(JSL_DBG_2, "extent_client: no server for shard %u of %llu\n", EXTENT_SHARD(id), id);
+    return cl;
+}
+
+// The server to read id from: with stale reads allowed, the shard's
+// primary and replicas in turn, otherwise the primary.
+rpcc *
+extent_client::route_read(unsigned long long id) {
+    std::vector<rpcc *> &r = replicas[EXTENT_SHARD(id)];
+    if (!stale_reads || r.empty())
+        return route(id);
+    unsigned n = next_read++ % (r.size() + 1);
+    return n < r.size() ? r[n] : route(id);
+}
+
+extent_client::~extent_client() {
+    VERIFY(pthread_mutex_destroy(&create_m) == 0);
 }
 
 // a demo to show how to use RPC
@@ -23,37 +104,112 @@ extent_protocol::status
 extent_client::getattr(extent_protocol::extentid_t eid,
                        extent_protocol::attr     & attr) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::getattr, eid, attr);
+    rpcc *cl = route_read(eid);
+    if (cl == NULL)
+        return extent_protocol::IOERR;
+    ret = cl->call(extent_rpc::getattr(), eid, attr);
+    if (ret == extent_protocol::STALE)
+        ret = route(eid)->call(extent_rpc::getattr(), eid, attr);
     return ret;
 }
 
 extent_protocol::status
 extent_client::create(uint32_t type, extent_protocol::extentid_t& id) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::create, type, id);
+    pthread_mutex_lock(&create_m);
+    rpcc *cl = shards[shard_ids[next_create++ % shard_ids.size()]];
+    pthread_mutex_unlock(&create_m);
+    ret = cl->call(extent_rpc::create(), type, id);
     return ret;
 }
 
 extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string& buf) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::get, eid, buf);
+    rpcc *cl = route_read(eid);
+    if (cl == NULL)
+        return extent_protocol::IOERR;
+    ret = cl->call(extent_rpc::get(), eid, buf);
+    if (ret == extent_protocol::STALE)
+        ret = route(eid)->call(extent_rpc::get(), eid, buf);
     return ret;
 }
 
 extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf) {
     extent_protocol::status ret = extent_protocol::OK;
+    rpcc *cl = route(eid);
+    if (cl == NULL)
+        return extent_protocol::IOERR;
     int i; // placeholder
-    ret = cl->call(extent_protocol::put, eid, buf, i);
+    ret = cl->call(extent_rpc::put(), eid, buf, i);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::append(extent_protocol::extentid_t eid, const std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    rpcc *cl = route(eid);
+    if (cl == NULL)
+        return extent_protocol::IOERR;
+    int i; // placeholder
+    ret = cl->call(extent_rpc::append(), eid, buf, i);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid, uint32_t size) {
+    extent_protocol::status ret = extent_protocol::OK;
+    rpcc *cl = route(eid);
+    if (cl == NULL)
+        return extent_protocol::IOERR;
+    int i; // placeholder
+    ret = cl->call(extent_rpc::truncate(), eid, size, i);
+    return ret;
+}
+
+// Copy on the server; aligned whole blocks end up shared between
+// src and dst rather than duplicated. That needs both on one server.
+extent_protocol::status
+extent_client::copy_range(extent_protocol::extentid_t src, uint32_t src_off,
+                          extent_protocol::extentid_t dst, uint32_t dst_off,
+                          uint32_t len, uint32_t &copied) {
+    extent_protocol::status ret = extent_protocol::OK;
+    rpcc *cl = route(src);
+    if (cl == NULL)
+        return extent_protocol::IOERR;
+    if (EXTENT_SHARD(src) == EXTENT_SHARD(dst)) {
+        ret = cl->call(extent_rpc::copy_range(), src, src_off, dst, dst_off, len, copied);
+        return ret;
+    }
+
+    // the two extents live on different servers, so the bytes have
+    // to come through here.
+    std::string sbuf, dbuf;
+    copied = 0;
+    if ((ret = extent_client::get(src, sbuf)) != extent_protocol::OK)
+        return ret;
+    if (src_off >= sbuf.size())
+        return ret;
+    sbuf = sbuf.substr(src_off, len);
+    if ((ret = extent_client::get(dst, dbuf)) != extent_protocol::OK)
+        return ret;
+    if (dbuf.size() < dst_off + sbuf.size())
+        dbuf.resize(dst_off + sbuf.size());
+    dbuf.replace(dst_off, sbuf.size(), sbuf);
+    if ((ret = extent_client::put(dst, dbuf)) == extent_protocol::OK)
+        copied = sbuf.size();
     return ret;
 }
 
 extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid) {
     extent_protocol::status ret = extent_protocol::OK;
+    rpcc *cl = route(eid);
+    if (cl == NULL)
+        return extent_protocol::IOERR;
     int i; // placeholder
-    ret = cl->call(extent_protocol::remove, eid, i);
+    ret = cl->call(extent_rpc::remove(), eid, i);
     return ret;
 }
 
@@ -61,7 +217,12 @@ extent_protocol::status
 extent_client::get_block_ids(extent_protocol::extentid_t eid, std::list<blockid_t> &block_ids)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::get_block_ids, eid, block_ids);
+  rpcc *cl = route_read(eid);
+  if (cl == NULL)
+    return extent_protocol::IOERR;
+  ret = cl->call(extent_rpc::get_block_ids(), eid, block_ids);
+  if (ret == extent_protocol::STALE)
+    ret = route(eid)->call(extent_rpc::get_block_ids(), eid, block_ids);
   return ret;
 }
 
@@ -69,7 +230,12 @@ extent_protocol::status
 extent_client::read_block(blockid_t bid, std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::read_block, bid, buf);
+  rpcc *cl = route_read(bid);
+  if (cl == NULL)
+    return extent_protocol::IOERR;
+  ret = cl->call(extent_rpc::read_block(), bid, buf);
+  if (ret == extent_protocol::STALE)
+    ret = route(bid)->call(extent_rpc::read_block(), bid, buf);
   return ret;
 }
 
@@ -77,8 +243,36 @@ extent_protocol::status
 extent_client::write_block(blockid_t bid, const std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
+  rpcc *cl = route(bid);
+  if (cl == NULL)
+    return extent_protocol::IOERR;
+  int r;
+  ret = cl->call(extent_rpc::write_block(), bid, buf, r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::read_block_range(blockid_t bid, uint32_t off, uint32_t len, std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  rpcc *cl = route_read(bid);
+  if (cl == NULL)
+    return extent_protocol::IOERR;
+  ret = cl->call(extent_rpc::read_block_range(), bid, off, len, buf);
+  if (ret == extent_protocol::STALE)
+    ret = route(bid)->call(extent_rpc::read_block_range(), bid, off, len, buf);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::write_block_range(blockid_t bid, uint32_t off, const std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  rpcc *cl = route(bid);
+  if (cl == NULL)
+    return extent_protocol::IOERR;
   int r;
-  ret = cl->call(extent_protocol::write_block, bid, buf, r);
+  ret = cl->call(extent_rpc::write_block_range(), bid, off, buf, r);
   return ret;
 }
 
@@ -86,7 +280,10 @@ extent_protocol::status
 extent_client::append_block(extent_protocol::extentid_t eid, blockid_t &bid)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::append_block, eid, bid);
+  rpcc *cl = route(eid);
+  if (cl == NULL)
+    return extent_protocol::IOERR;
+  ret = cl->call(extent_rpc::append_block(), eid, bid);
   return ret;
 }
 
@@ -94,8 +291,228 @@ extent_protocol::status
 extent_client::complete(extent_protocol::extentid_t eid, uint32_t size)
 {
   extent_protocol::status ret = extent_protocol::OK;
+  rpcc *cl = route(eid);
+  if (cl == NULL)
+    return extent_protocol::IOERR;
+  int r;
+  ret = cl->call(extent_rpc::complete(), eid, size, r);
+  return ret;
+}
+
+
+// Split eids by owning server: shard -> positions in eids.
+static void
+split_by_shard(const std::vector<extent_protocol::extentid_t> &eids,
+               std::map<unsigned, std::vector<size_t> > &groups)
+{
+  for (size_t i = 0; i < eids.size(); i++)
+    groups[EXTENT_SHARD(eids[i])].push_back(i);
+}
+
+extent_protocol::status
+extent_client::getattr_many(const std::vector<extent_protocol::extentid_t> &eids,
+                            std::vector<extent_protocol::attr> &as,
+                            std::vector<extent_protocol::status> &sts)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  as.clear();
+  sts.clear();
+  if (eids.empty())
+    return ret;
+
+  std::map<unsigned, std::vector<size_t> > groups;
+  split_by_shard(eids, groups);
+  as.resize(eids.size());
+  sts.resize(eids.size());
+  for (auto g = groups.begin(); g != groups.end(); g++) {
+    rpcc *cl = route_read(eids[g->second[0]]);
+    std::vector<extent_protocol::extentid_t> ids;
+    std::vector<extent_protocol::attr_entry> part;
+    for (size_t i = 0; i < g->second.size(); i++)
+      ids.push_back(eids[g->second[i]]);
+    if (cl == NULL)
+      ret = extent_protocol::IOERR;
+    else
+      ret = cl->call(extent_rpc::getattr_many(), ids, part);
+    if (ret == extent_protocol::STALE)
+      ret = route(ids[0])->call(extent_rpc::getattr_many(), ids, part);
+    if (ret == extent_protocol::OK && part.size() != ids.size())
+      ret = extent_protocol::IOERR;
+    if (ret != extent_protocol::OK) {
+      as.clear();
+      sts.clear();
+      return ret;
+    }
+    for (size_t i = 0; i < part.size(); i++) {
+      sts[g->second[i]] = part[i].st;
+      as[g->second[i]] = part[i].a;
+    }
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::get_many(const std::vector<extent_protocol::extentid_t> &eids,
+                        std::vector<std::string> &bufs,
+                        std::vector<extent_protocol::status> &sts)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  bufs.clear();
+  sts.clear();
+  if (eids.empty())
+    return ret;
+
+  std::map<unsigned, std::vector<size_t> > groups;
+  split_by_shard(eids, groups);
+  bufs.resize(eids.size());
+  sts.resize(eids.size());
+  for (auto g = groups.begin(); g != groups.end(); g++) {
+    rpcc *cl = route_read(eids[g->second[0]]);
+    std::vector<extent_protocol::extentid_t> ids;
+    std::vector<extent_protocol::buf_entry> part;
+    for (size_t i = 0; i < g->second.size(); i++)
+      ids.push_back(eids[g->second[i]]);
+    if (cl == NULL)
+      ret = extent_protocol::IOERR;
+    else
+      ret = cl->call(extent_rpc::get_many(), ids, part);
+    if (ret == extent_protocol::STALE)
+      ret = route(ids[0])->call(extent_rpc::get_many(), ids, part);
+    if (ret == extent_protocol::OK && part.size() != ids.size())
+      ret = extent_protocol::IOERR;
+    if (ret != extent_protocol::OK) {
+      bufs.clear();
+      sts.clear();
+      return ret;
+    }
+    for (size_t i = 0; i < part.size(); i++) {
+      sts[g->second[i]] = part[i].st;
+      bufs[g->second[i]].swap(part[i].buf);
+    }
+  }
+  return ret;
+}
+
+// eid must already be unlinked; the server frees the subtree later.
+extent_protocol::status
+extent_client::remove_tree(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  rpcc *cl = route(eid);
+  if (cl == NULL)
+    return extent_protocol::IOERR;
   int r;
-  ret = cl->call(extent_protocol::complete, eid, size, r);
+  ret = cl->call(extent_rpc::remove_tree(), eid, r);
   return ret;
 }
 
+extent_protocol::status
+extent_client::remove_many(const std::vector<extent_protocol::extentid_t> &eids)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  if (eids.empty())
+    return ret;
+
+  std::map<unsigned, std::vector<size_t> > groups;
+  split_by_shard(eids, groups);
+  for (auto g = groups.begin(); g != groups.end(); g++) {
+    rpcc *cl = route(eids[g->second[0]]);
+    std::vector<extent_protocol::extentid_t> ids;
+    for (size_t i = 0; i < g->second.size(); i++)
+      ids.push_back(eids[g->second[i]]);
+    if (cl == NULL)
+      return extent_protocol::IOERR;
+    if ((ret = cl->call(extent_rpc::remove_many(), ids, r)) != extent_protocol::OK)
+      return ret;
+  }
+  return ret;
+}
+
+extent_client::pending
+extent_client::ready(extent_protocol::status ret)
+{
+  std::promise<extent_protocol::status> p;
+  p.set_value(ret);
+  return p.get_future();
+}
+
+// A read may go to a replica too far behind to answer; it is then made
+// again on the primary when the result is collected.
+template<class Proc, class R, class... Args> extent_client::pending
+extent_client::read_async(unsigned long long id, R &r, Args... args)
+{
+  rpcc *cl = route_read(id);
+  if (cl == NULL)
+    return ready(extent_protocol::IOERR);
+  rpcc *primary = route(id);
+  if (cl == primary)
+    return cl->call_async(Proc(), args..., r);
+  std::shared_ptr<pending> first(new pending(cl->call_async(Proc(), args..., r)));
+  return std::async(std::launch::deferred, [first, primary, &r, args...]() {
+    extent_protocol::status ret = first->get();
+    if (ret == extent_protocol::STALE)
+      ret = primary->call(Proc(), args..., r);
+    return ret;
+  });
+}
+
+extent_client::pending
+extent_client::get_async(extent_protocol::extentid_t eid, std::string &buf)
+{
+  return read_async<extent_rpc::get>(eid, buf, eid);
+}
+
+extent_client::pending
+extent_client::getattr_async(extent_protocol::extentid_t eid,
+                             extent_protocol::attr &a)
+{
+  return read_async<extent_rpc::getattr>(eid, a, eid);
+}
+
+// the replies carry nothing, so the futures keep a placeholder for them
+extent_client::pending
+extent_client::put_async(extent_protocol::extentid_t eid, const std::string &buf)
+{
+  rpcc *cl = route(eid);
+  if (cl == NULL)
+    return ready(extent_protocol::IOERR);
+  std::shared_ptr<int> r(new int);
+  std::shared_ptr<pending> p(new pending(cl->call_async(extent_rpc::put(), eid, buf, *r)));
+  return std::async(std::launch::deferred, [p, r]() { return p->get(); });
+}
+
+extent_client::pending
+extent_client::remove_async(extent_protocol::extentid_t eid)
+{
+  rpcc *cl = route(eid);
+  if (cl == NULL)
+    return ready(extent_protocol::IOERR);
+  std::shared_ptr<int> r(new int);
+  std::shared_ptr<pending> p(new pending(cl->call_async(extent_rpc::remove(), eid, *r)));
+  return std::async(std::launch::deferred, [p, r]() { return p->get(); });
+}
+
+extent_client::pending
+extent_client::get_block_ids_async(extent_protocol::extentid_t eid,
+                                   std::list<blockid_t> &block_ids)
+{
+  return read_async<extent_rpc::get_block_ids>(eid, block_ids, eid);
+}
+
+extent_client::pending
+extent_client::read_block_async(blockid_t bid, std::string &buf)
+{
+  return read_async<extent_rpc::read_block>(bid, buf, bid);
+}
+
+extent_client::pending
+extent_client::write_block_async(blockid_t bid, const std::string &buf)
+{
+  rpcc *cl = route(bid);
+  if (cl == NULL)
+    return ready(extent_protocol::IOERR);
+  std::shared_ptr<int> r(new int);
+  std::shared_ptr<pending> p(new pending(cl->call_async(extent_rpc::write_block(), bid, buf, *r)));
+  return std::async(std::launch::deferred, [p, r]() { return p->get(); });
+}
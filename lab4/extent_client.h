@@ -4,28 +4,101 @@
 #define extent_client_h
 
 #include <string>
+#include <vector>
+#include <future>
+#include <pthread.h>
+#include <atomic>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// One server named by an extent config file: a line "shard host:port"
+// for the primary of a shard, or "replica shard host:port" for one of
+// its read replicas. # starts a comment.
+struct extent_config_line {
+  unsigned shard;
+  bool replica;
+  std::string dst;
+};
+// false if path is not a readable file.
+bool read_extent_config(const std::string &path, std::vector<extent_config_line> &lines);
+
+// dst is either the address of a single extent_server or the name of
+// an extent config file. Calls go to the server owning the id; new
+// extents are spread over all of them. With allow_stale_reads on,
+// reads are spread over a shard's primary and its replicas.
 class extent_client {
+ public:
+  // the result of an async call. Reference arguments are filled in by
+  // the time get() returns, so they must outlive the future.
+  typedef std::future<extent_protocol::status> pending;
+
  private:
-  rpcc *cl;
+  std::vector<rpcc *> shards; // by shard number, NULL if not configured
+  std::vector<std::vector<rpcc *> > replicas; // by shard number
+  std::vector<unsigned> shard_ids;
+  unsigned next_create;
+  pthread_mutex_t create_m;
+  bool stale_reads;
+  std::atomic<unsigned> next_read;
+  rpcc *route(unsigned long long id);
+  rpcc *route_read(unsigned long long id);
+  rpcc *bind_to(const std::string &dst);
+  template<class Proc, class R, class... Args>
+    pending read_async(unsigned long long id, R &r, Args... args);
+
+ protected:
+  // an already finished call
+  static pending ready(extent_protocol::status ret);
 
  public:
   extent_client(std::string dst);
+  virtual ~extent_client();
+
+  // Let reads go to replicas, which may lag the primary by up to
+  // REPLICA_STALE_MS. Callers relying on a lock to see the latest
+  // data leave this off, which is the default.
+  void allow_stale_reads(bool on) { stale_reads = on; }
 
-  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
-  extent_protocol::status get(extent_protocol::extentid_t eid, 
+  virtual extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
+  virtual extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
-  extent_protocol::status getattr(extent_protocol::extentid_t eid, 
+  virtual extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
-  extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
-  extent_protocol::status remove(extent_protocol::extentid_t eid);
+  virtual extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+  virtual extent_protocol::status remove(extent_protocol::extentid_t eid);
+  virtual extent_protocol::status append(extent_protocol::extentid_t eid, const std::string &buf);
+  virtual extent_protocol::status truncate(extent_protocol::extentid_t eid, uint32_t size);
+  virtual extent_protocol::status copy_range(extent_protocol::extentid_t src, uint32_t src_off,
+                                             extent_protocol::extentid_t dst, uint32_t dst_off,
+                                             uint32_t len, uint32_t &copied);
   extent_protocol::status get_block_ids(extent_protocol::extentid_t eid, std::list<blockid_t> &block_ids);
   extent_protocol::status read_block(blockid_t bid, std::string &buf);
   extent_protocol::status write_block(blockid_t bid, const std::string &buf);
+  extent_protocol::status read_block_range(blockid_t bid, uint32_t off, uint32_t len, std::string &buf);
+  extent_protocol::status write_block_range(blockid_t bid, uint32_t off, const std::string &buf);
   extent_protocol::status append_block(extent_protocol::extentid_t eid, blockid_t &bid);
   extent_protocol::status complete(extent_protocol::extentid_t eid, uint32_t size);
+  // sts[i] is the status of eids[i]; the batch as a whole only fails
+  // when a server cannot be reached
+  extent_protocol::status getattr_many(const std::vector<extent_protocol::extentid_t> &eids,
+                                       std::vector<extent_protocol::attr> &as,
+                                       std::vector<extent_protocol::status> &sts);
+  extent_protocol::status get_many(const std::vector<extent_protocol::extentid_t> &eids,
+                                   std::vector<std::string> &bufs,
+                                   std::vector<extent_protocol::status> &sts);
+  extent_protocol::status remove_many(const std::vector<extent_protocol::extentid_t> &eids);
+  extent_protocol::status remove_tree(extent_protocol::extentid_t eid);
+
+  // Sent at once, without a thread per call: rpcc completes them as
+  // the replies come in. A subclass that caches extents serves the
+  // first four itself.
+  virtual pending get_async(extent_protocol::extentid_t eid, std::string &buf);
+  virtual pending getattr_async(extent_protocol::extentid_t eid, extent_protocol::attr &a);
+  virtual pending put_async(extent_protocol::extentid_t eid, const std::string &buf);
+  virtual pending remove_async(extent_protocol::extentid_t eid);
+  pending get_block_ids_async(extent_protocol::extentid_t eid, std::list<blockid_t> &block_ids);
+  pending read_block_async(blockid_t bid, std::string &buf);
+  pending write_block_async(blockid_t bid, const std::string &buf);
 };
 
 #endif 
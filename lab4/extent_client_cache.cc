@@ -0,0 +1,206 @@
+// extent client that caches data and attributes of locked extents.
+
+#include "extent_client_cache.h"
+#include <stdio.h>
+#include <time.h>
+#include "lang/verify.h"
+#include "slock.h"
+#include "alog.h"
+
+extent_client_cache::extent_client_cache(std::string dst)
+  : extent_client(dst)
+{
+  VERIFY(pthread_mutex_init(&m, NULL) == 0);
+}
+
+extent_client_cache::~extent_client_cache()
+{
+  VERIFY(pthread_mutex_destroy(&m) == 0);
+}
+
+extent_protocol::status
+extent_client_cache::get(extent_protocol::extentid_t eid, std::string &buf)
+{
+  {
+    ScopedLock ml(&m);
+    std::map<extent_protocol::extentid_t, extent>::iterator it = extents.find(eid);
+    if (it != extents.end() && it->second.data_valid) {
+      buf = it->second.data;
+      return extent_protocol::OK;
+    }
+  }
+
+  extent_protocol::status ret = extent_client::get(eid, buf);
+  if (ret == extent_protocol::OK) {
+    ScopedLock ml(&m);
+    extent &e = extents[eid];
+    e.data = buf;
+    e.data_valid = true;
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client_cache::getattr(extent_protocol::extentid_t eid,
+                             extent_protocol::attr &a)
+{
+  {
+    ScopedLock ml(&m);
+    std::map<extent_protocol::extentid_t, extent>::iterator it = extents.find(eid);
+    if (it != extents.end() && it->second.attr_valid) {
+      a = it->second.attr;
+      return extent_protocol::OK;
+    }
+  }
+
+  extent_protocol::status ret = extent_client::getattr(eid, a);
+  if (ret == extent_protocol::OK) {
+    ScopedLock ml(&m);
+    extent &e = extents[eid];
+    e.attr = a;
+    e.attr_valid = true;
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client_cache::put(extent_protocol::extentid_t eid, std::string buf)
+{
+  // the attributes have to be known before the data goes dirty,
+  // otherwise a later getattr would return the server's stale size.
+  extent_protocol::attr a;
+  extent_protocol::status ret = getattr(eid, a);
+  if (ret != extent_protocol::OK)
+    return ret;
+
+  ScopedLock ml(&m);
+  extent &e = extents[eid];
+  e.data = buf;
+  e.data_valid = true;
+  e.dirty = true;
+  e.attr.size = buf.size();
+  e.attr.mtime = time(0);
+  e.attr.ctime = time(0);
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client_cache::remove(extent_protocol::extentid_t eid)
+{
+  {
+    ScopedLock ml(&m);
+    extents.erase(eid);
+  }
+  return extent_client::remove(eid);
+}
+
+// With data and attributes cached, appends and truncates are applied
+// locally and written back with the rest. Otherwise the entry is
+// dropped and the call goes to the server.
+extent_protocol::status
+extent_client_cache::append(extent_protocol::extentid_t eid, const std::string &buf)
+{
+  {
+    ScopedLock ml(&m);
+    std::map<extent_protocol::extentid_t, extent>::iterator it = extents.find(eid);
+    if (it != extents.end() && it->second.data_valid && it->second.attr_valid) {
+      extent &e = it->second;
+      e.data += buf;
+      e.dirty = true;
+      e.attr.size = e.data.size();
+      e.attr.mtime = time(0);
+      e.attr.ctime = time(0);
+      return extent_protocol::OK;
+    }
+  }
+
+  flush(eid);
+  return extent_client::append(eid, buf);
+}
+
+extent_protocol::status
+extent_client_cache::truncate(extent_protocol::extentid_t eid, uint32_t size)
+{
+  {
+    ScopedLock ml(&m);
+    std::map<extent_protocol::extentid_t, extent>::iterator it = extents.find(eid);
+    if (it != extents.end() && it->second.data_valid && it->second.attr_valid) {
+      extent &e = it->second;
+      e.data.resize(size);
+      e.dirty = true;
+      e.attr.size = size;
+      e.attr.mtime = time(0);
+      e.attr.ctime = time(0);
+      return extent_protocol::OK;
+    }
+  }
+
+  flush(eid);
+  return extent_client::truncate(eid, size);
+}
+
+// The server copies from what it has, so src must be written back
+// first, and dst is dropped since the copy changes it.
+extent_protocol::status
+extent_client_cache::copy_range(extent_protocol::extentid_t src, uint32_t src_off,
+                                extent_protocol::extentid_t dst, uint32_t dst_off,
+                                uint32_t len, uint32_t &copied)
+{
+  flush(src);
+  flush(dst);
+  return extent_client::copy_range(src, src_off, dst, dst_off, len, copied);
+}
+
+extent_client::pending
+extent_client_cache::get_async(extent_protocol::extentid_t eid, std::string &buf)
+{
+  return ready(get(eid, buf));
+}
+
+extent_client::pending
+extent_client_cache::getattr_async(extent_protocol::extentid_t eid,
+                                   extent_protocol::attr &a)
+{
+  return ready(getattr(eid, a));
+}
+
+extent_client::pending
+extent_client_cache::put_async(extent_protocol::extentid_t eid, const std::string &buf)
+{
+  return ready(put(eid, buf));
+}
+
+extent_client::pending
+extent_client_cache::remove_async(extent_protocol::extentid_t eid)
+{
+  return ready(remove(eid));
+}
+
+// Write eid back to the extent server if it is dirty, and drop it.
+extent_protocol::status
+extent_client_cache::flush(extent_protocol::extentid_t eid)
+{
+  extent e;
+  {
+    ScopedLock ml(&m);
+    std::map<extent_protocol::extentid_t, extent>::iterator it = extents.find(eid);
+    if (it == extents.end())
+      return extent_protocol::OK;
+    e.data.swap(it->second.data);
+    e.dirty = it->second.dirty;
+    extents.erase(it);
+  }
+
+  if (!e.dirty)
+    return extent_protocol::OK;
+  extent_protocol::status ret = extent_client::put(eid, e.data);
+  if (ret != extent_protocol::OK)
+    alog(JSL_DBG_2, "extent_client_cache: write back %llu failed %d\n", eid, ret);
+  return ret;
+}
+
+void
+extent_client_cache::dorelease(lock_protocol::lockid_t lid)
+{
+  flush(lid);
+}
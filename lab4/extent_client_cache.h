@@ -0,0 +1,55 @@
+// extent client with a write-back cache of extent data and attributes.
+
+#ifndef extent_client_cache_h
+#define extent_client_cache_h
+
+#include <string>
+#include <map>
+#include <pthread.h>
+#include "extent_client.h"
+#include "lock_client_cache.h"
+
+// Entries are only valid while the caller holds the lock named by
+// the extent id. lock_client_cache calls dorelease before it gives
+// such a lock back to the lock server; dirty data is written back
+// and the entry is dropped, so the next holder sees a fresh copy.
+class extent_client_cache : public extent_client, public lock_release_user {
+ private:
+  struct extent {
+    extent() : data_valid(false), attr_valid(false), dirty(false) {}
+    std::string data;
+    extent_protocol::attr attr;
+    bool data_valid;
+    bool attr_valid;
+    bool dirty;
+  };
+  std::map<extent_protocol::extentid_t, extent> extents;
+  pthread_mutex_t m;
+
+ public:
+  extent_client_cache(std::string dst);
+  virtual ~extent_client_cache();
+
+  extent_protocol::status get(extent_protocol::extentid_t eid,
+                              std::string &buf);
+  extent_protocol::status getattr(extent_protocol::extentid_t eid,
+                                  extent_protocol::attr &a);
+  extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+  extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status append(extent_protocol::extentid_t eid, const std::string &buf);
+  extent_protocol::status truncate(extent_protocol::extentid_t eid, uint32_t size);
+  extent_protocol::status copy_range(extent_protocol::extentid_t src, uint32_t src_off,
+                                     extent_protocol::extentid_t dst, uint32_t dst_off,
+                                     uint32_t len, uint32_t &copied);
+
+  // served from the cache like their synchronous forms
+  pending get_async(extent_protocol::extentid_t eid, std::string &buf);
+  pending getattr_async(extent_protocol::extentid_t eid, extent_protocol::attr &a);
+  pending put_async(extent_protocol::extentid_t eid, const std::string &buf);
+  pending remove_async(extent_protocol::extentid_t eid);
+
+  extent_protocol::status flush(extent_protocol::extentid_t eid);
+  void dorelease(lock_protocol::lockid_t lid);
+};
+
+#endif
@@ -0,0 +1,136 @@
+// shipping of extent_server disk writes to read replicas.
+
+#include "extent_log.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "extent_protocol.h"
+#include "threader.h"
+#include "lang/verify.h"
+#include "alog.h"
+
+// Each write is shipped as this header followed by len bytes.
+struct log_entry {
+  uint32_t id;
+  uint32_t off;
+  uint32_t len;
+};
+
+// writes of the section the calling thread is in
+static thread_local std::string section;
+static thread_local bool in_section;
+
+extent_log::extent_log(const std::vector<std::string> &dsts)
+  : seq(0)
+{
+  VERIFY(pthread_mutex_init(&m, NULL) == 0);
+  VERIFY(pthread_cond_init(&ready, NULL) == 0);
+  VERIFY(pthread_cond_init(&room, NULL) == 0);
+
+  for (size_t i = 0; i < dsts.size(); i++) {
+    sockaddr_in dstsock;
+    make_sockaddr(dsts[i].c_str(), &dstsock);
+    rpcc *cl = new rpcc(dstsock);
+    if (cl->bind(rpcc::to(1000)) != 0) {
+      alog(JSL_DBG_2, "extent_log: bind replica %s failed\n", dsts[i].c_str());
+      delete cl;
+      continue;
+    }
+    replicas.push_back(cl);
+  }
+  NewThread(this, &extent_log::shipper);
+}
+
+void
+extent_log::write(uint32_t id, uint32_t off, uint32_t len, const char *buf)
+{
+  log_entry e = { id, off, len };
+  if (in_section) {
+    section.append((const char *)&e, sizeof(e));
+    section.append(buf, len);
+    return;
+  }
+
+  std::string entry((const char *)&e, sizeof(e));
+  entry.append(buf, len);
+  queue(entry);
+}
+
+void
+extent_log::begin()
+{
+  in_section = true;
+}
+
+void
+extent_log::end()
+{
+  in_section = false;
+  if (!section.empty()) {
+    queue(section);
+    section.clear();
+  }
+}
+
+// Append entries to the next batch. The caller still holds whatever
+// lock ordered its writes, so batches keep that order.
+void
+extent_log::queue(const std::string &entries)
+{
+  pthread_mutex_lock(&m);
+  while (pending.size() > REPLICA_MAX_PENDING)
+    pthread_cond_wait(&room, &m);
+  pending += entries;
+  pthread_cond_signal(&ready);
+  pthread_mutex_unlock(&m);
+}
+
+void
+extent_log::shipper()
+{
+  std::string batch;
+  while (true) {
+    pthread_mutex_lock(&m);
+    if (pending.empty()) {
+      struct timeval now;
+      struct timespec deadline;
+      gettimeofday(&now, NULL);
+      long long usec = now.tv_usec + REPLICA_HEARTBEAT_MS * 1000LL;
+      deadline.tv_sec = now.tv_sec + usec / 1000000;
+      deadline.tv_nsec = (usec % 1000000) * 1000;
+      pthread_cond_timedwait(&ready, &m, &deadline);
+    }
+    batch.clear();
+    batch.swap(pending);
+    pthread_cond_broadcast(&room);
+    pthread_mutex_unlock(&m);
+
+    seq++;
+    for (size_t i = 0; i < replicas.size(); ) {
+      int r;
+      int ret = replicas[i]->call(extent_rpc::replicate(), seq, batch, r,
+                                  rpcc::to(REPLICA_STALE_MS));
+      if (ret != extent_protocol::OK) {
+        alog(JSL_DBG_2, "extent_log: replica %zu failed batch %llu (%d), dropped\n", i, seq, ret);
+        delete replicas[i];
+        replicas.erase(replicas.begin() + i);
+        continue;
+      }
+      i++;
+    }
+  }
+}
+
+void
+extent_log::replay(const std::string &batch, inode_manager *im)
+{
+  size_t pos = 0;
+  while (pos + sizeof(log_entry) <= batch.size()) {
+    log_entry e;
+    memcpy(&e, batch.data() + pos, sizeof(e));
+    pos += sizeof(e);
+    VERIFY(pos + e.len <= batch.size());
+    im->write_block_range(e.id, e.off, e.len, batch.data() + pos);
+    pos += e.len;
+  }
+}
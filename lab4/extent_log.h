@@ -0,0 +1,49 @@
+// shipping of extent_server disk writes to read replicas.
+
+#ifndef extent_log_h
+#define extent_log_h
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "inode_manager.h"
+#include "rpc.h"
+
+// A batch is shipped at least this often, empty if need be, so that
+// a replica can tell how far behind it may be.
+#define REPLICA_HEARTBEAT_MS 100
+// A replica refuses reads once it has heard nothing for this long.
+#define REPLICA_STALE_MS     1000
+// Writers on the primary wait while this much is unshipped.
+#define REPLICA_MAX_PENDING  (4 * 1024 * 1024)
+
+// Nothing reads the on-disk block bitmap back, so bits flipped by
+// sections of different threads may reach a replica out of order.
+//
+// Primary side. Collects the disk writes of an inode_manager and
+// ships them in order to every replica with the replicate RPC. The
+// writes of one section (see disk_log) are queued together, so each
+// batch holds whole operations. A replica that fails a call is
+// dropped for good; it has to be restarted along with the primary.
+class extent_log : public disk_log {
+ private:
+  std::vector<rpcc *> replicas;
+  pthread_mutex_t m;
+  pthread_cond_t ready; // pending is not empty
+  pthread_cond_t room;  // pending has shrunk below REPLICA_MAX_PENDING
+  std::string pending;
+  unsigned long long seq;
+  void queue(const std::string &entries);
+  void shipper();
+
+ public:
+  extent_log(const std::vector<std::string> &replicas);
+  void write(uint32_t id, uint32_t off, uint32_t len, const char *buf);
+  void begin();
+  void end();
+
+  // Replica side: apply a shipped batch to im.
+  static void replay(const std::string &batch, inode_manager *im);
+};
+
+#endif
@@ -7,11 +7,19 @@
 
 typedef uint32_t blockid_t;
 
+// With several extent_servers, extent and block ids carry the number
+// of the server that owns them above EXTENT_SHARD_SHIFT. Server 0's
+// ids are plain local numbers, so a single server sees no change.
+#define EXTENT_SHARD_SHIFT 24
+#define EXTENT_MAX_SHARDS  128
+#define EXTENT_SHARD(id)   ((unsigned)((id) >> EXTENT_SHARD_SHIFT) & (EXTENT_MAX_SHARDS - 1))
+#define EXTENT_LOCAL(id)   ((id) & ((1u << EXTENT_SHARD_SHIFT) - 1))
+
 class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, STALE };
   enum rpc_numbers {
     put = 0x6001,
     get,
@@ -22,7 +30,17 @@ class extent_protocol {
     read_block,
     write_block,
     append_block,
-    complete
+    complete,
+    getattr_many,
+    get_many,
+    remove_many,
+    read_block_range,
+    write_block_range,
+    append,
+    truncate,
+    copy_range,
+    remove_tree,
+    replicate
   };
 
   enum types {
@@ -38,6 +56,17 @@ class extent_protocol {
     unsigned int ctime;
     unsigned int size;
   };
+
+  // one entry of a getattr_many or get_many reply; a and buf are only
+  // meaningful when status is OK
+  struct attr_entry {
+    status st;
+    attr a;
+  };
+  struct buf_entry {
+    status st;
+    std::string buf;
+  };
 };
 
 inline unmarshall &
@@ -62,4 +91,74 @@ operator<<(marshall &m, extent_protocol::attr a)
   return m;
 }
 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::attr_entry &e)
+{
+  u >> e.st;
+  u >> e.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::attr_entry &e)
+{
+  m << e.st;
+  m << e.a;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::buf_entry &e)
+{
+  u >> e.st;
+  u >> e.buf;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::buf_entry &e)
+{
+  m << e.st;
+  m << e.buf;
+  return m;
+}
+
+// the server's replies are marshalled after their buffers are gone, so
+// large ones must be moved in, as marshall_move does for std::string
+inline void
+marshall_move(marshall &m, extent_protocol::buf_entry &e)
+{
+  m << e.st;
+  marshall_move(m, e.buf);
+}
+
+// Argument and reply types of each procedure, checked at compile time
+// by rpcc::call and rpcs::reg. Data payloads are strviews, so the
+// server reads them in place and clients pass std::strings.
+class extent_rpc {
+ public:
+  typedef extent_protocol P;
+  typedef P::extentid_t eid;
+  typedef rpc_proc<P::put, int, eid, strview> put;
+  typedef rpc_proc<P::get, std::string, eid> get;
+  typedef rpc_proc<P::getattr, P::attr, eid> getattr;
+  typedef rpc_proc<P::remove, int, eid> remove;
+  typedef rpc_proc<P::create, eid, uint32_t> create;
+  typedef rpc_proc<P::get_block_ids, std::list<blockid_t>, eid> get_block_ids;
+  typedef rpc_proc<P::read_block, std::string, blockid_t> read_block;
+  typedef rpc_proc<P::write_block, int, blockid_t, strview> write_block;
+  typedef rpc_proc<P::append_block, blockid_t, eid> append_block;
+  typedef rpc_proc<P::complete, int, eid, uint32_t> complete;
+  typedef rpc_proc<P::getattr_many, std::vector<P::attr_entry>, std::vector<eid> > getattr_many;
+  typedef rpc_proc<P::get_many, std::vector<P::buf_entry>, std::vector<eid> > get_many;
+  typedef rpc_proc<P::remove_many, int, std::vector<eid> > remove_many;
+  typedef rpc_proc<P::read_block_range, std::string, blockid_t, uint32_t, uint32_t> read_block_range;
+  typedef rpc_proc<P::write_block_range, int, blockid_t, uint32_t, strview> write_block_range;
+  typedef rpc_proc<P::append, int, eid, strview> append;
+  typedef rpc_proc<P::truncate, int, eid, uint32_t> truncate;
+  typedef rpc_proc<P::copy_range, uint32_t, eid, uint32_t, eid, uint32_t, uint32_t> copy_range;
+  typedef rpc_proc<P::remove_tree, int, eid> remove_tree;
+  typedef rpc_proc<P::replicate, int, unsigned long long, std::string> replicate;
+};
+
 #endif
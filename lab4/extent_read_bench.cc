@@ -0,0 +1,86 @@
+// Read throughput of the extent service, to compare configs with
+// different numbers of read replicas.
+//
+// usage: extent_read_bench <extent_server or config> [threads] [seconds]
+//
+// Writes one file through the primary, waits for it to reach the
+// replicas, then has every thread get and getattr it with stale reads
+// allowed, so the reads are spread over the primary and its replicas.
+
+#include "extent_client.h"
+#include "extent_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <atomic>
+
+static extent_client *ec;
+static extent_protocol::extentid_t eid;
+static volatile bool done;
+static std::atomic<long> reads(0);
+
+static void *
+worker(void *)
+{
+  std::string buf;
+  extent_protocol::attr a;
+  long n = 0;
+  while (!done) {
+    if (ec->get(eid, buf) != extent_protocol::OK ||
+        ec->getattr(eid, a) != extent_protocol::OK) {
+      printf("read failed\n");
+      exit(1);
+    }
+    n += 2;
+  }
+  reads += n;
+  return NULL;
+}
+
+static double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nthreads = 8;
+  int secs = 5;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <extent_server or config> [threads] [seconds]\n", argv[0]);
+    exit(1);
+  }
+  if (argc > 2)
+    nthreads = atoi(argv[2]);
+  if (argc > 3)
+    secs = atoi(argv[3]);
+
+  ec = new extent_client(argv[1]);
+  if (ec->create(extent_protocol::T_FILE, eid) != extent_protocol::OK ||
+      ec->put(eid, std::string(4096, 'x')) != extent_protocol::OK) {
+    printf("cannot write the test file\n");
+    exit(1);
+  }
+  usleep(2 * REPLICA_HEARTBEAT_MS * 1000);
+  ec->allow_stale_reads(true);
+
+  pthread_t th[nthreads];
+  double start = now();
+  for (int i = 0; i < nthreads; i++)
+    pthread_create(&th[i], NULL, worker, NULL);
+  sleep(secs);
+  done = true;
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(th[i], NULL);
+  double elapsed = now() - start;
+
+  printf("threads\treads/s\n%d\t%.0f\n", nthreads, reads / elapsed);
+  return 0;
+}
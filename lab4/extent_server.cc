@@ -2,48 +2,117 @@
 
 #include "extent_server.h"
 #include <sstream>
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include "threader.h"
+#include "extent_client.h"
+#include "extent_log.h"
+#include "lang/verify.h"
+#include "alog.h"
 
-extent_server::extent_server() 
+extent_server::extent_server(unsigned shard, std::string config, bool replica)
+  : shard(shard), config(config), peers(NULL), replica(replica),
+    apply_q(16), applied_seq(0)
 {
   im = new inode_manager();
+  VERIFY(pthread_rwlock_init(&replica_lock, NULL) == 0);
+  VERIFY(pthread_mutex_init(&replica_m, NULL) == 0);
+  memset(&synced, 0, sizeof(synced));
+
+  if (replica) {
+    NewThread(this, &extent_server::applier);
+  } else {
+    // a primary ships its writes to the replicas the config lists
+    // for its shard.
+    std::vector<extent_config_line> lines;
+    std::vector<std::string> dsts;
+    if (!config.empty() && read_extent_config(config, lines)) {
+      for (size_t i = 0; i < lines.size(); i++)
+        if (lines[i].replica && lines[i].shard == shard)
+          dsts.push_back(lines[i].dst);
+    }
+    if (!dsts.empty())
+      im->set_log(new extent_log(dsts));
+  }
+  NewThread(this, &extent_server::reaper);
+  NewThread(this, &extent_server::forwarder);
 }
 
+// A replica only changes through replicate(), so every call that
+// would write to it is refused.
+
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 {
+  if (replica)
+    return extent_protocol::IOERR;
   // alloc a new inode and return inum
-  printf("extent_server: create inode\n");
+  alog(JSL_DBG_4, "extent_server: create inode\n");
   id = im->alloc_inode(type);
+  if (id != 0)
+    id = global(id);
 
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+int extent_server::put(extent_protocol::extentid_t id, strview buf, int &)
 {
-  id &= 0x7fffffff;
+  if (replica)
+    return extent_protocol::IOERR;
+  id = EXTENT_LOCAL(id);
   
-  const char * cbuf = buf.c_str();
-  int size = buf.size();
-  im->write_file(id, cbuf, size);
+  im->write_file(id, buf.data, buf.size);
   
   return extent_protocol::OK;
 }
 
+int extent_server::append(extent_protocol::extentid_t id, strview buf, int &)
+{
+  if (replica)
+    return extent_protocol::IOERR;
+  id = EXTENT_LOCAL(id);
+
+  return im->append_file(id, buf.data, buf.size);
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id, uint32_t size, int &)
+{
+  if (replica)
+    return extent_protocol::IOERR;
+  id = EXTENT_LOCAL(id);
+
+  return im->truncate_file(id, size);
+}
+
+int extent_server::copy_range(extent_protocol::extentid_t src, uint32_t src_off,
+                              extent_protocol::extentid_t dst, uint32_t dst_off,
+                              uint32_t len, uint32_t &copied)
+{
+  if (replica)
+    return extent_protocol::IOERR;
+  src = EXTENT_LOCAL(src);
+  dst = EXTENT_LOCAL(dst);
+
+  return im->copy_range(src, src_off, dst, dst_off, len, copied);
+}
+
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 {
-  printf("extent_server: get %lld\n", id);
+  alog(JSL_DBG_4, "extent_server: get %lld\n", id);
 
-  id &= 0x7fffffff;
+  id = EXTENT_LOCAL(id);
 
   int size = 0;
   char *cbuf = NULL;
 
+  if (!read_begin())
+    return extent_protocol::STALE;
   im->read_file(id, &cbuf, &size);
+  read_end();
   if (size == 0)
     buf = "";
   else {
@@ -56,13 +125,16 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
-  printf("extent_server: getattr %lld\n", id);
+  alog(JSL_DBG_4, "extent_server: getattr %lld\n", id);
 
-  id &= 0x7fffffff;
+  id = EXTENT_LOCAL(id);
   
   extent_protocol::attr attr;
   memset(&attr, 0, sizeof(attr));
+  if (!read_begin())
+    return extent_protocol::STALE;
   im->getattr(id, attr);
+  read_end();
   a = attr;
 
   return extent_protocol::OK;
@@ -70,9 +142,11 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
 
 int extent_server::remove(extent_protocol::extentid_t id, int &)
 {
-  printf("extent_server: write %lld\n", id);
+  if (replica)
+    return extent_protocol::IOERR;
+  alog(JSL_DBG_4, "extent_server: write %lld\n", id);
 
-  id &= 0x7fffffff;
+  id = EXTENT_LOCAL(id);
   im->remove_file(id);
  
   return extent_protocol::OK;
@@ -80,45 +154,286 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
 
 int extent_server::append_block(extent_protocol::extentid_t id, blockid_t &bid)
 {
-  id &= 0x7fffffff;
+  if (replica)
+    return extent_protocol::IOERR;
+  id = EXTENT_LOCAL(id);
 
   im->append_block(id, bid);
+  if (bid != 0)
+    bid = global(bid);
 
   return extent_protocol::OK;
 }
 
 int extent_server::get_block_ids(extent_protocol::extentid_t id, std::list<blockid_t> &block_ids)
 {
-  id &= 0x7fffffff;
+  id = EXTENT_LOCAL(id);
 
+  if (!read_begin())
+    return extent_protocol::STALE;
   im->get_block_ids(id, block_ids);
+  read_end();
+  for (std::list<blockid_t>::iterator it = block_ids.begin(); it != block_ids.end(); it++)
+    *it = global(*it);
 
   return extent_protocol::OK;
 }
 
+// Block payloads are read straight into the reply and written straight
+// from the request; the RPC layer neither copies them on the way out
+// nor into a std::string on the way in.
 int extent_server::read_block(blockid_t id, std::string &buf)
 {
-  char _buf[BLOCK_SIZE];
+  buf.resize(BLOCK_SIZE);
+  id = EXTENT_LOCAL(id);
+  if (!read_begin())
+    return extent_protocol::STALE;
+  im->read_block(id, &buf[0]);
+  read_end();
 
-  im->read_block(id, _buf);
-  buf.assign(_buf, BLOCK_SIZE);
+  return extent_protocol::OK;
+}
+
+int extent_server::write_block(blockid_t id, strview buf, int &)
+{
+  if (replica)
+    return extent_protocol::IOERR;
+  if (buf.size != BLOCK_SIZE)
+    return extent_protocol::IOERR;
+
+  id = EXTENT_LOCAL(id);
+  im->write_block(id, buf.data);
+
+  return extent_protocol::OK;
+}
+
+// Partial block I/O. A read past the end of the block is cut short,
+// a write past it is refused.
+int extent_server::read_block_range(blockid_t id, uint32_t off, uint32_t len, std::string &buf)
+{
+  if (off >= BLOCK_SIZE) {
+    buf.clear();
+    return extent_protocol::OK;
+  }
+  if (len > BLOCK_SIZE - off)
+    len = BLOCK_SIZE - off;
+
+  buf.resize(len);
+  id = EXTENT_LOCAL(id);
+  if (!read_begin())
+    return extent_protocol::STALE;
+  im->read_block_range(id, off, len, &buf[0]);
+  read_end();
 
   return extent_protocol::OK;
 }
 
-int extent_server::write_block(blockid_t id, std::string buf, int &)
+int extent_server::write_block_range(blockid_t id, uint32_t off, strview buf, int &)
 {
-  if (buf.size() != BLOCK_SIZE)
+  if (replica)
+    return extent_protocol::IOERR;
+  if (off > BLOCK_SIZE || buf.size > BLOCK_SIZE - off)
     return extent_protocol::IOERR;
 
-  im->write_block(id, (const char *) buf.data());
+  id = EXTENT_LOCAL(id);
+  im->write_block_range(id, off, buf.size, buf.data);
 
   return extent_protocol::OK;
 }
 
 int extent_server::complete(extent_protocol::extentid_t eid, uint32_t size, int &)
 {
-  im->complete(eid, size);
+  if (replica)
+    return extent_protocol::IOERR;
+  im->complete(EXTENT_LOCAL(eid), size);
+  return extent_protocol::OK;
+}
+
+
+// Batched variants, so that callers walking many inodes pay one
+// round trip instead of one per inode. Each id gets its own status:
+// NOENT for a free inode, so one extent deleted under a caller does
+// not fail the rest of its batch.
+
+int extent_server::getattr_many(std::vector<extent_protocol::extentid_t> ids,
+                                std::vector<extent_protocol::attr_entry> &es)
+{
+  es.resize(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    es[i].st = getattr(ids[i], es[i].a);
+    // a replica too far behind answers for none of them
+    if (es[i].st == extent_protocol::STALE)
+      return extent_protocol::STALE;
+    if (es[i].st == extent_protocol::OK && es[i].a.type == 0)
+      es[i].st = extent_protocol::NOENT;
+  }
+
   return extent_protocol::OK;
 }
 
+int extent_server::get_many(std::vector<extent_protocol::extentid_t> ids,
+                            std::vector<extent_protocol::buf_entry> &es)
+{
+  es.resize(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    extent_protocol::attr a;
+    es[i].st = getattr(ids[i], a);
+    if (es[i].st == extent_protocol::OK && a.type == 0)
+      es[i].st = extent_protocol::NOENT;
+    if (es[i].st == extent_protocol::OK)
+      es[i].st = get(ids[i], es[i].buf);
+    if (es[i].st == extent_protocol::STALE)
+      return extent_protocol::STALE;
+  }
+
+  return extent_protocol::OK;
+}
+
+int extent_server::remove_many(std::vector<extent_protocol::extentid_t> ids, int &)
+{
+  if (replica)
+    return extent_protocol::IOERR;
+  int r;
+  for (size_t i = 0; i < ids.size(); i++)
+    remove(ids[i], r);
+
+  return extent_protocol::OK;
+}
+
+// Hand the subtree rooted at id to the reaper. The caller has already
+// unlinked id from its parent, so nothing can reach the subtree and
+// the reply does not wait for it to be freed.
+int extent_server::remove_tree(extent_protocol::extentid_t id, int &)
+{
+  if (replica)
+    return extent_protocol::IOERR;
+  reap_q.enq(id);
+
+  return extent_protocol::OK;
+}
+
+// Free queued subtrees one inode at a time. The children of a
+// directory are queued before the directory itself is freed;
+// children owned by another server are handed to forwarder().
+void extent_server::reaper()
+{
+  while (true) {
+    extent_protocol::extentid_t id;
+    reap_q.deq(&id);
+
+    if (EXTENT_SHARD(id) != shard) {
+      forward_q.enq(id);
+      continue;
+    }
+    id = EXTENT_LOCAL(id);
+
+    extent_protocol::attr a;
+    memset(&a, 0, sizeof(a));
+    im->getattr(id, a);
+    if (a.type == extent_protocol::T_DIR) {
+      char *cbuf = NULL;
+      int size = 0;
+      im->read_file(id, &cbuf, &size);
+      int pos = 0;
+      while (pos < size) {
+        int len = strlen(cbuf + pos);
+        reap_q.enq(*(uint32_t *)(cbuf + pos + len + 1));
+        pos += len + 1 + sizeof(uint32_t);
+      }
+      free(cbuf);
+    }
+    im->remove_file(id);
+  }
+}
+
+// Hand subtrees to the server owning them. One that cannot be handed
+// over goes to the back of the queue and is tried again, after a
+// pause that doubles with each failure in a row, up to a minute.
+void extent_server::forwarder()
+{
+  unsigned backoff = 0;
+  while (true) {
+    extent_protocol::extentid_t id;
+    forward_q.deq(&id);
+
+    if (peers == NULL && !config.empty())
+      peers = new extent_client(config);
+    int ret = peers == NULL ? extent_protocol::IOERR : peers->remove_tree(id);
+    if (ret == extent_protocol::OK) {
+      backoff = 0;
+      continue;
+    }
+    // a server that was down when peers was made is never bound to;
+    // make a new client to try again
+    if (ret == rpc_const::bind_failure) {
+      delete peers;
+      peers = NULL;
+    }
+    backoff = backoff == 0 ? 1 : std::min(backoff * 2, 60u);
+    alog(JSL_DBG_2, "extent_server: cannot reap %llu on shard %u, retrying in %us\n", id, EXTENT_SHARD(id), backoff);
+    forward_q.enq(id);
+    sleep(backoff);
+  }
+}
+
+// Replica side of log shipping; see extent_log.h. Batches must come
+// in order, a gap means this replica has missed writes for good.
+int extent_server::replicate(unsigned long long seq, std::string batch, int &)
+{
+  if (!replica)
+    return extent_protocol::IOERR;
+
+  pthread_mutex_lock(&replica_m);
+  if (seq != applied_seq + 1) {
+    alog(JSL_DBG_2, "extent_server: replica got batch %llu after %llu\n", seq, applied_seq);
+    pthread_mutex_unlock(&replica_m);
+    return extent_protocol::IOERR;
+  }
+  applied_seq = seq;
+  pthread_mutex_unlock(&replica_m);
+
+  apply_q.enq(batch);
+  return extent_protocol::OK;
+}
+
+void extent_server::applier()
+{
+  while (true) {
+    std::string batch;
+    apply_q.deq(&batch);
+
+    pthread_rwlock_wrlock(&replica_lock);
+    extent_log::replay(batch, im);
+    pthread_rwlock_unlock(&replica_lock);
+
+    pthread_mutex_lock(&replica_m);
+    gettimeofday(&synced, NULL);
+    pthread_mutex_unlock(&replica_m);
+  }
+}
+
+// Reads on a replica wait out the batch being applied, and are
+// refused once the primary has not been heard from for a while.
+bool extent_server::read_begin()
+{
+  if (!replica)
+    return true;
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  pthread_mutex_lock(&replica_m);
+  long long lag = (now.tv_sec - synced.tv_sec) * 1000LL +
+                  (now.tv_usec - synced.tv_usec) / 1000;
+  pthread_mutex_unlock(&replica_m);
+  if (lag > REPLICA_STALE_MS)
+    return false;
+
+  pthread_rwlock_rdlock(&replica_lock);
+  return true;
+}
+
+void extent_server::read_end()
+{
+  if (replica)
+    pthread_rwlock_unlock(&replica_lock);
+}
@@ -6,8 +6,14 @@
 #include <string>
 #include <map>
 #include <list>
+#include <vector>
+#include <pthread.h>
+#include <sys/time.h>
 #include "extent_protocol.h"
 #include "inode_manager.h"
+#include "fifo.h"
+
+class extent_client;
 
 class extent_server {
  protected:
@@ -20,19 +26,62 @@ class extent_server {
 #endif
   inode_manager *im;
 
+  // this server's number among several, and the config file naming
+  // the others; see extent_client.h. Ids on the wire carry the shard,
+  // ids handed to im do not.
+  unsigned shard;
+  std::string config;
+  extent_client *peers;
+  extent_protocol::extentid_t global(extent_protocol::extentid_t id) {
+    return id | ((extent_protocol::extentid_t)shard << EXTENT_SHARD_SHIFT);
+  }
+
+  // read replica state: batches from the primary are queued by
+  // replicate() and applied by applier() under the write side of
+  // replica_lock; reads hold the read side.
+  bool replica;
+  fifo<std::string> apply_q;
+  pthread_rwlock_t replica_lock;
+  pthread_mutex_t replica_m;
+  unsigned long long applied_seq;
+  struct timeval synced; // when the last batch was applied
+  void applier();
+  bool read_begin();
+  void read_end();
+
+  // inodes of deleted subtrees, waiting to be reclaimed by reaper()
+  fifo<extent_protocol::extentid_t> reap_q;
+  void reaper();
+  // subtree roots owned by other shards, kept by forwarder() until
+  // their server has taken them
+  fifo<extent_protocol::extentid_t> forward_q;
+  void forwarder();
+
  public:
-  extent_server();
+  extent_server(unsigned shard = 0, std::string config = "", bool replica = false);
 
   int create(uint32_t type, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, int &);
+  int put(extent_protocol::extentid_t id, strview, int &);
+  int append(extent_protocol::extentid_t id, strview, int &);
+  int truncate(extent_protocol::extentid_t id, uint32_t size, int &);
+  int copy_range(extent_protocol::extentid_t src, uint32_t src_off,
+                 extent_protocol::extentid_t dst, uint32_t dst_off,
+                 uint32_t len, uint32_t &copied);
   int get(extent_protocol::extentid_t id, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
   int get_block_ids(extent_protocol::extentid_t id, std::list<blockid_t> &);
   int read_block(blockid_t id, std::string &buf);
-  int write_block(blockid_t id, std::string buf, int &);
+  int write_block(blockid_t id, strview buf, int &);
+  int read_block_range(blockid_t id, uint32_t off, uint32_t len, std::string &buf);
+  int write_block_range(blockid_t id, uint32_t off, strview buf, int &);
   int append_block(extent_protocol::extentid_t eid, blockid_t &bid);
   int complete(extent_protocol::extentid_t eid, uint32_t size, int &);
+  int getattr_many(std::vector<extent_protocol::extentid_t> ids, std::vector<extent_protocol::attr_entry> &);
+  int get_many(std::vector<extent_protocol::extentid_t> ids, std::vector<extent_protocol::buf_entry> &);
+  int remove_many(std::vector<extent_protocol::extentid_t> ids, int &);
+  int remove_tree(extent_protocol::extentid_t id, int &);
+  int replicate(unsigned long long seq, std::string batch, int &);
 };
 
 #endif 
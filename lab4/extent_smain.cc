@@ -10,9 +10,33 @@ int
 main(int argc, char *argv[])
 {
   int count = 0;
+  unsigned shard = 0;
+  std::string config;
+  bool replica = false;
+  int ch;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  // -s: this server's shard number, -c: config file naming every
+  // shard's server and replica, needed when a deleted directory spans
+  // servers and for a primary to find its replicas. -R: serve as a
+  // read replica of the shard's primary.
+  while((ch = getopt(argc, argv, "s:c:R")) != -1){
+    switch(ch){
+    case 's':
+      shard = atoi(optarg);
+      break;
+    case 'c':
+      config = optarg;
+      break;
+    case 'R':
+      replica = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s shard] [-c config] [-R] port\n", argv[0]);
+      exit(1);
+    }
+  }
+  if(optind != argc - 1 || shard >= EXTENT_MAX_SHARDS){
+    fprintf(stderr, "Usage: %s [-s shard] [-c config] [-R] port\n", argv[0]);
     exit(1);
   }
 
@@ -23,19 +47,29 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
-  rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  rpcs server(atoi(argv[optind]), count);
+  extent_server ls(shard, config, replica);
 
-  server.reg(extent_protocol::get, &ls, &extent_server::get);
-  server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
-  server.reg(extent_protocol::put, &ls, &extent_server::put);
-  server.reg(extent_protocol::remove, &ls, &extent_server::remove);
-  server.reg(extent_protocol::create, &ls, &extent_server::create);
-  server.reg(extent_protocol::get_block_ids, &ls, &extent_server::get_block_ids);
-  server.reg(extent_protocol::read_block, &ls, &extent_server::read_block);
-  server.reg(extent_protocol::write_block, &ls, &extent_server::write_block);
-  server.reg(extent_protocol::append_block, &ls, &extent_server::append_block);
-  server.reg(extent_protocol::complete, &ls, &extent_server::complete);
+  server.reg(extent_rpc::get(), &ls, &extent_server::get);
+  server.reg(extent_rpc::getattr(), &ls, &extent_server::getattr);
+  server.reg(extent_rpc::put(), &ls, &extent_server::put);
+  server.reg(extent_rpc::append(), &ls, &extent_server::append);
+  server.reg(extent_rpc::truncate(), &ls, &extent_server::truncate);
+  server.reg(extent_rpc::copy_range(), &ls, &extent_server::copy_range);
+  server.reg(extent_rpc::remove(), &ls, &extent_server::remove);
+  server.reg(extent_rpc::create(), &ls, &extent_server::create);
+  server.reg(extent_rpc::get_block_ids(), &ls, &extent_server::get_block_ids);
+  server.reg(extent_rpc::read_block(), &ls, &extent_server::read_block);
+  server.reg(extent_rpc::write_block(), &ls, &extent_server::write_block);
+  server.reg(extent_rpc::read_block_range(), &ls, &extent_server::read_block_range);
+  server.reg(extent_rpc::write_block_range(), &ls, &extent_server::write_block_range);
+  server.reg(extent_rpc::append_block(), &ls, &extent_server::append_block);
+  server.reg(extent_rpc::complete(), &ls, &extent_server::complete);
+  server.reg(extent_rpc::getattr_many(), &ls, &extent_server::getattr_many);
+  server.reg(extent_rpc::get_many(), &ls, &extent_server::get_many);
+  server.reg(extent_rpc::remove_many(), &ls, &extent_server::remove_many);
+  server.reg(extent_rpc::remove_tree(), &ls, &extent_server::remove_tree);
+  server.reg(extent_rpc::replicate(), &ls, &extent_server::replicate);
 
   while(1)
     sleep(1000);
@@ -17,6 +17,7 @@
 #include <arpa/inet.h>
 #include "lang/verify.h"
 #include "yfs_client.h"
+#include "alog.h"
 
 int myid;
 yfs_client *yfs;
@@ -45,7 +46,7 @@ getattr(yfs_client::inum inum, struct stat &st)
     bzero(&st, sizeof(st));
 
     st.st_ino = inum;
-    printf("getattr %016llx %d\n", inum, yfs->isfile(inum));
+    alog(JSL_DBG_4, "getattr %016llx %d\n", inum, yfs->isfile(inum));
     if(yfs->isfile(inum)){
         yfs_client::fileinfo info;
         ret = yfs->getfile(inum, info);
@@ -57,7 +58,7 @@ getattr(yfs_client::inum inum, struct stat &st)
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
         st.st_size = info.size;
-        printf("   getattr -> %llu\n", info.size);
+        alog(JSL_DBG_4, "   getattr -> %llu\n", info.size);
     } else if (yfs->issymlink(inum)){
         yfs_client::symlinkinfo info;
         ret = yfs->getsymlink(inum, info);
@@ -69,7 +70,7 @@ getattr(yfs_client::inum inum, struct stat &st)
         st.st_atime = info.atime;
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
-        printf("   getattr -> %llu\n", info.size);
+        alog(JSL_DBG_4, "   getattr -> %llu\n", info.size);
     } else {
         yfs_client::dirinfo info;
         ret = yfs->getdir(inum, info);
@@ -80,7 +81,7 @@ getattr(yfs_client::inum inum, struct stat &st)
         st.st_atime = info.atime;
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
-        printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
+        alog(JSL_DBG_4, "   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
     }
     return yfs_client::OK;
 }
@@ -133,16 +134,20 @@ void
 fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         int to_set, struct fuse_file_info *fi)
 {
-    printf("fuseserver_setattr 0x%x\n", to_set);
+    alog(JSL_DBG_4, "fuseserver_setattr 0x%x\n", to_set);
     if (FUSE_SET_ATTR_SIZE & to_set) {
-        printf("   fuseserver_setattr set size to %zu\n", attr->st_size);
+        alog(JSL_DBG_4, "   fuseserver_setattr set size to %zu\n", attr->st_size);
         struct stat st;
 
 #if 1
         // Change the above line to "#if 1", and your code goes here
         // Note: fill st using getattr before fuse_reply_attr
         if (to_set & FUSE_SET_ATTR_SIZE) {
-            yfs->setattr(ino, attr->st_size);
+            int r = yfs->setattr(ino, attr->st_size);
+            if (r != yfs_client::OK) {
+                fuse_reply_err(req, r == yfs_client::NOENT ? ENOENT : EIO);
+                return;
+            }
         }
         getattr(ino, st);
         fuse_reply_attr(req, &st, 0);
@@ -268,7 +273,7 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     yfs_client::status ret;
     if( (ret = fuseserver_createhelper( parent, name, mode, &e, extent_protocol::T_FILE)) == yfs_client::OK ) {
         fuse_reply_create(req, &e, fi);
-        printf("OK: create returns.\n");
+        alog(JSL_DBG_4, "OK: create returns.\n");
     } else {
         if (ret == yfs_client::EXIST) {
             fuse_reply_err(req, EEXIST);
@@ -350,38 +355,94 @@ int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
 }
 
 //
-// Retrieve all the file names / i-numbers pairs
-// in directory @ino. Send the reply using reply_buf_limited.
+// Encode every name / i-number pair of directory @inum into @b.
+// The byte offsets of the entries inside @b are the directory
+// cookies that the kernel hands back to us as @off.
 //
-// You can ignore @size and @off (except that you must pass
-// them to reply_buf_limited).
+yfs_client::status
+dirbuf_fill(struct dirbuf *b, yfs_client::inum inum)
+{
+    std::list<yfs_client::dirent> entries;
+    yfs_client::status ret;
+
+    if ((ret = yfs->readdir(inum, entries)) != yfs_client::OK)
+        return ret;
+    for (std::list<yfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        dirbuf_add(b, it->name.c_str(), (fuse_ino_t) it->inum);
+    }
+    return yfs_client::OK;
+}
+
 //
-// Call dirbuf_add(&b, name, inum) for each entry in the directory.
+// Open directory @ino. The encoded listing is kept in fi->fh
+// for the lifetime of the handle, so that a directory larger
+// than one fuse buffer is fetched once instead of once per page.
 //
 void
-fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-        off_t off, struct fuse_file_info *fi)
+fuseserver_opendir(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
 {
     yfs_client::inum inum = ino; // req->in.h.nodeid;
-    struct dirbuf b;
-
-    printf("fuseserver_readdir\n");
 
     if(!yfs->isdir(inum)){
         fuse_reply_err(req, ENOTDIR);
         return;
     }
 
-    memset(&b, 0, sizeof(b));
+    struct dirbuf *b = (struct dirbuf *) calloc(1, sizeof(struct dirbuf));
+    if(b == NULL){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uintptr_t) b;
+    fuse_reply_open(req, fi);
+}
 
-    std::list<yfs_client::dirent> entries;
-    yfs->readdir(inum, entries);
-    for (std::list<yfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
+//
+// Retrieve the file names / i-numbers pairs in directory @ino,
+// starting at cookie @off. Send the reply using reply_buf_limited.
+//
+// The listing is (re)built when a scan starts at offset 0 and
+// every later page resumes from the snapshot in fi->fh, which
+// makes a full scan linear in the size of the directory.
+//
+void
+fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t off, struct fuse_file_info *fi)
+{
+    yfs_client::inum inum = ino; // req->in.h.nodeid;
+    struct dirbuf *b = (struct dirbuf *) (uintptr_t) fi->fh;
+
+    alog(JSL_DBG_4, "fuseserver_readdir\n");
+
+    if (b == NULL) {
+        fuse_reply_err(req, EBADF);
+        return;
     }
 
-    reply_buf_limited(req, b.p, b.size, off, size);
-    free(b.p);
+    if (off == 0) {
+        free(b->p);
+        memset(b, 0, sizeof(*b));
+        if (dirbuf_fill(b, inum) != yfs_client::OK) {
+            fuse_reply_err(req, EIO);
+            return;
+        }
+    }
+
+    reply_buf_limited(req, b->p, b->size, off, size);
+}
+
+void
+fuseserver_releasedir(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    struct dirbuf *b = (struct dirbuf *) (uintptr_t) fi->fh;
+
+    if (b) {
+        free(b->p);
+        free(b);
+    }
+    fuse_reply_err(req, 0);
 }
 
 
@@ -459,7 +520,7 @@ fuseserver_statfs(fuse_req_t req)
 {
     struct statvfs buf;
 
-    printf("statfs\n");
+    alog(JSL_DBG_4, "statfs\n");
 
     memset(&buf, 0, sizeof(buf));
 
@@ -547,7 +608,9 @@ main(int argc, char *argv[])
 
     fuseserver_oper.getattr    = fuseserver_getattr;
     fuseserver_oper.statfs     = fuseserver_statfs;
+    fuseserver_oper.opendir    = fuseserver_opendir;
     fuseserver_oper.readdir    = fuseserver_readdir;
+    fuseserver_oper.releasedir = fuseserver_releasedir;
     fuseserver_oper.lookup     = fuseserver_lookup;
     fuseserver_oper.create     = fuseserver_create;
     fuseserver_oper.mknod      = fuseserver_mknod;
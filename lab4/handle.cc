@@ -1,6 +1,7 @@
 #include "handle.h"
 #include <stdio.h>
-#include "tprintf.h"
+#include "alog.h"
+#include "slock.h"
 
 handle_mgr mgr;
 
@@ -22,18 +23,20 @@ handle::safebind()
   sockaddr_in dstsock;
   make_sockaddr(h->m.c_str(), &dstsock);
   rpcc *cl = new rpcc(dstsock);
-  tprintf("handler_mgr::get_handle trying to bind...%s\n", h->m.c_str());
+  if (h->nconns > 0)
+    cl->set_conns(h->nconns);
+  alog(JSL_DBG_3, "handler_mgr::get_handle trying to bind...%s\n", h->m.c_str());
   int ret;
   if (cl->islossy())
         ret = cl->bind();
   else
         ret = cl->bind(rpcc::to(1000));
   if (ret < 0) {
-    tprintf("handle_mgr::get_handle bind failure! %s %d\n", h->m.c_str(), ret);
+    alog(JSL_DBG_2, "handle_mgr::get_handle bind failure! %s %d\n", h->m.c_str(), ret);
     delete cl;
     h->del = true;
   } else {
-    tprintf("handle_mgr::get_handle bind succeeded %s\n", h->m.c_str());
+    alog(JSL_DBG_3, "handle_mgr::get_handle bind succeeded %s\n", h->m.c_str());
     h->cl = cl;
   }
   return h->cl;
@@ -59,6 +62,7 @@ handle_mgr::get_handle(std::string m)
     h->cl = NULL;
     h->del = false;
     h->refcnt = 1;
+    h->nconns = conns.count(m) ? conns[m] : 0;
     h->m = m;
     pthread_mutex_init(&h->cl_mutex, NULL);
     hmap[m] = h;
@@ -69,6 +73,22 @@ handle_mgr::get_handle(std::string m)
   return h;
 }
 
+// connections for the rpcc of m, now and
+// whenever it is made again
+void
+handle_mgr::set_conns(std::string m, int n)
+{
+  ScopedLock ml(&handle_mutex);
+  conns[m] = n;
+  if (hmap.find(m) != hmap.end()) {
+    struct hinfo *h = hmap[m];
+    ScopedLock cl(&h->cl_mutex);
+    h->nconns = n;
+    if (h->cl)
+      h->cl->set_conns(n);
+  }
+}
+
 void 
 handle_mgr::done_handle(struct hinfo *h)
 {
@@ -90,9 +110,9 @@ void
 handle_mgr::delete_handle_wo(std::string m)
 {
   if (hmap.find(m) == hmap.end()) {
-    tprintf("handle_mgr::delete_handle_wo: cl %s isn't in cl list\n", m.c_str());
+    alog(JSL_DBG_3, "handle_mgr::delete_handle_wo: cl %s isn't in cl list\n", m.c_str());
   } else {
-    tprintf("handle_mgr::delete_handle_wo: cl %s refcnt %d\n", m.c_str(),
+    alog(JSL_DBG_3, "handle_mgr::delete_handle_wo: cl %s refcnt %d\n", m.c_str(),
 	   hmap[m]->refcnt);
     struct hinfo *h = hmap[m];
     if (h->refcnt == 0) {
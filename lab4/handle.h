@@ -19,6 +19,11 @@
 // safebind() just returns the previously
 // created rpcc*. best not to hold any
 // mutexes while calling safebind().
+//
+// mgr.set_conns(cid, n) makes the rpcc for
+// cid spread its calls over n connections
+// (see rpcc::set_conns()), e.g. so block
+// transfers do not delay lock RPCs.
 
 #ifndef handle_h
 #define handle_h
@@ -31,6 +36,7 @@ struct hinfo {
   rpcc *cl;
   int refcnt;
   bool del;
+  int nconns;  // 0 leaves the rpcc's default
   std::string m;
   pthread_mutex_t cl_mutex;
 };
@@ -66,9 +72,11 @@ class handle_mgr {
  private:
   pthread_mutex_t handle_mutex;
   std::map<std::string, struct hinfo *> hmap;
+  std::map<std::string, int> conns;
  public:
   handle_mgr();
   struct hinfo *get_handle(std::string m);
+  void set_conns(std::string m, int n);
   void done_handle(struct hinfo *h);
   void delete_handle(std::string m);
   void delete_handle_wo(std::string m);
@@ -2,10 +2,15 @@
 #include <cstring>
 #include <ctime>
 #include <pthread.h>
+#include "alog.h"
+#include "lang/verify.h"
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
 
 // disk layer -----------------------------------------
 
 disk::disk()
+  : log(NULL)
 {
   bzero(blocks, sizeof(blocks));
 }
@@ -21,7 +26,7 @@ disk::read_block(blockid_t id, char *buf)
    *hint: use memcpy
   */
   if (id < 0 || id >= BLOCK_NUM || buf == NULL) {
-    printf("\tim: error! invalid blockid %d\n", id);
+    alog(JSL_DBG_2, "\tim: error! invalid blockid %d\n", id);
     return;
   }
 
@@ -36,15 +41,132 @@ disk::write_block(blockid_t id, const char *buf)
    *hint: just like read_block
   */
   if (id < 0 || id >= BLOCK_NUM || buf == NULL) {
-    printf("\tim: error! invalid blockid %d\n", id);
+    alog(JSL_DBG_2, "\tim: error! invalid blockid %d\n", id);
     return;
   }
 
   std::memcpy(blocks[id], buf, BLOCK_SIZE);
+  if (log != NULL)
+    log->write(id, 0, BLOCK_SIZE, buf);
+}
+
+// Copy len bytes at off within block id, so callers touching part of
+// a block do not have to move the whole of it.
+void
+disk::read_range(blockid_t id, uint32_t off, uint32_t len, char *buf)
+{
+  if (id >= BLOCK_NUM || buf == NULL || off > BLOCK_SIZE || len > BLOCK_SIZE - off) {
+    alog(JSL_DBG_2, "\tim: error! invalid range %u+%u of block %d\n", off, len, id);
+    return;
+  }
+
+  std::memcpy(buf, blocks[id] + off, len);
+}
+
+void
+disk::write_range(blockid_t id, uint32_t off, uint32_t len, const char *buf)
+{
+  if (id >= BLOCK_NUM || buf == NULL || off > BLOCK_SIZE || len > BLOCK_SIZE - off) {
+    alog(JSL_DBG_2, "\tim: error! invalid range %u+%u of block %d\n", off, len, id);
+    return;
+  }
+
+  std::memcpy(blocks[id] + off, buf, len);
+  if (log != NULL)
+    log->write(id, off, len, buf);
+}
+
+// allocation -----------------------------------------
+
+shard_allocator::shard_allocator(uint32_t _first, uint32_t end)
+  : used(end - _first, 0), first(_first)
+{
+  uint32_t per = (end - first + ALLOC_SHARDS - 1) / ALLOC_SHARDS;
+  for (int i = 0; i < ALLOC_SHARDS; ++i) {
+    pthread_mutex_init(&shards[i].m, NULL);
+    shards[i].first = MIN(first + i * per, end);
+    shards[i].end = MIN(shards[i].first + per, end);
+    shards[i].next = shards[i].first;
+  }
+}
+
+// Take the first free id at or after the shard's hint, wrapping
+// around once. The caller holds s.m.
+uint32_t
+shard_allocator::alloc_in(struct shard &s)
+{
+  for (uint32_t n = 0; n < s.end - s.first; ++n) {
+    uint32_t id = s.next + n;
+    if (id >= s.end)
+      id -= s.end - s.first;
+    if (!used[id - first]) {
+      used[id - first] = 1;
+      s.next = id + 1 < s.end ? id + 1 : s.first;
+      return id;
+    }
+  }
+  return 0;
+}
+
+uint32_t
+shard_allocator::alloc()
+{
+  // first pass skips busy shards; the second waits for them, in case
+  // the only free ids are in a shard someone else was using.
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < ALLOC_SHARDS; ++i) {
+      struct shard &s = shards[i];
+      if (pass == 0) {
+        if (pthread_mutex_trylock(&s.m) != 0)
+          continue;
+      } else {
+        pthread_mutex_lock(&s.m);
+      }
+      uint32_t id = alloc_in(s);
+      pthread_mutex_unlock(&s.m);
+      if (id != 0)
+        return id;
+    }
+  }
+  return 0;
+}
+
+void
+shard_allocator::free(uint32_t id)
+{
+  uint32_t per = shards[0].end - shards[0].first;
+  struct shard &s = shards[(id - first) / per];
+  pthread_mutex_lock(&s.m);
+  used[id - first] = 0;
+  pthread_mutex_unlock(&s.m);
 }
 
 // block layer -----------------------------------------
 
+// Stripes the calling thread holds exclusively, one bit each. The
+// writes made while any is held form one section of the disk log,
+// closed before the last of them is released. Blocks and inodes freed
+// in a section only go back to their allocator once it is closed, so
+// that a new owner's writes cannot be logged ahead of the free.
+static thread_local uint64_t write_stripes;
+static thread_local std::vector<uint32_t> freed_blocks;
+static thread_local std::vector<uint32_t> freed_inodes;
+
+// Set or clear the bit of block id in the on-disk bitmap.
+void
+block_manager::mark_block(uint32_t id, bool used)
+{
+  unsigned char byte;
+  uint32_t off = (id % BPB) >> 3;
+  unsigned char mask = 1 << (7 - ((id % BPB) & 0x7));
+
+  pthread_mutex_lock(&bitmap_mutex);
+  d->read_range(BBLOCK(id), off, 1, (char *)&byte);
+  byte = used ? (byte | mask) : (byte & ~mask);
+  d->write_range(BBLOCK(id), off, 1, (const char *)&byte);
+  pthread_mutex_unlock(&bitmap_mutex);
+}
+
 // Allocate a free disk block.
 blockid_t
 block_manager::alloc_block()
@@ -54,29 +176,37 @@ block_manager::alloc_block()
    * note: you should mark the corresponding bit in block bitmap when alloc.
    * you need to think about which block you can start to be allocated.
    */
-  // use lock to ensure allocation is thread-safe
-  pthread_mutex_lock(&bitmap_mutex);
-  char buf[BLOCK_SIZE];
-  blockid_t cur = 0;
-  while (cur < sb.nblocks) {
-    read_block(BBLOCK(cur), buf);
-    for (int i = 0; i < BLOCK_SIZE && cur < sb.nblocks; ++i) {
-      unsigned char mask = 0x80;
-      while (mask > 0 && cur < sb.nblocks) {
-        if ((buf[i] & mask) == 0) {
-          buf[i] = buf[i] | mask;
-          write_block(BBLOCK(cur), buf);
-          pthread_mutex_unlock(&bitmap_mutex);
-          return cur;
-        }
-        mask = mask >> 1;
-        ++cur;
-      }
-    }
+  blockid_t id = free_blocks->alloc();
+  if (id == 0) {
+    alog(JSL_DBG_2, "\tim: error! out of blocks\n");
+    exit(0);
   }
-  printf("\tim: error! out of blocks\n");
-  pthread_mutex_unlock(&bitmap_mutex);
-  exit(0);
+  mark_block(id, true);
+  return id;
+}
+
+// Reference count of block id, and setting it. Called with
+// bitmap_mutex held. Like the bitmap they are written to the disk, so
+// the log ships every change to them with the operation making it.
+uint16_t
+block_manager::get_refs(uint32_t id)
+{
+  uint16_t refs;
+  d->read_range(RBLOCK(id, sb.nblocks), (id % RPB) * sizeof(refs), sizeof(refs), (char *)&refs);
+  return refs;
+}
+
+void
+block_manager::set_refs(uint32_t id, uint16_t refs)
+{
+  uint16_t old = get_refs(id);
+  if (old == refs)
+    return;
+  if (old == 0)
+    shared_blocks++;
+  else if (refs == 0)
+    shared_blocks--;
+  d->write_range(RBLOCK(id, sb.nblocks), (id % RPB) * sizeof(refs), sizeof(refs), (const char *)&refs);
 }
 
 void
@@ -86,22 +216,67 @@ block_manager::free_block(uint32_t id)
    * your lab1 code goes here.
    * note: you should unmark the corresponding bit in the block bitmap when free.
    */
-  // use lock to ensure free is thread-safe
+  // a shared block only loses one of its owners
   pthread_mutex_lock(&bitmap_mutex);
-  char buf[BLOCK_SIZE];
-  read_block(BBLOCK(id), buf);
+  uint16_t refs = get_refs(id);
+  if (refs != 0) {
+    set_refs(id, refs - 1);
+    pthread_mutex_unlock(&bitmap_mutex);
+    return;
+  }
+  pthread_mutex_unlock(&bitmap_mutex);
 
-  int index = (id % BPB) >> 3;
-  unsigned char mask = 0xFF ^ (1 << (7 - ((id % BPB) & 0x7)));
-  buf[index] = buf[index] & mask;
+  mark_block(id, false);
+  if (write_stripes != 0)
+    freed_blocks.push_back(id);
+  else
+    free_blocks->free(id);
+}
+
+// Hand the blocks freed in the calling thread's last section to the
+// allocator, once the section is closed.
+void
+block_manager::release_freed()
+{
+  for (size_t i = 0; i < freed_blocks.size(); ++i)
+    free_blocks->free(freed_blocks[i]);
+  freed_blocks.clear();
+}
+
+// Add an owner to an allocated block. Each owner gives it up again
+// with free_block; the last one really frees it.
+void
+block_manager::share_block(uint32_t id)
+{
+  pthread_mutex_lock(&bitmap_mutex);
+  uint16_t refs = get_refs(id);
+  VERIFY(refs < 0xffff);
+  set_refs(id, refs + 1);
+  pthread_mutex_unlock(&bitmap_mutex);
+}
 
-  write_block(BBLOCK(id), buf);
+bool
+block_manager::is_shared(uint32_t id)
+{
+  pthread_mutex_lock(&bitmap_mutex);
+  bool shared = get_refs(id) != 0;
+  pthread_mutex_unlock(&bitmap_mutex);
+  return shared;
+}
+
+bool
+block_manager::any_shared()
+{
+  pthread_mutex_lock(&bitmap_mutex);
+  bool shared = shared_blocks != 0;
   pthread_mutex_unlock(&bitmap_mutex);
+  return shared;
 }
 
 // The layout of disk should be like this:
-// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
+// |<-sb->|<-free block bitmap->|<-reference counts->|<-inode table->|<-data->|
 block_manager::block_manager()
+  : shared_blocks(0)
 {
   d = new disk();
 
@@ -132,6 +307,7 @@ block_manager::block_manager()
   write_block(1, buf);
 
   pthread_mutex_init(&bitmap_mutex, NULL);
+  free_blocks = new shard_allocator(ending, sb.nblocks);
 }
 
 void
@@ -146,17 +322,73 @@ block_manager::write_block(uint32_t id, const char *buf)
   d->write_block(id, buf);
 }
 
+void
+block_manager::read_range(uint32_t id, uint32_t off, uint32_t len, char *buf)
+{
+  d->read_range(id, off, len, buf);
+}
+
+void
+block_manager::write_range(uint32_t id, uint32_t off, uint32_t len, const char *buf)
+{
+  d->write_range(id, off, len, buf);
+}
+
 // inode layer -----------------------------------------
 
 inode_manager::inode_manager()
+  : log(NULL)
 {
   bm = new block_manager();
+  free_inodes = new shard_allocator(1, bm->sb.ninodes + 1);
+  for (int i = 0; i < INODE_LOCKS; ++i)
+    pthread_rwlock_init(&inode_locks[i], NULL);
   uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
   if (root_dir != 1) {
-    printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
+    alog(JSL_DBG_2, "\tim: error! alloc first inode %d, should be 1\n", root_dir);
     exit(0);
   }
-  pthread_mutex_init(&inodes_mutex, NULL);
+}
+
+// Log the disk writes of the calling thread to l from now on. Set
+// before the inode_manager is shared between threads.
+void
+inode_manager::set_log(disk_log *l)
+{
+  log = l;
+  bm->set_log(l);
+}
+
+void
+inode_manager::lock_inode(uint32_t inum, bool write)
+{
+  pthread_rwlock_t *l = &inode_locks[inum % INODE_LOCKS];
+  if (write) {
+    pthread_rwlock_wrlock(l);
+    if (log != NULL && write_stripes == 0)
+      log->begin();
+    write_stripes |= 1ULL << (inum % INODE_LOCKS);
+  } else {
+    pthread_rwlock_rdlock(l);
+  }
+}
+
+void
+inode_manager::unlock_inode(uint32_t inum)
+{
+  uint64_t bit = 1ULL << (inum % INODE_LOCKS);
+  if (write_stripes & bit) {
+    write_stripes &= ~bit;
+    if (write_stripes == 0) {
+      if (log != NULL)
+        log->end();
+      bm->release_freed();
+      for (size_t i = 0; i < freed_inodes.size(); ++i)
+        free_inodes->free(freed_inodes[i]);
+      freed_inodes.clear();
+    }
+  }
+  pthread_rwlock_unlock(&inode_locks[inum % INODE_LOCKS]);
 }
 
 /* Create a new file.
@@ -169,30 +401,25 @@ inode_manager::alloc_inode(uint32_t type)
    * note: the normal inode block should begin from the 2nd inode block.
    * the 1st is used for root_dir, see inode_manager::inode_manager().
    */
-  // use lock to ensure allocation is thread-safe
-  pthread_mutex_lock(&inodes_mutex);
-  char buf[BLOCK_SIZE];
-  uint32_t cur = 1;
-  while (cur <= bm->sb.ninodes) {
-    bm->read_block(IBLOCK(cur, bm->sb.nblocks), buf);
-    for (int i = 0; i < IPB && cur <= bm->sb.ninodes; ++i) {
-      inode_t * ino = (inode_t *)buf + i;
-      if (ino->type == 0) {
-        ino->type = type;
-        ino->size = 0;
-        ino->atime = std::time(0);
-        ino->mtime = std::time(0);
-        ino->ctime = std::time(0);
-        bm->write_block(IBLOCK(cur, bm->sb.nblocks), buf);
-        pthread_mutex_unlock(&inodes_mutex);
-        return cur;
-      }
-      ++cur;
-    }
+  // IPB is 1, so the inode's block belongs to it alone once the
+  // allocator has handed out its number. It is still written under
+  // its lock, to be a section of the log of its own.
+  uint32_t inum = free_inodes->alloc();
+  if (inum == 0) {
+    alog(JSL_DBG_2, "\tim: error! out of inodes\n");
+    exit(0);
   }
-  printf("\tim: error! out of inodes\n");
-  pthread_mutex_unlock(&inodes_mutex);
-  exit(0);
+  inode_t ino;
+  bzero(&ino, sizeof(ino));
+  ino.type = type;
+  ino.size = 0;
+  ino.atime = std::time(0);
+  ino.mtime = std::time(0);
+  ino.ctime = std::time(0);
+  lock_inode(inum, true);
+  put_inode(inum, &ino);
+  unlock_inode(inum);
+  return inum;
 }
 
 void
@@ -203,19 +430,20 @@ inode_manager::free_inode(uint32_t inum)
    * note: you need to check if the inode is already a freed one;
    * if not, clear it, and remember to write back to disk.
    */
-  // use lock to ensure free is thread-safe
-  pthread_mutex_lock(&inodes_mutex);
-  char buf[BLOCK_SIZE];
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  inode_t * ino = (inode_t *)buf + (inum - 1) % IPB;
-  if (ino->type == 0) {
-    printf("\tim: error! inode is already freed\n");
-    pthread_mutex_unlock(&inodes_mutex);
+  // the caller holds the inode's lock; the number goes back to the
+  // allocator only once the section clearing the inode is closed.
+  inode_t * ino = get_inode(inum);
+  if (ino == NULL) {
+    alog(JSL_DBG_2, "\tim: error! inode is already freed\n");
     exit(0);
   } else {
     ino->type = 0;
-    bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
-    pthread_mutex_unlock(&inodes_mutex);
+    put_inode(inum, ino);
+    free(ino);
+    if (write_stripes != 0)
+      freed_inodes.push_back(inum);
+    else
+      free_inodes->free(inum);
   }
 }
 
@@ -224,49 +452,36 @@ inode_manager::free_inode(uint32_t inum)
 struct inode* 
 inode_manager::get_inode(uint32_t inum)
 {
-  struct inode *ino, *ino_disk;
-  char buf[BLOCK_SIZE];
-
-  printf("\tim: get_inode %d\n", inum);
+  struct inode *ino;
 
   if (inum <= 0 || inum > INODE_NUM) {
-    printf("\tim: inum out of range\n");
+    alog(JSL_DBG_2, "\tim: inum out of range\n");
     return NULL;
   }
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  // printf("%s:%d\n", __FILE__, __LINE__);
-
-  ino_disk = (struct inode*)buf + inum%IPB;
-  if (ino_disk->type == 0) {
-    printf("\tim: inode not exist\n");
+  // only the inode itself is copied, not the block holding it
+  ino = (struct inode*)malloc(sizeof(struct inode));
+  bm->read_range(IBLOCK(inum, bm->sb.nblocks), (inum%IPB) * sizeof(struct inode),
+                 sizeof(struct inode), (char *)ino);
+  if (ino->type == 0) {
+    alog(JSL_DBG_4, "\tim: inode not exist\n");
+    free(ino);
     return NULL;
   }
 
-  ino = (struct inode*)malloc(sizeof(struct inode));
-  *ino = *ino_disk;
-
   return ino;
 }
 
 void
 inode_manager::put_inode(uint32_t inum, struct inode *ino)
 {
-  char buf[BLOCK_SIZE];
-  struct inode *ino_disk;
-
-  printf("\tim: put_inode %d\n", inum);
   if (ino == NULL)
     return;
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (struct inode*)buf + inum%IPB;
-  *ino_disk = *ino;
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+  bm->write_range(IBLOCK(inum, bm->sb.nblocks), (inum%IPB) * sizeof(struct inode),
+                  sizeof(struct inode), (const char *)ino);
 }
 
-#define MIN(a,b) ((a)<(b) ? (a) : (b))
-
 /* Get all the data of a file by inum. 
  * Return alloced data, should be freed by caller. */
 void
@@ -278,7 +493,14 @@ inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
    * and copy them to buf_Out
    */
   char block[BLOCK_SIZE];
+  lock_inode(inum, false);
   inode_t * ino = get_inode(inum);
+  if (ino == NULL) {
+    unlock_inode(inum);
+    *buf_out = NULL;
+    *size = 0;
+    return;
+  }
   char * buf = (char *)malloc(ino->size);
   unsigned int cur = 0;
   for (int i = 0; i < NDIRECT && cur < ino->size; ++i) {
@@ -312,27 +534,34 @@ inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
 
   *buf_out = buf;
   *size = ino->size;
-  ino->atime = std::time(0);
-  ino->ctime = std::time(0);
-  put_inode(inum, ino);
+  unsigned int now = std::time(0);
+  bool touch = now - ino->atime >= ATIME_LAZY;
+  free(ino);
+  unlock_inode(inum);
+  if (!touch)
+    return;
+
+  // readers share the lock, so the times are written under the
+  // exclusive one against a fresh copy of the inode. that costs a
+  // log section, so it is only done once the atime is ATIME_LAZY
+  // seconds old, and most reads never take the lock exclusively.
+  lock_inode(inum, true);
+  ino = get_inode(inum);
+  if (ino != NULL && now - ino->atime >= ATIME_LAZY) {
+    ino->atime = now;
+    ino->ctime = now;
+    put_inode(inum, ino);
+  }
   free(ino);
+  unlock_inode(inum);
 }
 
-/* alloc/free blocks if needed */
+/* Grow or shrink the block list of ino from old_block_num blocks to
+ * new_block_num blocks. The caller writes ino back. */
 void
-inode_manager::write_file(uint32_t inum, const char *buf, int size)
+inode_manager::resize_blocks(inode_t *ino, unsigned int old_block_num, unsigned int new_block_num)
 {
-  /*
-   * your lab1 code goes here.
-   * note: write buf to blocks of inode inum.
-   * you need to consider the situation when the size of buf 
-   * is larger or smaller than the size of original inode
-   */
-  char block[BLOCK_SIZE];
   char indirect[BLOCK_SIZE];
-  inode_t * ino = get_inode(inum);
-  unsigned int old_block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  unsigned int new_block_num = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
   /* free some blocks */
   if (old_block_num > new_block_num) {
@@ -386,6 +615,81 @@ inode_manager::write_file(uint32_t inum, const char *buf, int size)
       }
     }
   }
+}
+
+/* Id of the n-th data block of ino, which must already exist. */
+blockid_t
+inode_manager::nth_block(inode_t *ino, unsigned int n)
+{
+  if (n < NDIRECT)
+    return ino->blocks[n];
+
+  char indirect[BLOCK_SIZE];
+  bm->read_block(ino->blocks[NDIRECT], indirect);
+  return *((blockid_t *)indirect + (n - NDIRECT));
+}
+
+void
+inode_manager::set_nth_block(inode_t *ino, unsigned int n, blockid_t bid)
+{
+  if (n < NDIRECT) {
+    ino->blocks[n] = bid;
+    return;
+  }
+
+  char indirect[BLOCK_SIZE];
+  bm->read_block(ino->blocks[NDIRECT], indirect);
+  *((blockid_t *)indirect + (n - NDIRECT)) = bid;
+  bm->write_block(ino->blocks[NDIRECT], indirect);
+}
+
+/* Id of the n-th data block of ino, made private to ino first if a
+ * reflink shares it. keep says whether the old content is still
+ * needed or is about to be overwritten. */
+blockid_t
+inode_manager::own_block(inode_t *ino, unsigned int n, bool keep)
+{
+  blockid_t bid = nth_block(ino, n);
+  if (!bm->is_shared(bid))
+    return bid;
+
+  blockid_t copy = bm->alloc_block();
+  if (keep) {
+    char block[BLOCK_SIZE];
+    bm->read_block(bid, block);
+    bm->write_block(copy, block);
+  }
+  bm->free_block(bid);
+  set_nth_block(ino, n, copy);
+  return copy;
+}
+
+/* alloc/free blocks if needed */
+void
+inode_manager::write_file(uint32_t inum, const char *buf, int size)
+{
+  /*
+   * your lab1 code goes here.
+   * note: write buf to blocks of inode inum.
+   * you need to consider the situation when the size of buf 
+   * is larger or smaller than the size of original inode
+   */
+  char block[BLOCK_SIZE];
+  char indirect[BLOCK_SIZE];
+  lock_inode(inum, true);
+  inode_t * ino = get_inode(inum);
+  if (ino == NULL) {
+    unlock_inode(inum);
+    return;
+  }
+  unsigned int old_block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  unsigned int new_block_num = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  resize_blocks(ino, old_block_num, new_block_num);
+  if (bm->any_shared()) {
+    for (unsigned int i = 0; i < new_block_num; ++i)
+      own_block(ino, i, false);
+  }
 
   /* write file content */
 
@@ -424,6 +728,220 @@ inode_manager::write_file(uint32_t inum, const char *buf, int size)
   ino->ctime = std::time(0);
   put_inode(inum, ino);
   free(ino);
+  unlock_inode(inum);
+}
+
+/* Add size bytes at the end of the file. Only the tail block and the
+ * blocks the new bytes need are touched. NOENT if the inode is free,
+ * IOERR if the file would grow past MAXFILE blocks. */
+extent_protocol::status
+inode_manager::append_file(uint32_t inum, const char *buf, int size)
+{
+  lock_inode(inum, true);
+  inode_t * ino = get_inode(inum);
+  if (ino == NULL) {
+    unlock_inode(inum);
+    return extent_protocol::NOENT;
+  }
+  if ((unsigned long long)ino->size + size > (unsigned long long)MAXFILE * BLOCK_SIZE) {
+    alog(JSL_DBG_2, "\tim: error! append of %d bytes to %d exceeds MAXFILE\n", size, inum);
+    free(ino);
+    unlock_inode(inum);
+    return extent_protocol::IOERR;
+  }
+
+  unsigned int old_block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  unsigned int new_block_num = (ino->size + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  resize_blocks(ino, old_block_num, new_block_num);
+
+  unsigned int pos = ino->size;
+  int cur = 0;
+  while (cur < size) {
+    unsigned int off = pos % BLOCK_SIZE;
+    int len = MIN(BLOCK_SIZE - off, (unsigned int)(size - cur));
+    bm->write_range(own_block(ino, pos / BLOCK_SIZE, off != 0), off, len, buf + cur);
+    pos += len;
+    cur += len;
+  }
+
+  ino->size = pos;
+  ino->mtime = std::time(0);
+  ino->ctime = std::time(0);
+  put_inode(inum, ino);
+  free(ino);
+  unlock_inode(inum);
+  return extent_protocol::OK;
+}
+
+/* Set the file size. Blocks past the new end are freed; a file that
+ * grows reads back zeros in the new range. Fails like append_file. */
+extent_protocol::status
+inode_manager::truncate_file(uint32_t inum, uint32_t size)
+{
+  lock_inode(inum, true);
+  inode_t * ino = get_inode(inum);
+  if (ino == NULL) {
+    unlock_inode(inum);
+    return extent_protocol::NOENT;
+  }
+  if (size > MAXFILE * BLOCK_SIZE) {
+    alog(JSL_DBG_2, "\tim: error! truncate of %d to %u exceeds MAXFILE\n", inum, size);
+    free(ino);
+    unlock_inode(inum);
+    return extent_protocol::IOERR;
+  }
+
+  unsigned int old_block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  unsigned int new_block_num = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  resize_blocks(ino, old_block_num, new_block_num);
+
+  if (size > ino->size) {
+    char zero[BLOCK_SIZE];
+    bzero(zero, BLOCK_SIZE);
+    unsigned int pos = ino->size;
+    while (pos < size) {
+      unsigned int off = pos % BLOCK_SIZE;
+      unsigned int len = MIN(BLOCK_SIZE - off, size - pos);
+      bm->write_range(own_block(ino, pos / BLOCK_SIZE, off != 0), off, len, zero);
+      pos += len;
+    }
+  }
+
+  ino->size = size;
+  ino->mtime = std::time(0);
+  ino->ctime = std::time(0);
+  put_inode(inum, ino);
+  free(ino);
+  unlock_inode(inum);
+  return extent_protocol::OK;
+}
+
+/* Copy len bytes at src_off in src to dst_off in dst, growing dst if
+ * needed. Whole blocks that are block aligned in both files are shared
+ * instead of copied; they are copied on the first write to either
+ * file. copied is the number of bytes copied, short at the end of src.
+ * NOENT if either inode is free, IOERR if dst would grow past MAXFILE
+ * blocks. */
+extent_protocol::status
+inode_manager::copy_range(uint32_t src, uint32_t src_off, uint32_t dst, uint32_t dst_off, uint32_t len, uint32_t &copied)
+{
+  // take the two stripes in index order; one stripe covering both
+  // inodes is taken once, exclusively.
+  bool same_stripe = src % INODE_LOCKS == dst % INODE_LOCKS;
+  if (same_stripe) {
+    lock_inode(dst, true);
+  } else if (src % INODE_LOCKS < dst % INODE_LOCKS) {
+    lock_inode(src, false);
+    lock_inode(dst, true);
+  } else {
+    lock_inode(dst, true);
+    lock_inode(src, false);
+  }
+
+  extent_protocol::status r = copy_range_locked(src, src_off, dst, dst_off, len, copied);
+
+  unlock_inode(dst);
+  if (!same_stripe)
+    unlock_inode(src);
+  return r;
+}
+
+extent_protocol::status
+inode_manager::copy_range_locked(uint32_t src, uint32_t src_off, uint32_t dst, uint32_t dst_off, uint32_t len, uint32_t &copied)
+{
+  copied = 0;
+  inode_t * sino = get_inode(src);
+  if (sino == NULL)
+    return extent_protocol::NOENT;
+  if (src != dst) {
+    // dst has to exist even when there is nothing to copy
+    inode_t * dino = get_inode(dst);
+    if (dino == NULL) {
+      free(sino);
+      return extent_protocol::NOENT;
+    }
+    free(dino);
+  }
+  if (src_off >= sino->size) {
+    free(sino);
+    return extent_protocol::OK;
+  }
+  len = MIN(len, sino->size - src_off);
+  if ((unsigned long long)dst_off + len > (unsigned long long)MAXFILE * BLOCK_SIZE) {
+    alog(JSL_DBG_2, "\tim: error! copy of %u bytes to %d exceeds MAXFILE\n", len, dst);
+    free(sino);
+    return extent_protocol::IOERR;
+  }
+
+  // a copy within one file reads the source into a buffer first, so
+  // that it is not changed under the copy.
+  std::string src_buf;
+  inode_t * dino = sino;
+  if (src == dst) {
+    src_buf.resize(len);
+    for (uint32_t pos = 0; pos < len; ) {
+      uint32_t off = (src_off + pos) % BLOCK_SIZE;
+      uint32_t n = MIN(BLOCK_SIZE - off, len - pos);
+      bm->read_range(nth_block(sino, (src_off + pos) / BLOCK_SIZE), off, n, &src_buf[pos]);
+      pos += n;
+    }
+  } else {
+    dino = get_inode(dst);
+  }
+
+  uint32_t end = dst_off + len;
+  if (end > dino->size) {
+    unsigned int old_block_num = (dino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned int new_block_num = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    resize_blocks(dino, old_block_num, new_block_num);
+
+    // zero the gap between the old end and the copy
+    char zero[BLOCK_SIZE];
+    bzero(zero, BLOCK_SIZE);
+    for (uint32_t pos = dino->size; pos < dst_off; ) {
+      uint32_t off = pos % BLOCK_SIZE;
+      uint32_t n = MIN(BLOCK_SIZE - off, dst_off - pos);
+      bm->write_range(own_block(dino, pos / BLOCK_SIZE, off != 0), off, n, zero);
+      pos += n;
+    }
+    dino->size = end;
+  }
+
+  char block[BLOCK_SIZE];
+  for (uint32_t pos = 0; pos < len; ) {
+    uint32_t s = src_off + pos, d = dst_off + pos;
+    if (src != dst && s % BLOCK_SIZE == 0 && d % BLOCK_SIZE == 0 && len - pos >= BLOCK_SIZE) {
+      blockid_t sb = nth_block(sino, s / BLOCK_SIZE);
+      blockid_t db = nth_block(dino, d / BLOCK_SIZE);
+      if (sb != db) {
+        bm->free_block(db);
+        bm->share_block(sb);
+        set_nth_block(dino, d / BLOCK_SIZE, sb);
+      }
+      pos += BLOCK_SIZE;
+      continue;
+    }
+
+    uint32_t n = MIN(BLOCK_SIZE - s % BLOCK_SIZE, BLOCK_SIZE - d % BLOCK_SIZE);
+    n = MIN(n, len - pos);
+    const char *from = block;
+    if (src == dst)
+      from = src_buf.data() + pos;
+    else
+      bm->read_range(nth_block(sino, s / BLOCK_SIZE), s % BLOCK_SIZE, n, block);
+    bool keep = d % BLOCK_SIZE != 0 || n < BLOCK_SIZE;
+    bm->write_range(own_block(dino, d / BLOCK_SIZE, keep), d % BLOCK_SIZE, n, from);
+    pos += n;
+  }
+
+  dino->mtime = std::time(0);
+  dino->ctime = std::time(0);
+  put_inode(dst, dino);
+  if (dino != sino)
+    free(dino);
+  free(sino);
+  copied = len;
+  return extent_protocol::OK;
 }
 
 void
@@ -434,6 +952,7 @@ inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
    * note: get the attributes of inode inum.
    * you can refer to "struct attr" in extent_protocol.h
    */
+  lock_inode(inum, false);
   inode_t * ino = get_inode(inum);
 
   if (ino) {
@@ -445,6 +964,7 @@ inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
 
     free(ino);
   }
+  unlock_inode(inum);
 }
 
 void
@@ -455,7 +975,12 @@ inode_manager::remove_file(uint32_t inum)
    * note: you need to consider about both the data block and inode of the file
    */
   
+  lock_inode(inum, true);
   inode_t * ino = get_inode(inum);
+  if (ino == NULL) {
+    unlock_inode(inum);
+    return;
+  }
   unsigned int block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
   if (block_num <= NDIRECT) {
     for (unsigned int i = 0; i < block_num; ++i) {
@@ -474,6 +999,7 @@ inode_manager::remove_file(uint32_t inum)
   }
   free_inode(inum);
   free(ino);
+  unlock_inode(inum);
 }
 
 void
@@ -482,12 +1008,21 @@ inode_manager::append_block(uint32_t inum, blockid_t &bid)
   /*
    * your code goes here.
    */
-  bid = bm->alloc_block();
+  lock_inode(inum, true);
   struct inode* ino = get_inode(inum);
+  if (ino == NULL) {
+    unlock_inode(inum);
+    return;
+  }
 
   int num_blocks = ino->size / BLOCK_SIZE;
   num_blocks += (ino->size % BLOCK_SIZE > 0) ? 1 : 0;
-  if(num_blocks > MAXFILE) return;
+  if(num_blocks >= MAXFILE) {
+    free(ino);
+    unlock_inode(inum);
+    return;
+  }
+  bid = bm->alloc_block();
 
   if(num_blocks < NDIRECT){
     ino->blocks[num_blocks] = bid; // direct ref
@@ -503,6 +1038,8 @@ inode_manager::append_block(uint32_t inum, blockid_t &bid)
   num_blocks++;
   ino->size += BLOCK_SIZE;
   put_inode(inum, ino);
+  free(ino);
+  unlock_inode(inum);
 }
 
 void
@@ -512,7 +1049,12 @@ inode_manager::get_block_ids(uint32_t inum, std::list<blockid_t> &block_ids)
    * your code goes here.
    */
 
+   lock_inode(inum, false);
    struct inode* ino = get_inode(inum);
+   if (ino == NULL) {
+     unlock_inode(inum);
+     return;
+   }
    int tmp[NINDIRECT];
    int num_blocks = ino->size / BLOCK_SIZE;
    num_blocks += (ino->size % BLOCK_SIZE > 0) ? 1 : 0;
@@ -525,6 +1067,8 @@ inode_manager::get_block_ids(uint32_t inum, std::list<blockid_t> &block_ids)
 
      for(int i = NDIRECT; i < num_blocks; i++) block_ids.push_back(tmp[i-NDIRECT]);
    }
+   free(ino);
+   unlock_inode(inum);
 
   return;
    
@@ -550,13 +1094,30 @@ inode_manager::write_block(blockid_t id, const char buf[BLOCK_SIZE])
   bm->write_block(id, buf);
 }
 
+void
+inode_manager::read_block_range(blockid_t id, uint32_t off, uint32_t len, char *buf)
+{
+  bm->read_range(id, off, len, buf);
+}
+
+void
+inode_manager::write_block_range(blockid_t id, uint32_t off, uint32_t len, const char *buf)
+{
+  bm->write_range(id, off, len, buf);
+}
+
 void
 inode_manager::complete(uint32_t inum, uint32_t size)
 {
   /*
    * your code goes here.
    */
+  lock_inode(inum, true);
   struct inode * ino = get_inode(inum);
-  ino->size = size;
-  put_inode(inum, ino);
+  if (ino != NULL) {
+    ino->size = size;
+    put_inode(inum, ino);
+    free(ino);
+  }
+  unlock_inode(inum);
 }
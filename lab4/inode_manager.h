@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 #include <pthread.h>
+#include <vector>
 #include "extent_protocol.h" // TODO: delete it
 
 #define DISK_SIZE  1024*1024*32
@@ -13,14 +14,52 @@
 
 // disk layer -----------------------------------------
 
+// Sees every write to the disk, in order, so that it can be replayed
+// elsewhere. Writes between begin and end belong to one operation
+// and are meant to be replayed together.
+class disk_log {
+ public:
+  virtual ~disk_log() {}
+  virtual void write(uint32_t id, uint32_t off, uint32_t len, const char *buf) = 0;
+  virtual void begin() = 0;
+  virtual void end() = 0;
+};
+
 class disk {
  private:
   unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
 
  public:
   disk();
+  disk_log *log;
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_range(uint32_t id, uint32_t off, uint32_t len, char *buf);
+  void write_range(uint32_t id, uint32_t off, uint32_t len, const char *buf);
+};
+
+// allocation -----------------------------------------
+
+#define ALLOC_SHARDS 8
+
+// Free map of the ids in [first, end), split into ALLOC_SHARDS ranges
+// with a lock each. alloc tries the shards in order and passes over
+// those another thread is using, so a lone thread hands out ids in
+// sequence while concurrent threads spread over the shards.
+class shard_allocator {
+ private:
+  struct shard {
+    pthread_mutex_t m;
+    uint32_t first, end, next;
+  } shards[ALLOC_SHARDS];
+  std::vector<unsigned char> used;
+  uint32_t first;
+  uint32_t alloc_in(struct shard &s);
+
+ public:
+  shard_allocator(uint32_t first, uint32_t end);
+  uint32_t alloc(); // 0 when every shard is full
+  void free(uint32_t id);
 };
 
 // block layer -----------------------------------------
@@ -34,16 +73,30 @@ typedef struct superblock {
 class block_manager {
  private:
   disk *d;
-  std::map <uint32_t, int> using_blocks;
+  // blocks with a nonzero reference count on disk
+  uint32_t shared_blocks;
+  // guards the on-disk bitmap and reference counts, and
+  // shared_blocks; the free map itself is kept by free_blocks.
   pthread_mutex_t bitmap_mutex; 
+  shard_allocator *free_blocks;
+  void mark_block(uint32_t id, bool used);
+  uint16_t get_refs(uint32_t id);
+  void set_refs(uint32_t id, uint16_t refs);
  public:
   block_manager();
   struct superblock sb;
+  void set_log(disk_log *log) { d->log = log; }
 
   uint32_t alloc_block();
   void free_block(uint32_t id);
+  void release_freed();
+  void share_block(uint32_t id);
+  bool is_shared(uint32_t id);
+  bool any_shared();
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_range(uint32_t id, uint32_t off, uint32_t len, char *buf);
+  void write_range(uint32_t id, uint32_t off, uint32_t len, const char *buf);
 };
 
 // inode layer -----------------------------------------
@@ -57,10 +110,18 @@ class block_manager {
 // IPB=1 is important for thread-safe
 
 // reserved blocks
-#define RESERVED_BLOCK(ninodes, nblocks)     (2 + ((nblocks) + BPB - 1)/BPB + ((ninodes) + IPB - 1)/IPB)
+#define RESERVED_BLOCK(ninodes, nblocks)     (2 + ((nblocks) + BPB - 1)/BPB + NREFBLOCKS(nblocks) + ((ninodes) + IPB - 1)/IPB)
 
 // Block containing inode i
-#define IBLOCK(i, nblocks)     (2 + ((nblocks) + BPB - 1)/BPB + ((i)-1)/IPB)
+#define IBLOCK(i, nblocks)     (2 + ((nblocks) + BPB - 1)/BPB + NREFBLOCKS(nblocks) + ((i)-1)/IPB)
+
+// Reference counts per block: after the bitmap, a uint16_t per block
+// holding the number of owners it has beyond the first.
+#define RPB           (BLOCK_SIZE / sizeof(uint16_t))
+#define NREFBLOCKS(nblocks)  (((nblocks) + RPB - 1)/RPB)
+
+// Block containing the reference count of block b
+#define RBLOCK(b, nblocks)   (2 + ((nblocks) + BPB - 1)/BPB + (b)/RPB)
 
 // Bitmap bits per block
 #define BPB           (BLOCK_SIZE*8)
@@ -81,25 +142,48 @@ typedef struct inode {
   blockid_t blocks[NDIRECT+1];   // Data block addresses
 } inode_t;
 
+// read_file only moves the atime of an inode forward once it is this
+// many seconds old
+#define ATIME_LAZY 60
+
+// Inode locks are striped: inode i is guarded by lock i % INODE_LOCKS.
+// At most 64, see write_stripes in inode_manager.cc.
+#define INODE_LOCKS 64
+
 class inode_manager {
  private:
   block_manager *bm;
-  pthread_mutex_t inodes_mutex; 
+  disk_log *log;
+  shard_allocator *free_inodes;
+  pthread_rwlock_t inode_locks[INODE_LOCKS];
+  void lock_inode(uint32_t inum, bool write);
+  void unlock_inode(uint32_t inum);
   struct inode* get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
+  void resize_blocks(struct inode *ino, unsigned int old_block_num, unsigned int new_block_num);
+  blockid_t nth_block(struct inode *ino, unsigned int n);
+  void set_nth_block(struct inode *ino, unsigned int n, blockid_t bid);
+  blockid_t own_block(struct inode *ino, unsigned int n, bool keep);
+  extent_protocol::status copy_range_locked(uint32_t src, uint32_t src_off, uint32_t dst, uint32_t dst_off, uint32_t len, uint32_t &copied);
 
  public:
   inode_manager();
+  void set_log(disk_log *l);
   uint32_t alloc_inode(uint32_t type);
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
   void write_file(uint32_t inum, const char *buf, int size);
+  extent_protocol::status append_file(uint32_t inum, const char *buf, int size);
+  extent_protocol::status truncate_file(uint32_t inum, uint32_t size);
+  extent_protocol::status copy_range(uint32_t src, uint32_t src_off, uint32_t dst, uint32_t dst_off, uint32_t len, uint32_t &copied);
   void remove_file(uint32_t inum);
   void getattr(uint32_t inum, extent_protocol::attr &a);
   void append_block(uint32_t inum, blockid_t &bid);
   void get_block_ids(uint32_t inum, std::list<blockid_t> &block_ids);
   void read_block(blockid_t bid, char block[BLOCK_SIZE]);
   void write_block(blockid_t bid, const char block[BLOCK_SIZE]);
+  void read_block_range(blockid_t bid, uint32_t off, uint32_t len, char *buf);
+  void write_block_range(blockid_t bid, uint32_t off, uint32_t len, const char *buf);
   void complete(uint32_t inum, uint32_t size);
 };
 
@@ -7,13 +7,14 @@
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include "alog.h"
 
 lock_client::lock_client(std::string dst) {
 	sockaddr_in dstsock;
 	make_sockaddr(dst.c_str(), &dstsock);
 	cl = new rpcc(dstsock);
 	if (cl->bind() < 0) {
-		printf("lock_client: call bind\n");
+		alog(JSL_DBG_3, "lock_client: call bind\n");
 	}
 }
 
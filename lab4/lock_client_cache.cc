@@ -4,9 +4,8 @@
 #include "lock_client_cache.h"
 #include "rpc.h"
 #include <sstream>
-#include <iostream>
 #include <stdio.h>
-#include "tprintf.h"
+#include "alog.h"
 #include <unistd.h>
 
 int lock_client_cache::last_port = 0;
@@ -18,11 +17,8 @@ lock_client_cache::lock_client_cache(std::string xdst,
 				     class lock_release_user *_lu)
   : lock_client(xdst), lu(_lu)
 {
-  for (int i=0;i<1100;i++){
-    cond[i] = PTHREAD_COND_INITIALIZER;
-  }
   mutex = PTHREAD_MUTEX_INITIALIZER;
-  std::cerr << "client init" << '\n';
+  alog(JSL_DBG_3, "client init\n");
   srand(time(NULL)^last_port);
   rlock_port = ((rand()%32000) | (0x1 << 10));
   char hname[100];
@@ -32,8 +28,17 @@ lock_client_cache::lock_client_cache(std::string xdst,
   id = host.str();
   last_port = rlock_port;
   rpcs *rlsrpc = new rpcs(rlock_port);
-  rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache::revoke_handler);
-  rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache::retry_handler);
+  rlsrpc->reg(lock_rpc::revoke(), this, &lock_client_cache::revoke_handler);
+  rlsrpc->reg(lock_rpc::retry(), this, &lock_client_cache::retry_handler);
+}
+
+// Wait on l's condition; called with mutex held.
+void
+lock_client_cache::wait(lock_entry &l)
+{
+  l.waiters++;
+  pthread_cond_wait(&l.cond, &mutex);
+  l.waiters--;
 }
 
 lock_protocol::status
@@ -41,35 +46,36 @@ lock_client_cache::acquire(lock_protocol::lockid_t lid)
 {
   int ret = rlock_protocol::OK;
   pthread_mutex_lock(&mutex);
-  while(lock[lid] == discard){
-    pthread_cond_wait(&cond[lid], &mutex);
+  lock_entry &l = lock[lid];
+  while(l.state == discard){
+    wait(l);
   }
 
-  if (lock[lid] == unlock){
-    lock[lid] = apply;
+  if (l.state == unlock){
+    l.state = apply;
     int tr = 9;
     int ac_ret;
-    std::cerr << "applying\n"; 
+    alog(JSL_DBG_4, "applying %llu\n", lid);
     pthread_mutex_unlock(&mutex);
-    ac_ret = cl->call(lock_protocol::acquire, lid, id, tr);
+    ac_ret = cl->call(lock_rpc::acquire(), lid, id, tr);
     pthread_mutex_lock(&mutex);
-    if (lock[lid] == revokee){
-      std::cerr << "applying revoke\n"; 
+    if (l.state == revokee){
+      alog(JSL_DBG_4, "applying revoke %llu\n", lid);
     }
     else if (ac_ret == lock_protocol::RETRY){
-      std::cerr << "applying retry\n"; 
-      pthread_cond_wait(&cond[lid], &mutex);
+      alog(JSL_DBG_4, "applying retry %llu\n", lid);
+      wait(l);
     }else if(ac_ret == rlock_protocol::REVOKE){
-      lock[lid] = revokee;
-    }else if (lock[lid] == apply){
-      std::cerr << "applying ok\n"; 
-      lock[lid] = locked;
+      l.state = revokee;
+    }else if (l.state == apply){
+      alog(JSL_DBG_4, "applying ok %llu\n", lid);
+      l.state = locked;
     }
   }
-  else if (lock[lid] == hold){
-    lock[lid] = locked;
+  else if (l.state == hold){
+    l.state = locked;
   }else{
-    pthread_cond_wait(&cond[lid], &mutex);
+    wait(l);
   }
   pthread_mutex_unlock(&mutex);
   return lock_protocol::OK;
@@ -80,25 +86,28 @@ lock_client_cache::release(lock_protocol::lockid_t lid)
 {
   int ret = rlock_protocol::OK;
   pthread_mutex_lock(&mutex);
-  if (!pthread_cond_destroy(&cond[lid])){
-    pthread_cond_init(&cond[lid], NULL);
-    if (lock[lid] == revokee){
-      lock[lid] = discard;
+  lock_entry &l = lock[lid];
+  if (l.waiters == 0){
+    if (l.state == revokee){
+      l.state = discard;
       pthread_mutex_unlock(&mutex);
+      if (lu)
+        lu->dorelease(lid);
       int tr = 9;
-      cl->call(lock_protocol::release, lid, id, tr);
+      cl->call(lock_rpc::release(), lid, id, tr);
       pthread_mutex_lock(&mutex);
-      lock[lid] = unlock;
+      l.state = unlock;
       //std::cerr << "release 3" << '\n';
     }else{
-      lock[lid] = hold;
+      l.state = hold;
       //std::cerr << "release 4" << '\n';
     }
     //std::cerr << "release 5" << '\n';
   }
   else{
     //std::cerr << "release 6" << '\n';
-    pthread_cond_signal(&cond[lid]);
+    // hand the lock straight to a waiting thread
+    pthread_cond_signal(&l.cond);
   }
   //std::cerr << "release 7" << '\n';
   pthread_mutex_unlock(&mutex);
@@ -109,33 +118,39 @@ rlock_protocol::status
 lock_client_cache::revoke_handler(lock_protocol::lockid_t lid, int & r)
 {
   int ret = rlock_protocol::OK;
-  std::cerr << "revoke 1 " << lock[lid] << '\n';
   pthread_mutex_lock(&mutex);
-  if (lock[lid] == hold){
-    lock[lid] = discard;
+  lock_entry &l = lock[lid];
+  alog(JSL_DBG_4, "revoke 1 %llu %d\n", lid, l.state);
+  if (l.state == hold){
+    l.state = discard;
     ret = 1;
-  }else if (lock[lid] == discard){
-    lock[lid] = unlock;
-    pthread_cond_broadcast(&cond[lid]);
-  }else if (lock[lid] > unlock){
-    lock[lid] = revokee;
-    std::cerr << "revoke 2" << '\n';
+  }else if (l.state == discard){
+    l.state = unlock;
+    pthread_cond_broadcast(&l.cond);
+  }else if (l.state > unlock){
+    l.state = revokee;
+    alog(JSL_DBG_4, "revoke 2 %llu\n", lid);
   }
-  std::cerr << "revoke done" << '\n';
+  alog(JSL_DBG_4, "revoke done %llu\n", lid);
   pthread_mutex_unlock(&mutex);
+  // the lock goes straight back to the server, so cached state
+  // guarded by it has to be written back first.
+  if (ret == 1 && lu)
+    lu->dorelease(lid);
   return ret;
 }
 
 rlock_protocol::status
 lock_client_cache::retry_handler(lock_protocol::lockid_t lid,  int state, int & r)
 {
-  std::cerr << "retry " << state << '\n';
+  alog(JSL_DBG_4, "retry %llu %d\n", lid, state);
   pthread_mutex_lock(&mutex);
+  lock_entry &l = lock[lid];
   int ret = rlock_protocol::OK;
-  if (lock[lid] == apply){
-    if (state) lock[lid] = revokee;
-    else lock[lid] = locked;
-    pthread_cond_signal(&cond[lid]);
+  if (l.state == apply){
+    if (state) l.state = revokee;
+    else l.state = locked;
+    pthread_cond_signal(&l.cond);
     r = rlock_protocol::OK;
   }else{
     r = 2;
@@ -143,6 +158,3 @@ lock_client_cache::retry_handler(lock_protocol::lockid_t lid,  int state, int &
   pthread_mutex_unlock(&mutex);
   return ret;
 }
-
-
-
@@ -26,9 +26,18 @@ class lock_client_cache : public lock_client {
   int rlock_port;
   std::string hostname;
   std::string id;
-  std::map<lock_protocol::lockid_t, int> lock;
+  // what this client knows of each lock, with the condition its
+  // threads wait on for it. Entries are never erased, so references
+  // to them stay good.
+  struct lock_entry {
+    lock_entry() : state(0), waiters(0) { VERIFY(pthread_cond_init(&cond, NULL) == 0); }
+    int state;
+    int waiters;
+    pthread_cond_t cond;
+  };
+  std::map<lock_protocol::lockid_t, lock_entry> lock;
   pthread_mutex_t mutex;
-  pthread_cond_t cond[1100];
+  void wait(lock_entry &l);
  public:
   static int last_port;
   lock_client_cache(std::string xdst, class lock_release_user *l = 0);
@@ -27,4 +27,16 @@ public:
     };
 };
 
+// argument and reply types, checked at compile time by rpcc::call and
+// rpcs::reg. the lab 1 lock_server, which takes the client's nonce
+// instead of its id, is still called by number.
+class lock_rpc {
+ public:
+  typedef rpc_proc<lock_protocol::stat, int, lock_protocol::lockid_t> stat;
+  typedef rpc_proc<lock_protocol::acquire, int, lock_protocol::lockid_t, std::string> acquire;
+  typedef rpc_proc<lock_protocol::release, int, lock_protocol::lockid_t, std::string> release;
+  typedef rpc_proc<rlock_protocol::revoke, int, lock_protocol::lockid_t> revoke;
+  typedef rpc_proc<rlock_protocol::retry, int, lock_protocol::lockid_t, int> retry;
+};
+
 #endif 
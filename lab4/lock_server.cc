@@ -5,13 +5,14 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include "alog.h"
 
 lock_server::lock_server() : nacquire (0) {
     pthread_mutex_init(&map_mutex, NULL);
 }
 
 lock_protocol::status lock_server::stat(int clt, lock_protocol::lockid_t lid, int &r) {
-	printf("stat request from clt %d\n", clt);
+	alog(JSL_DBG_3, "stat request from clt %d\n", clt);
 	r = nacquire;
 	return lock_protocol::OK;
 }
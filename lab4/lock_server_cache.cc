@@ -7,7 +7,7 @@
 #include <arpa/inet.h>
 #include "lang/verify.h"
 #include "handle.h"
-#include "tprintf.h"
+#include "alog.h"
 
 
 lock_server_cache::lock_server_cache():
@@ -25,23 +25,23 @@ int lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id, int
     lock[lid].push(id);
     wait_set[lid].insert(id);
     r = lock_protocol::OK;
-    std::cout <<  lid << " "<< id <<" "<< "a1\n";
+    alog(JSL_DBG_4, "%llu %s a1\n", lid, id.c_str());
   }else if (find(wait_set[lid].begin(), wait_set[lid].end(), id) == wait_set[lid].end()){
-    std::cout <<  lid << " "<< id <<" "<< "a2\n";
+    alog(JSL_DBG_4, "%llu %s a2\n", lid, id.c_str());
     ret = lock_protocol::RETRY;
 
     lock[lid].push(id);
     wait_set[lid].insert(id);
     if (lock[lid].size() == 2){
-      std::cout <<  lid << " "<< id <<" "<< "a3\n";
+      alog(JSL_DBG_4, "%llu %s a3\n", lid, id.c_str());
       std::string t = lock[lid].front();
       handle h(t);
       rpcc *cl = h.safebind();
       int tr = 9;
       int revoke_ret;
-      std::cout <<  lid << " "<< id <<" "<< "a4\n";
+      alog(JSL_DBG_4, "%llu %s a4\n", lid, id.c_str());
       pthread_mutex_unlock(&mutex);
-      revoke_ret = cl->call(rlock_protocol::revoke, lid, tr);
+      revoke_ret = cl->call(lock_rpc::revoke(), lid, tr);
       pthread_mutex_lock(&mutex);
       if (revoke_ret == 1) {
         wait_set[lid].erase(lock[lid].front());
@@ -49,7 +49,7 @@ int lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id, int
         if (lock[lid].size() > 1) ret = 2;
         else ret = 0;
         pthread_mutex_unlock(&mutex);
-        cl->call(rlock_protocol::revoke, lid, tr);
+        cl->call(lock_rpc::revoke(), lid, tr);
         pthread_mutex_lock(&mutex);
       }
       pthread_mutex_unlock(&mutex);
@@ -65,7 +65,7 @@ int lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id, int
 int lock_server_cache::release(lock_protocol::lockid_t lid, std::string id, int &r)
 {
   lock_protocol::status ret = lock_protocol::OK;
-  std::cout << lid <<" "<<  id << " "<< "r\n";
+  alog(JSL_DBG_4, "%llu %s r\n", lid, id.c_str());
   pthread_mutex_lock(&mutex);
   if (!lock[lid].empty() && lock[lid].front() == id){
     lock[lid].pop();
@@ -75,19 +75,19 @@ int lock_server_cache::release(lock_protocol::lockid_t lid, std::string id, int
     pthread_mutex_unlock(&mutex);
     return ret;
   }
-  std::cout << "next\n";
+  alog(JSL_DBG_4, "next\n");
   if (!lock[lid].empty()){
     std::string t = lock[lid].front();
     int state = lock[lid].size() > 1;
     handle h(t);
     rpcc *cl = h.safebind();
-    std::cout << "next2\n";
+    alog(JSL_DBG_4, "next2\n");
     int tr = 9;
     pthread_mutex_unlock(&mutex);
-    cl->call(rlock_protocol::retry, lid, state, tr);
+    cl->call(lock_rpc::retry(), lid, state, tr);
     return ret;
   }
-  std::cout << lid << "free\n";
+  alog(JSL_DBG_4, "%llu free\n", lid);
   pthread_mutex_unlock(&mutex);
   return ret;
 }
@@ -95,7 +95,7 @@ int lock_server_cache::release(lock_protocol::lockid_t lid, std::string id, int
 lock_protocol::status
 lock_server_cache::stat(lock_protocol::lockid_t lid, int &r)
 {
-  tprintf("stat request\n");
+  alog(JSL_DBG_3, "stat request\n");
   r = nacquire;
   return lock_protocol::OK;
 }
@@ -41,9 +41,9 @@ main(int argc, char *argv[])
 
   lock_server_cache ls;
   rpcs server(atoi(argv[1]), count);
-  server.reg(lock_protocol::stat, &ls, &lock_server_cache::stat);
-  server.reg(lock_protocol::release, &ls, &lock_server_cache::release);
-  server.reg(lock_protocol::acquire, &ls, &lock_server_cache::acquire);
+  server.reg(lock_rpc::stat(), &ls, &lock_server_cache::stat);
+  server.reg(lock_rpc::release(), &ls, &lock_server_cache::release);
+  server.reg(lock_rpc::acquire(), &ls, &lock_server_cache::acquire);
   // server.reg(lock_protocol::retry &ls, &lock_server_cache::retry);
   // server.reg(lock_protocol::revoke &ls, &lock_server_cache::revoke);
 #endif
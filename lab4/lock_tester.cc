@@ -7,6 +7,7 @@
 #include "lock_client_cache.h"
 #include "rpc.h"
 #include "jsl_log.h"
+#include "slock.h"
 #include <arpa/inet.h>
 #include <vector>
 #include <stdlib.h>
@@ -4,16 +4,22 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include "threader.h"
+#include "alog.h"
 
 using namespace std;
 
 void NameNode::init(const string &extent_dst, const string &lock_dst) {
   ec = new extent_client(extent_dst);
-  lc = new lock_client_cache(lock_dst);
-  yfs = new yfs_client(extent_dst, lock_dst);
+  lc = new lock_client_cache(lock_dst, this);
+  // NameNode reads and writes extents behind yfs's back, so its
+  // yfs_client must not keep a cache of its own.
+  yfs = new yfs_client(ec, new lock_client_cache(lock_dst));
 
   /* Add your init logic here */
   counter = 0;
+  pthread_mutex_init(&listing_mutex, NULL);
+  path_generation = 0;
+  pthread_mutex_init(&path_mutex, NULL);
   NewThread(this, &NameNode::CountBeat);
 }
 void NameNode::CountBeat(){
@@ -27,9 +33,10 @@ list<NameNode::LocatedBlock> NameNode::GetBlockLocations(yfs_client::inum ino) {
   list<NameNode::LocatedBlock> list_block;
   list<blockid_t> block_ids;
   long long size = 0;
-  ec->get_block_ids(ino, block_ids);
   extent_protocol::attr attr;
+  extent_client::pending ids_done = ec->get_block_ids_async(ino, block_ids);
   ec->getattr(ino, attr);
+  ids_done.get();
   int cnt = 0;
   for(blockid_t blockid : block_ids){
     cnt++;
@@ -63,8 +70,9 @@ bool NameNode::Rename(yfs_client::inum src_dir_ino, string src_name, yfs_client:
   //printf("rename : %s to %s\n",src_name,dst_name);
   //fflush(stdout);
   string src_buf, dst_buf;
+  extent_client::pending dst_done = ec->get_async(dst_dir_ino, dst_buf);
   ec->get(src_dir_ino, src_buf);
-  ec->get(dst_dir_ino, dst_buf);
+  dst_done.get();
   bool flag = false;
   int pos = 0, dst_ino;
   const char* p;
@@ -86,8 +94,15 @@ bool NameNode::Rename(yfs_client::inum src_dir_ino, string src_name, yfs_client:
     dst_buf.resize(dst_buf.size() + 5, 0);
     *(uint32_t *)(dst_buf.c_str() + dst_buf.size() -4) = dst_ino;
     
-    ec->put(src_dir_ino, src_buf);
+    // the two directories may live on different extent servers, so
+    // the writes are not atomic together: link the new name first,
+    // so a crash in between leaves the file reachable twice rather
+    // than not at all.
     ec->put(dst_dir_ino, dst_buf);
+    if(src_dir_ino != dst_dir_ino)
+      ec->put(src_dir_ino, src_buf);
+    DirChanged(dst_dir_ino);
+    DirChanged(src_dir_ino);
   }
   return flag;
 }
@@ -96,6 +111,7 @@ bool NameNode::Mkdir(yfs_client::inum parent, string name, mode_t mode, yfs_clie
   //printf("mkdir : %s\n",name);
   fflush(stdout);
   bool rst = !yfs->mkdir(parent, name.c_str(), mode, ino_out);
+  if(rst) DirChanged(parent);
   return rst;
 }
 
@@ -103,6 +119,7 @@ bool NameNode::Create(yfs_client::inum parent, string name, mode_t mode, yfs_cli
   //printf("create : %s\n",name);
   fflush(stdout);
   bool rst = !yfs->create(parent, name.c_str(), mode, ino_out);
+  if(rst) DirChanged(parent);
   if(rst) lc->acquire(ino_out);
   return rst;
 }
@@ -112,7 +129,7 @@ bool NameNode::Isfile(yfs_client::inum ino) {
   fflush(stdout);
   extent_protocol::attr tmp;
   if(ec->getattr(ino, tmp) != extent_protocol::OK){
-    printf("error getting attr\n");
+    alog(JSL_DBG_2, "error getting attr\n");
     return false;
   }
 
@@ -126,7 +143,7 @@ bool NameNode::Isdir(yfs_client::inum ino) {
   //fflush(stdout);
   extent_protocol::attr tmp;
   if(ec->getattr(ino, tmp) != extent_protocol::OK){
-    printf("error getting attr\n");
+    alog(JSL_DBG_2, "error getting attr\n");
     return false;
   }
 
@@ -173,7 +190,9 @@ bool NameNode::Readdir(yfs_client::inum ino, std::list<yfs_client::dirent> &dir)
   return true;
 }
 
-bool NameNode::Unlink(yfs_client::inum parent, string name, yfs_client::inum ino) {
+// With tree set, a directory is unlinked however full it is, and the
+// extent server frees everything below it in the background.
+bool NameNode::Unlink(yfs_client::inum parent, string name, yfs_client::inum ino, bool tree) {
   //printf("unlink %s\n",name);
   string buf;
   ec->get(parent, buf);
@@ -184,7 +203,11 @@ bool NameNode::Unlink(yfs_client::inum parent, string name, yfs_client::inum ino
       uint32_t ino = *(uint32_t *)(p + strlen(p) + 1);
       buf.erase(pos, strlen(p) + 1 + sizeof(uint32_t));
       ec->put(parent, buf);
-      ec->remove(ino);
+      DirChanged(parent);
+      if (tree)
+        ec->remove_tree(ino);
+      else
+        ec->remove(ino);
       return true;
     }
     pos += strlen(p) + 1 + sizeof(uint32_t);
@@ -192,6 +215,208 @@ bool NameNode::Unlink(yfs_client::inum parent, string name, yfs_client::inum ino
   return false;
 }
 
+// Also starts tracking dir, so that losing its lock counts as a change.
+unsigned long long NameNode::DirVersion(yfs_client::inum dir) {
+  pthread_mutex_lock(&listing_mutex);
+  unsigned long long v = dir_versions[dir];
+  pthread_mutex_unlock(&listing_mutex);
+  return v;
+}
+
+// Called after the new contents of dir are written, so a listing that
+// read the version before the change is seen to be stale.
+void NameNode::DirChanged(yfs_client::inum dir) {
+  pthread_mutex_lock(&listing_mutex);
+  dir_versions[dir]++;
+  pthread_mutex_unlock(&listing_mutex);
+}
+
+// lc gives up the lock of lid, because another client wants it, most
+// likely to change it. Only directories that have been listed are
+// tracked; file locks come and go with every write.
+void NameNode::dorelease(lock_protocol::lockid_t lid) {
+  pthread_mutex_lock(&listing_mutex);
+  auto it = dir_versions.find(lid);
+  if (it != dir_versions.end())
+    it->second++;
+  pthread_mutex_unlock(&listing_mutex);
+
+  // names found in lid may be gone or point elsewhere once it changes
+  pthread_mutex_lock(&path_mutex);
+  vector<string> stale;
+  for (auto p = path_cache.begin(); p != path_cache.end(); p++) {
+    if (p->second.parent == lid)
+      stale.push_back(p->first);
+  }
+  if (stale.size() != 0)
+    path_generation++;
+  for (size_t i = 0; i < stale.size(); i++)
+    PathCacheErase(stale[i]);
+  pthread_mutex_unlock(&path_mutex);
+}
+
+// Acquire the lock of every inode below dir, whose own lock the caller
+// holds, top down. Taking a lock revokes it from any client caching
+// that inode, which writes back what it has and drops it, so a
+// directory is read only once no client has a newer copy, and no
+// client is left with one to flush after the subtree is freed. The
+// inodes are appended to locked, for the caller to release.
+void NameNode::LockSubtree(yfs_client::inum dir, list<yfs_client::inum> &locked) {
+  list<yfs_client::dirent> entries;
+  Readdir(dir, entries);
+  for (auto it = entries.begin(); it != entries.end(); it++) {
+    lc->acquire(it->inum);
+    locked.push_back(it->inum);
+    if (Isdir(it->inum))
+      LockSubtree(it->inum, locked);
+  }
+}
+
+// Position a listing of directory ino just after start_after. A cursor
+// saved by the previous page is reused when the directory has not been
+// modified since; otherwise the directory is read and scanned once.
+bool NameNode::OpenListing(yfs_client::inum ino, const string &start_after, ListingCursor &cursor) {
+  yfs_client::dirinfo info;
+  if (!Getdir(ino, info))
+    return false;
+  // read under the lock, and the version before the directory itself:
+  // a change by another client revokes the lock first, and a change
+  // racing with the read below leaves the cursor looking stale
+  lc->acquire(ino);
+  unsigned long long version = DirVersion(ino);
+
+  if (start_after.size() != 0) {
+    pthread_mutex_lock(&listing_mutex);
+    auto it = listing_cursors.find(make_pair(ino, start_after));
+    if (it != listing_cursors.end()) {
+      bool fresh = it->second.version == version;
+      if (fresh) {
+        cursor.entries.swap(it->second.entries);
+        cursor.next = it->second.next;
+        cursor.version = version;
+      }
+      listing_cursors.erase(it);
+      listing_cursor_order.remove(make_pair(ino, start_after));
+      if (fresh) {
+        pthread_mutex_unlock(&listing_mutex);
+        lc->release(ino);
+        return true;
+      }
+    }
+    pthread_mutex_unlock(&listing_mutex);
+  }
+
+  // not yfs->readdir: its lock client would have to take the lock
+  // from lc, which holds it
+  list<yfs_client::dirent> dir;
+  Readdir(ino, dir);
+  lc->release(ino);
+  cursor.version = version;
+  cursor.entries.assign(dir.begin(), dir.end());
+  cursor.next = 0;
+  if (start_after.size() != 0) {
+    while (cursor.next < cursor.entries.size() && cursor.entries[cursor.next].name != start_after)
+      cursor.next++;
+  }
+  return true;
+}
+
+// Park the unread tail of a listing until the client asks for the
+// page after last. Old cursors are dropped first-in first-out.
+void NameNode::SaveListing(yfs_client::inum ino, const string &last, ListingCursor &cursor) {
+  ListingKey key = make_pair(ino, last);
+  pthread_mutex_lock(&listing_mutex);
+  if (listing_cursors.count(key) == 0) {
+    while (listing_cursors.size() >= MAX_LISTING_CURSORS) {
+      listing_cursors.erase(listing_cursor_order.front());
+      listing_cursor_order.pop_front();
+    }
+    listing_cursor_order.push_back(key);
+  }
+  ListingCursor &saved = listing_cursors[key];
+  saved.version = cursor.version;
+  saved.entries.swap(cursor.entries);
+  saved.next = cursor.next;
+  pthread_mutex_unlock(&listing_mutex);
+}
+
+bool NameNode::PathCacheGet(const string &path, yfs_client::inum &ino) {
+  pthread_mutex_lock(&path_mutex);
+  auto it = path_cache.find(path);
+  if (it == path_cache.end()) {
+    pthread_mutex_unlock(&path_mutex);
+    return false;
+  }
+  ino = it->second.ino;
+  path_lru.splice(path_lru.begin(), path_lru, it->second.lru);
+  pthread_mutex_unlock(&path_mutex);
+  return true;
+}
+
+unsigned long long NameNode::PathCacheGeneration() {
+  pthread_mutex_lock(&path_mutex);
+  unsigned long long gen = path_generation;
+  pthread_mutex_unlock(&path_mutex);
+  return gen;
+}
+
+// Cache path -> ino, found in directory parent, whose lock the caller
+// holds, by a lookup that started at generation gen.
+void NameNode::PathCachePut(const string &path, yfs_client::inum ino, yfs_client::inum parent, unsigned long long gen) {
+  pthread_mutex_lock(&path_mutex);
+  if (gen != path_generation) {
+    pthread_mutex_unlock(&path_mutex);
+    return;
+  }
+  auto it = path_cache.find(path);
+  if (it != path_cache.end()) {
+    it->second.ino = ino;
+    it->second.parent = parent;
+    path_lru.splice(path_lru.begin(), path_lru, it->second.lru);
+  } else {
+    while (path_cache.size() >= MAX_PATH_CACHE) {
+      path_cache.erase(path_lru.back());
+      path_lru.pop_back();
+    }
+    path_lru.push_front(path);
+    PathEntry &e = path_cache[path];
+    e.ino = ino;
+    e.parent = parent;
+    e.lru = path_lru.begin();
+  }
+  pthread_mutex_unlock(&path_mutex);
+}
+
+// Forget path and everything below it.
+void NameNode::PathCacheInvalidate(const string &path) {
+  string prefix;
+  size_t pos = 0, next;
+  while ((next = path.find('/', pos)) != string::npos) {
+    if (next != pos)
+      prefix += "/" + path.substr(pos, next - pos);
+    pos = next + 1;
+  }
+  if (pos != path.size())
+    prefix += "/" + path.substr(pos);
+
+  pthread_mutex_lock(&path_mutex);
+  path_generation++;
+  PathCacheErase(prefix);
+  pthread_mutex_unlock(&path_mutex);
+}
+
+// Drop the normalized path prefix and its subtree; path_mutex is held.
+void NameNode::PathCacheErase(const string &prefix) {
+  auto it = path_cache.lower_bound(prefix);
+  while (it != path_cache.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+    if (it->first.size() == prefix.size() || it->first[prefix.size()] == '/') {
+      path_lru.erase(it->second.lru);
+      it = path_cache.erase(it);
+    } else
+      it++;
+  }
+}
+
 void NameNode::DatanodeHeartbeat(DatanodeIDProto id) {
   int m = 0;
   for (auto i : datanodes){
@@ -8,6 +8,7 @@
 #include <stdexcept>
 #include <set>
 #include <unordered_map>
+#include <vector>
 #include "lock_client_cache.h"
 class extent_client;
 class lock_client;
@@ -22,7 +23,7 @@ public:
 bool operator<(const DatanodeIDProto &, const DatanodeIDProto &);
 bool operator==(const DatanodeIDProto &, const DatanodeIDProto &);
 
-class NameNode {
+class NameNode : public lock_release_user {
   struct LocatedBlock {
     blockid_t block_id;
     uint64_t offset, size;
@@ -53,6 +54,49 @@ private:
   std::map<yfs_client::inum, uint32_t> pendingWrite;
 
   /* Add your member variables/functions here */
+  // Resumable GetListing state. A page that ends at entry X leaves
+  // the rest of the directory snapshot under (dir, X), so the next
+  // call with startAfter == X continues without rescanning. A cursor
+  // is only reused while the directory's version is the one it was
+  // read at; every change the NameNode makes to a directory bumps it
+  // (mtime has one-second resolution, so it cannot tell). Directories
+  // are read under their lock, which any other client has to take
+  // from the NameNode before it changes them, so losing the lock
+  // bumps the version as well.
+  struct ListingCursor {
+    unsigned long long version;
+    std::vector<yfs_client::dirent> entries;
+    size_t next;
+  };
+  typedef std::pair<yfs_client::inum, std::string> ListingKey;
+  static const size_t LISTING_LIMIT = 1000;
+  static const size_t MAX_LISTING_CURSORS = 64;
+  std::map<ListingKey, ListingCursor> listing_cursors;
+  std::list<ListingKey> listing_cursor_order;
+  std::map<yfs_client::inum, unsigned long long> dir_versions;
+  pthread_mutex_t listing_mutex;
+  unsigned long long DirVersion(yfs_client::inum dir);
+  void DirChanged(yfs_client::inum dir);
+
+  // Path resolution cache: normalized absolute path -> inum, kept in
+  // LRU order and bounded by MAX_PATH_CACHE. Only successful lookups
+  // are cached; Rename and Delete drop the affected subtree once the
+  // change is made. path_generation counts those drops, and a lookup
+  // that raced with one does not cache what it found. Each entry is
+  // found under the lock of its parent directory, and is dropped with
+  // its subtree when another client revokes that lock.
+  typedef std::list<std::string>::iterator PathLRU;
+  static const size_t MAX_PATH_CACHE = 4096;
+  struct PathEntry {
+    yfs_client::inum ino;
+    yfs_client::inum parent;
+    PathLRU lru;
+  };
+  std::map<std::string, PathEntry> path_cache;
+  std::list<std::string> path_lru;
+  unsigned long long path_generation;
+  pthread_mutex_t path_mutex;
+
   unsigned long long counter;
   std::map<DatanodeIDProto, int> datanodes;
   std::set<blockid_t> modified_blocks;
@@ -62,7 +106,11 @@ private:
   bool RecursiveLookup(const std::string &path, yfs_client::inum &ino, yfs_client::inum &last);
   bool RecursiveLookup(const std::string &path, yfs_client::inum &ino);
   bool RecursiveLookupParent(const std::string &path, yfs_client::inum &ino);
-  bool RecursiveDelete(yfs_client::inum ino);
+  bool PathCacheGet(const std::string &path, yfs_client::inum &ino);
+  unsigned long long PathCacheGeneration();
+  void PathCachePut(const std::string &path, yfs_client::inum ino, yfs_client::inum parent, unsigned long long gen);
+  void PathCacheInvalidate(const std::string &path);
+  void PathCacheErase(const std::string &prefix);
   bool ConvertLocatedBlock(const LocatedBlock &src, LocatedBlockProto &dst);
   std::list<LocatedBlock> GetBlockLocations(yfs_client::inum ino);
   bool Complete(yfs_client::inum ino, uint32_t new_size);
@@ -78,7 +126,10 @@ private:
   void DualLock(lock_protocol::lockid_t a, lock_protocol::lockid_t b);
   void DualUnlock(lock_protocol::lockid_t a, lock_protocol::lockid_t b);
   bool Readdir(yfs_client::inum, std::list<yfs_client::dirent> &);
-  bool Unlink(yfs_client::inum parent, std::string name, yfs_client::inum ino);
+  bool Unlink(yfs_client::inum parent, std::string name, yfs_client::inum ino, bool tree = false);
+  void LockSubtree(yfs_client::inum dir, std::list<yfs_client::inum> &locked);
+  bool OpenListing(yfs_client::inum ino, const std::string &start_after, ListingCursor &cursor);
+  void SaveListing(yfs_client::inum ino, const std::string &last, ListingCursor &cursor);
   static void *_RegisterDatanode(void *arg);
   void RegisterDatanode(DatanodeIDProto id);
   void DatanodeHeartbeat(DatanodeIDProto id);
@@ -87,6 +138,7 @@ private:
 public:
   void init(const std::string &extent_dst, const std::string &lock_dst);
   bool PBGetFileInfoFromInum(yfs_client::inum ino, HdfsFileStatusProto &info);
+  bool PBGetFileInfoFromAttr(const extent_protocol::attr &attr, HdfsFileStatusProto &info);
   void PBGetFileInfo(const GetFileInfoRequestProto &req, GetFileInfoResponseProto &resp);
   void PBGetListing(const GetListingRequestProto &req, GetListingResponseProto &resp);
   void PBGetBlockLocations(const GetBlockLocationsRequestProto &req, GetBlockLocationsResponseProto &resp);
@@ -104,6 +156,7 @@ public:
   void PBGetDatanodeReport(const GetDatanodeReportRequestProto &req, GetDatanodeReportResponseProto &resp);
   void PBDatanodeHeartbeat(const DatanodeHeartbeatRequestProto &req, DatanodeHeartbeatResponseProto &resp);
   void CountBeat();
+  void dorelease(lock_protocol::lockid_t lid);
 };
 
 #endif
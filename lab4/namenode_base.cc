@@ -156,26 +156,55 @@ bool NameNode::RecursiveLookup(const string &path, yfs_client::inum &ino, yfs_cl
     fprintf(stderr, "%s:%d Only absolute path allowed\n", __func__, __LINE__); fflush(stderr);
     return false;
   }
-  last = 1;
-  ino = 1;
+
+  // prefixes[i] is the normalized path of the first i components
+  vector<string> components, prefixes(1, "");
   while ((pos = path.find('/', pos)) != string::npos) {
-    if (pos != lastpos) {
-      string component = path.substr(lastpos, pos - lastpos);
-      last = ino;
-      if (yfs->lookup(ino, component.c_str(), found, ino) != yfs_client::OK || !found) {
-        fprintf(stderr, "%s:%d Lookup %s in %llu failed\n", __func__, __LINE__, component.c_str(), ino); fflush(stderr);
-        return false;
-      }
-    }
+    if (pos != lastpos)
+      components.push_back(path.substr(lastpos, pos - lastpos));
     pos++;
     lastpos = pos;
   }
+  if (lastpos != path.size())
+    components.push_back(path.substr(lastpos));
+  for (size_t i = 0; i < components.size(); i++)
+    prefixes.push_back(prefixes[i] + "/" + components[i]);
 
-  if (lastpos != path.size()) {
+  unsigned long long gen = PathCacheGeneration();
+
+  // start from the longest cached prefix
+  size_t done = components.size();
+  ino = 1;
+  while (done > 0 && !PathCacheGet(prefixes[done], ino))
+    done--;
+  if (done == 0)
+    ino = 1;
+
+  last = 1;
+  if (done == components.size() && done > 1)
+    return RecursiveLookup(prefixes[done - 1], last);
+
+  // each step reads the directory under its lock in lc and caches what
+  // it found before letting go, so that a client changing the directory
+  // later has to revoke the lock, which drops the entry
+  for (size_t i = done; i < components.size(); i++) {
     last = ino;
-    string component = path.substr(lastpos);
-    if (yfs->lookup(ino, component.c_str(), found, ino) != yfs_client::OK || !found) {
-      fprintf(stderr, "%s:%d Lookup %s in %llu failed\n", __func__, __LINE__, component.c_str(), ino); fflush(stderr);
+    list<yfs_client::dirent> entries;
+    found = false;
+    lc->acquire(last);
+    Readdir(last, entries);
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+      if (it->name == components[i]) {
+        found = true;
+        ino = it->inum;
+        break;
+      }
+    }
+    if (found)
+      PathCachePut(prefixes[i + 1], ino, last, gen);
+    lc->release(last);
+    if (!found) {
+      fprintf(stderr, "%s:%d Lookup %s in %llu failed\n", __func__, __LINE__, components[i].c_str(), last); fflush(stderr);
       return false;
     }
   }
@@ -271,33 +300,32 @@ bool NameNode::ReplicateBlock(blockid_t bid, DatanodeIDProto from, DatanodeIDPro
 // Translators
 
 bool NameNode::PBGetFileInfoFromInum(yfs_client::inum ino, HdfsFileStatusProto &info) {
+  extent_protocol::attr attr;
+  if (ec->getattr(ino, attr) != extent_protocol::OK) {
+    fprintf(stderr, "%s:%d getattr(%llu) failed\n", __func__, __LINE__, ino); fflush(stderr);
+    return false;
+  }
+  return PBGetFileInfoFromAttr(attr, info);
+}
+
+bool NameNode::PBGetFileInfoFromAttr(const extent_protocol::attr &attr, HdfsFileStatusProto &info) {
   info.set_filetype(HdfsFileStatusProto_FileType_IS_FILE);
   info.set_path("");
   info.set_length(0);
   info.set_owner("cse");
   info.set_group("supergroup");
   info.set_blocksize(BLOCK_SIZE);
-  if (Isfile(ino)) {
-    yfs_client::fileinfo yfs_info;
-    if (!Getfile(ino, yfs_info)) {
-      fprintf(stderr, "%s:%d Getfile(%llu) failed\n", __func__, __LINE__, ino); fflush(stderr);
-      return false;
-    }
-    info.set_length(yfs_info.size);
+  if (attr.type == extent_protocol::T_FILE) {
+    info.set_length(attr.size);
     info.mutable_permission()->set_perm(0666);
-    info.set_modification_time(((uint64_t) yfs_info.mtime) * 1000);
-    info.set_access_time(((uint64_t) yfs_info.atime) * 1000);
+    info.set_modification_time(((uint64_t) attr.mtime) * 1000);
+    info.set_access_time(((uint64_t) attr.atime) * 1000);
     return true;
-  } else if (Isdir(ino)) {
-    yfs_client::dirinfo yfs_info;
-    if (!Getdir(ino, yfs_info)) {
-      fprintf(stderr, "%s:%d Getdir(%llu) failed\n", __func__, __LINE__, ino); fflush(stderr);
-      return false;
-    }
+  } else if (attr.type == extent_protocol::T_DIR) {
     info.set_filetype(HdfsFileStatusProto_FileType_IS_DIR);
     info.mutable_permission()->set_perm(0777);
-    info.set_modification_time(((uint64_t) yfs_info.mtime) * 1000);
-    info.set_access_time(((uint64_t) yfs_info.atime) * 1000);
+    info.set_modification_time(((uint64_t) attr.mtime) * 1000);
+    info.set_access_time(((uint64_t) attr.atime) * 1000);
     return true;
   }
 
@@ -317,25 +345,35 @@ void NameNode::PBGetListing(const GetListingRequestProto &req, GetListingRespons
   if (!RecursiveLookup(req.src(), ino))
     return;
   string start_after(req.startafter());
-  list<yfs_client::dirent> dir;
-  if (yfs->readdir(ino, dir) != yfs_client::OK)
+  ListingCursor cursor;
+  if (!OpenListing(ino, start_after, cursor))
     throw HdfsException("read directory failed");
-  auto it = dir.begin();
-  if (start_after.size() != 0) {
-    while (it != dir.end() && it->name != start_after)
-      it++;
-  }
-  for (; it != dir.end(); it++) {
-    if (!PBGetFileInfoFromInum(it->inum, *resp.mutable_dirlist()->add_partiallisting()))
+  if (cursor.next < cursor.entries.size() && start_after.size() != 0 &&
+      cursor.entries[cursor.next].name == start_after)
+    cursor.next++;
+  size_t end = min(cursor.entries.size(), cursor.next + LISTING_LIMIT);
+  vector<extent_protocol::extentid_t> inums;
+  vector<extent_protocol::attr> attrs;
+  vector<extent_protocol::status> sts;
+  for (size_t i = cursor.next; i < end; i++)
+    inums.push_back(cursor.entries[i].inum);
+  if (ec->getattr_many(inums, attrs, sts) != extent_protocol::OK || attrs.size() != inums.size())
+    throw HdfsException("get dirent info failed");
+  for (size_t i = cursor.next; i < end; i++) {
+    auto it = cursor.entries.begin() + i;
+    // deleted since the directory was read
+    if (sts[i - cursor.next] == extent_protocol::NOENT)
+      continue;
+    if (sts[i - cursor.next] != extent_protocol::OK)
+      throw HdfsException("get dirent info failed");
+    const extent_protocol::attr &attr = attrs[i - cursor.next];
+    if (!PBGetFileInfoFromAttr(attr, *resp.mutable_dirlist()->add_partiallisting()))
       throw HdfsException("get dirent info failed");
     resp.mutable_dirlist()->mutable_partiallisting()->rbegin()->set_path(it->name);
-    if (req.needlocation() && yfs->isfile(it->inum)) {
-      yfs_client::fileinfo info;
-      if (yfs->getfile(it->inum, info) != yfs_client::OK)
-        return;
+    if (req.needlocation() && attr.type == extent_protocol::T_FILE) {
       list<LocatedBlock> blocks = GetBlockLocations(it->inum);
       LocatedBlocksProto &locations = *resp.mutable_dirlist()->mutable_partiallisting()->rbegin()->mutable_locations();
-      locations.set_filelength(info.size);
+      locations.set_filelength(attr.size);
       locations.set_underconstruction(false);
       locations.set_islastblockcomplete(true);
       int i = 0;
@@ -349,7 +387,10 @@ void NameNode::PBGetListing(const GetListingRequestProto &req, GetListingRespons
       }
     }
   }
-  resp.mutable_dirlist()->set_remainingentries(0);
+  cursor.next = end;
+  resp.mutable_dirlist()->set_remainingentries(cursor.entries.size() - end);
+  if (end < cursor.entries.size())
+    SaveListing(ino, cursor.entries[end - 1].name, cursor);
 }
 
 bool NameNode::ConvertLocatedBlock(const LocatedBlock &src, LocatedBlockProto &dst) {
@@ -441,21 +482,26 @@ void NameNode::PBCreate(const CreateRequestProto &req, CreateResponseProto &resp
   if (path[0] != '/')
     throw HdfsException("Not absolute path");
   yfs_client::inum ino = 1;
-  while ((pos = path.find('/', pos)) != string::npos) {
-    if (pos != lastpos) {
-      string component = path.substr(lastpos, pos - lastpos);
-      if (yfs->lookup(ino, component.c_str(), found, ino) != yfs_client::OK)
-        throw HdfsException("Traverse failed");
-      if (!found) {
-        if (req.createparent()) {
-          if (!Mkdir(ino, component.c_str(), 0777, ino))
-            throw HdfsException("Create parent failed");
-        } else
-          throw HdfsException("Parent not exists");
+  lastpos = path.rfind('/') + 1;
+  if (!RecursiveLookup(path.substr(0, lastpos), ino)) {
+    ino = 1;
+    pos = lastpos = 1;
+    while ((pos = path.find('/', pos)) != string::npos) {
+      if (pos != lastpos) {
+        string component = path.substr(lastpos, pos - lastpos);
+        if (yfs->lookup(ino, component.c_str(), found, ino) != yfs_client::OK)
+          throw HdfsException("Traverse failed");
+        if (!found) {
+          if (req.createparent()) {
+            if (!Mkdir(ino, component.c_str(), 0777, ino))
+              throw HdfsException("Create parent failed");
+          } else
+            throw HdfsException("Parent not exists");
+        }
       }
+      pos++;
+      lastpos = pos;
     }
-    pos++;
-    lastpos = pos;
   }
 
   if (lastpos != path.size()) {
@@ -519,7 +565,13 @@ void NameNode::PBRename(const RenameRequestProto &req, RenameResponseProto &resp
   }
   src_name = req.src().substr(req.src().rfind('/') + 1);
   dst_name = req.dst().substr(req.dst().rfind('/') + 1);
+  // evict only once the directories have changed, and while they are
+  // still locked, so a lookup cannot cache the old names again
+  DualLock(src_dir_ino, dst_dir_ino);
   resp.set_result(Rename(src_dir_ino, src_name, dst_dir_ino, dst_name));
+  PathCacheInvalidate(req.src());
+  PathCacheInvalidate(req.dst());
+  DualUnlock(src_dir_ino, dst_dir_ino);
 }
 
 void NameNode::DualLock(lock_protocol::lockid_t a, lock_protocol::lockid_t b) {
@@ -542,31 +594,6 @@ void NameNode::DualUnlock(lock_protocol::lockid_t a, lock_protocol::lockid_t b)
   }
 }
 
-bool NameNode::RecursiveDelete(yfs_client::inum ino) {
-  list<yfs_client::dirent> dir;
-  if (!Isdir(ino))
-    return true;
-  if (!Readdir(ino, dir)) {
-    fprintf(stderr, "%s:%d Readdir(%llu) failed\n", __func__, __LINE__, ino); fflush(stderr);
-    return false;
-  }
-  for (auto it = dir.begin(); it != dir.end(); it++) {
-    lc->acquire(it->inum);
-    if (!RecursiveDelete(it->inum)) {
-      lc->release(it->inum);
-      fprintf(stderr, "%s:%d recursively delete %s failed\n", __func__, __LINE__, it->name.c_str()); fflush(stderr);
-      return false;
-    }
-    if (!Unlink(ino, it->name, it->inum)) {
-      lc->release(it->inum);
-      fprintf(stderr, "%s:%d delete %s failed\n", __func__, __LINE__, it->name.c_str()); fflush(stderr);
-      return false;
-    }
-    lc->release(it->inum);
-  }
-  return true;
-}
-
 void NameNode::PBDelete(const DeleteRequestProto &req, DeleteResponseProto &resp) {
   yfs_client::inum ino, parent;
   if (!RecursiveLookup(req.src(), ino, parent)) {
@@ -574,14 +601,7 @@ void NameNode::PBDelete(const DeleteRequestProto &req, DeleteResponseProto &resp
     return;
   }
   DualLock(ino, parent);
-  if (req.recursive()) {
-    if (!RecursiveDelete(ino)) {
-      resp.set_result(false);
-      DualUnlock(ino, parent);
-      return;
-    }
-  }
-  if (Isdir(ino)) {
+  if (!req.recursive() && Isdir(ino)) {
     list<yfs_client::dirent> dir;
     if (!Readdir(ino, dir)) {
       resp.set_result(false);
@@ -594,11 +614,20 @@ void NameNode::PBDelete(const DeleteRequestProto &req, DeleteResponseProto &resp
       return;
     }
   }
-  if (!Unlink(parent, req.src().substr(req.src().rfind('/') + 1), ino)) {
+  // a subtree is freed by the extent server later; before that, every
+  // client caching part of it has to let go of it
+  list<yfs_client::inum> locked;
+  if (req.recursive() && Isdir(ino))
+    LockSubtree(ino, locked);
+  bool unlinked = Unlink(parent, req.src().substr(req.src().rfind('/') + 1), ino, req.recursive());
+  for (auto it = locked.rbegin(); it != locked.rend(); it++)
+    lc->release(*it);
+  if (!unlinked) {
     resp.set_result(false);
     DualUnlock(ino, parent);
     return;
   }
+  PathCacheInvalidate(req.src());
   resp.set_result(true);
   DualUnlock(ino, parent);
 }
@@ -610,21 +639,26 @@ void NameNode::PBMkdirs(const MkdirsRequestProto &req, MkdirsResponseProto &resp
   if (path[0] != '/')
     throw HdfsException("Not absolute path");
   yfs_client::inum ino = 1;
-  while ((pos = path.find('/', pos)) != string::npos) {
-    if (pos != lastpos) {
-      string component = path.substr(lastpos, pos - lastpos);
-      if (yfs->lookup(ino, component.c_str(), found, ino) != yfs_client::OK)
-        throw HdfsException("Traverse failed");
-      if (!found) {
-        if (req.createparent()) {
-          if (!Mkdir(ino, component.c_str(), 0777, ino))
-            throw HdfsException("Create parent failed");
-        } else
-          throw HdfsException("Parent not exists");
+  lastpos = path.rfind('/') + 1;
+  if (!RecursiveLookup(path.substr(0, lastpos), ino)) {
+    ino = 1;
+    pos = lastpos = 1;
+    while ((pos = path.find('/', pos)) != string::npos) {
+      if (pos != lastpos) {
+        string component = path.substr(lastpos, pos - lastpos);
+        if (yfs->lookup(ino, component.c_str(), found, ino) != yfs_client::OK)
+          throw HdfsException("Traverse failed");
+        if (!found) {
+          if (req.createparent()) {
+            if (!Mkdir(ino, component.c_str(), 0777, ino))
+              throw HdfsException("Create parent failed");
+          } else
+            throw HdfsException("Parent not exists");
+        }
       }
+      pos++;
+      lastpos = pos;
     }
-    pos++;
-    lastpos = pos;
   }
 
   if (lastpos != path.size()) {
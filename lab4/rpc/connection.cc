@@ -0,0 +1,1071 @@
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <set>
+
+#include "connection.h"
+#include "slock.h"
+#include "pollmgr.h"
+#include "jsl_log.h"
+#include "gettime.h"
+#include "rpcbuf.h"
+#include "shmchan.h"
+#include "rpc_stats.h"
+#include "lang/verify.h"
+
+#define MAX_PDU (10<<20) //maximum PDF is 10M
+#define WRITE_IOV 64 //iovecs handed to one writev()
+#define READ_AHEAD 16384 //smaller reads go through a buffer this big
+
+// pdus one write may carry, from RPC_COALESCE
+static int
+coalesce_max()
+{
+	static int max = -1;
+	if (max < 0) {
+		char *env = getenv("RPC_COALESCE");
+		int n = env ? atoi(env) : 0;
+		max = n > 1 ? n : 1;
+	}
+	return max;
+}
+
+// how long, in microseconds, a write waits for more pdus, from
+// RPC_COALESCE_US
+static int
+coalesce_us()
+{
+	static int us = -1;
+	if (us < 0) {
+		char *env = getenv("RPC_COALESCE_US");
+		int n = env ? atoi(env) : 0;
+		us = n > 0 ? n : 0;
+	}
+	return us;
+}
+
+static rpc_hist &
+batch_hist()
+{
+	static rpc_hist h;
+	return h;
+}
+static std::atomic<unsigned long long> pdus_in_(0);
+static std::atomic<unsigned long long> reads_(0);
+
+void
+connection_stats(rpc_histdata *batch, unsigned long long *pdus_in,
+		unsigned long long *reads)
+{
+	batch_hist().get(batch);
+	*pdus_in = pdus_in_.load(std::memory_order_relaxed);
+	*reads = reads_.load(std::memory_order_relaxed);
+}
+
+
+connection::connection(chanmgr *m1, int f1, int l1, shmchan *shm)
+: mgr_(m1), fd_(f1), shm_(shm), dead_(false), wiov_(NULL), wiovcnt_(0),
+	writing_(false), inwrite_(false), last_batch_(0), hdrn_(0), ra_(NULL), raoff_(0),
+	ralen_(0), waiters_(0), refno_(1),lossy_(l1)
+{
+
+	int flags = fcntl(fd_, F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(fd_, F_SETFL, flags);
+
+	signal(SIGPIPE, SIG_IGN);
+	VERIFY(pthread_mutex_init(&m_,0)==0);
+	VERIFY(pthread_mutex_init(&ref_m_,0)==0);
+	VERIFY(pthread_cond_init(&send_wait_,0)==0);
+	VERIFY(pthread_cond_init(&send_complete_,0)==0);
+	VERIFY(pthread_cond_init(&linger_c_,0)==0);
+
+	VERIFY(gettimeofday(&create_time_, NULL) == 0);
+
+	PollMgr::Instance()->add_callback(fd_, CB_RDONLY, this);
+	if (shm_) {
+		// on the same loop, so the two callbacks never overlap
+		PollMgr::Instance()->add_callback(shm_->doorbell(), CB_RDONLY,
+				this, PollMgr::Instance()->loop_of(fd_));
+	}
+}
+
+connection::~connection()
+{
+	VERIFY(dead_);
+	VERIFY(pthread_mutex_destroy(&m_)== 0);
+	VERIFY(pthread_mutex_destroy(&ref_m_)== 0);
+	VERIFY(pthread_cond_destroy(&send_wait_) == 0);
+	VERIFY(pthread_cond_destroy(&send_complete_) == 0);
+	VERIFY(pthread_cond_destroy(&linger_c_) == 0);
+	rpcbuf_free(rpdu_.buf);
+	rpcbuf_free(ra_);
+	VERIFY(!wpdu_.buf);
+	VERIFY(outq_.empty());
+	close(fd_);
+	delete shm_;
+}
+
+void
+connection::incref()
+{
+	ScopedLock ml(&ref_m_);
+	refno_++;
+}
+
+bool
+connection::isdead()
+{
+	ScopedLock ml(&m_);
+	return dead_;
+}
+
+void
+connection::closeconn()
+{
+	{
+		ScopedLock ml(&m_);
+		if (!dead_) {
+			dead_ = true;
+			shutdown(fd_,SHUT_RDWR);
+		}else{
+			return;
+		}
+	}
+	//after block_remove_fd, the loop will never wait on fd_
+	//and no callbacks will be active
+	unwatch(true);
+}
+
+// stop the callbacks, waiting for running ones if block
+void
+connection::unwatch(bool block)
+{
+	PollMgr *pm = PollMgr::Instance();
+	if (block) {
+		pm->block_remove_fd(fd_);
+		if (shm_)
+			pm->block_remove_fd(shm_->doorbell());
+	} else {
+		pm->del_callback(fd_, CB_RDWR);
+		if (shm_)
+			pm->del_callback(shm_->doorbell(), CB_RDWR);
+	}
+}
+
+void
+connection::decref()
+{
+	VERIFY(pthread_mutex_lock(&ref_m_)==0);
+	refno_ --;
+	VERIFY(refno_>=0);
+	if (refno_==0) {
+		VERIFY(pthread_mutex_lock(&m_)==0);
+		if (dead_) {
+			VERIFY(pthread_mutex_unlock(&ref_m_)==0);
+			VERIFY(pthread_mutex_unlock(&m_)==0);
+			delete this;
+			return;
+		}
+		VERIFY(pthread_mutex_unlock(&m_)==0);
+	}
+	pthread_mutex_unlock(&ref_m_);
+}
+
+int
+connection::ref()
+{
+	ScopedLock rl(&ref_m_);
+	return refno_;
+}
+
+int
+connection::compare(connection *another)
+{
+	if (create_time_.tv_sec > another->create_time_.tv_sec)
+		return 1;
+	if (create_time_.tv_sec < another->create_time_.tv_sec)
+		return -1;
+	if (create_time_.tv_usec > another->create_time_.tv_usec)
+		return 1;
+	if (create_time_.tv_usec < another->create_time_.tv_usec)
+		return -1;
+	return 0;
+}
+
+bool
+connection::send(char *b, int sz)
+{
+	struct iovec v;
+	v.iov_base = b;
+	v.iov_len = sz;
+	return sendv(&v, 1);
+}
+
+bool
+connection::sendv(const struct iovec *v, int n)
+{
+	outpdu me;
+	me.v = v;
+	me.n = n;
+	me.sz = 0;
+	me.state = 0;
+	for (int i = 0; i < n; i++)
+		me.sz += v[i].iov_len;
+	int sz = htonl(me.sz);
+	bcopy(&sz, v[0].iov_base, sizeof(sz));
+
+	ScopedLock ml(&m_);
+	if (dead_)
+		return false;
+	outq_.push_back(&me);
+	if (writing_ && coalesce_max() > 1)
+		pthread_cond_signal(&linger_c_);
+	while (me.state == 0) {
+		if (dead_) {
+			// nobody will write it now; a batch that failed may
+			// already have taken it off outq_
+			std::deque<outpdu *>::iterator i =
+				std::find(outq_.begin(), outq_.end(), &me);
+			if (i != outq_.end())
+				outq_.erase(i);
+			break;
+		}
+		if (writing_) {
+			waiters_++;
+			VERIFY(pthread_cond_wait(&send_wait_, &m_)==0);
+			waiters_--;
+			continue;
+		}
+		writebatch();
+	}
+	return me.state > 0;
+}
+
+// write the pdus at the head of outq_, as many as coalescing allows,
+// and tell their senders how it went. called with m_ held and nobody
+// else writing.
+void
+connection::writebatch()
+{
+	VERIFY(!writing_ && !outq_.empty());
+	writing_ = true;
+
+	int max = coalesce_max();
+	int us = coalesce_us();
+	if (us > 0 && last_batch_ > 1 && (int)outq_.size() < max) {
+		// the last write was shared, so more senders are likely
+		// close behind; give them a moment to join this one
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += us / 1000000;
+		deadline.tv_nsec += (us % 1000000) * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!dead_ && (int)outq_.size() < max &&
+				pthread_cond_timedwait(&linger_c_, &m_, &deadline) != ETIMEDOUT)
+			;
+	}
+
+	int take = std::min((int)outq_.size(), max);
+	std::vector<outpdu *> batch(outq_.begin(), outq_.begin() + take);
+	outq_.erase(outq_.begin(), outq_.begin() + take);
+	std::vector<struct iovec> iov;
+	int sz = 0;
+	for (int i = 0; i < take; i++) {
+		iov.insert(iov.end(), batch[i]->v, batch[i]->v + batch[i]->n);
+		sz += batch[i]->sz;
+	}
+
+	bool ok = false;
+	if (!dead_) {
+		wpdu_.buf = (char *)iov[0].iov_base;
+		wpdu_.sz = sz;
+		wpdu_.solong = 0;
+		wiov_ = &iov[0];
+		wiovcnt_ = iov.size();
+
+		if (lossy_) {
+			if ((random()%100) < lossy_) {
+				jsl_log(JSL_DBG_1, "connection::send LOSSY TEST shutdown fd_ %d\n", fd_);
+				shutdown(fd_,SHUT_RDWR);
+			}
+		}
+
+		bool wrote;
+		if (max > 1) {
+			// write without m_, so more senders can queue up for
+			// the next write meanwhile
+			inwrite_ = true;
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+			wrote = writepdu();
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+			inwrite_ = false;
+			// write_cb() or the doorbell may have come and gone
+			if (wrote && wpdu_.solong < wpdu_.sz)
+				wrote = writepdu();
+		} else {
+			wrote = writepdu();
+		}
+		if (!wrote) {
+			dead_ = true;
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+			unwatch(true);
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+		}else{
+			if (wpdu_.solong == wpdu_.sz) {
+			}else{
+				//should be rare to need to explicitly add write callback.
+				//a shm ring rings our doorbell when it has room.
+				if (!shm_)
+					PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
+				while (!dead_ && wpdu_.solong >= 0 && wpdu_.solong < wpdu_.sz) {
+					VERIFY(pthread_cond_wait(&send_complete_,&m_) == 0);
+				}
+			}
+		}
+		ok = (!dead_ && wpdu_.solong == wpdu_.sz);
+		wpdu_.solong = wpdu_.sz = 0;
+		wpdu_.buf = NULL;
+		wiov_ = NULL;
+		wiovcnt_ = 0;
+		batch_hist().record(take);
+	}
+
+	for (int i = 0; i < take; i++)
+		batch[i]->state = ok ? 1 : -1;
+	last_batch_ = take;
+	writing_ = false;
+	if (waiters_ > 0)
+		pthread_cond_broadcast(&send_wait_);
+}
+
+//fd_ is ready to be written
+void
+connection::write_cb(int s)
+{
+	ScopedLock ml(&m_);
+	VERIFY(fd_ == s);
+	if (dead_ || inwrite_)
+		return;
+	if (wpdu_.sz == 0) {
+		PollMgr::Instance()->del_callback(fd_,CB_WRONLY);
+		return;
+	}
+	if (!writepdu()) {
+		unwatch(false);
+		dead_ = true;
+	}else{
+		VERIFY(wpdu_.solong >= 0);
+		if (wpdu_.solong < wpdu_.sz) {
+			return;
+		}
+	}
+	pthread_cond_signal(&send_complete_);
+}
+
+//fd_ is ready to be read, or the shm doorbell rang
+void
+connection::read_cb(int s)
+{
+	ScopedLock ml(&m_);
+	if (shm_ && s == fd_) {
+		// nothing is sent on the socket; it only closes
+		char c;
+		int n = ::read(fd_, &c, 1);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			unwatch(false);
+			dead_ = true;
+			pthread_cond_signal(&send_complete_);
+			return;
+		}
+	} else if (shm_) {
+		VERIFY(s == shm_->doorbell());
+		shm_->drain();
+		// a send may be waiting for room in the ring
+		if (!dead_ && !inwrite_ && wpdu_.buf && wpdu_.solong >= 0 && wpdu_.solong < wpdu_.sz) {
+			if (!writepdu()) {
+				unwatch(false);
+				dead_ = true;
+			}
+			if (dead_ || wpdu_.solong == wpdu_.sz)
+				pthread_cond_signal(&send_complete_);
+		}
+	} else {
+		VERIFY(fd_ == s);
+	}
+
+	// the poll loop only tells us about new data once, so keep
+	// reading until the socket would block
+	while (!dead_) {
+		if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
+			if (!mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
+				// the chanmgr cannot take it now; leave the rest in
+				// the socket and hand this one over again shortly
+				PollMgr::Instance()->defer_read(fd_);
+				return;
+			}
+			//chanmgr has successfully consumed the pdu
+			pdus_in_.fetch_add(1, std::memory_order_relaxed);
+			rpdu_.buf = NULL;
+			rpdu_.sz = rpdu_.solong = 0;
+		}
+
+		int n = readpdu();
+		if (n == 0)
+			return;
+		if (n < 0) {
+			unwatch(false);
+			dead_ = true;
+			pthread_cond_signal(&send_complete_);
+		}
+	}
+}
+
+bool
+connection::writepdu()
+{
+	VERIFY(wpdu_.solong >= 0);
+
+	while (wpdu_.solong < wpdu_.sz) {
+		// pick up where the last write stopped
+		struct iovec v[WRITE_IOV];
+		int i = 0, cnt = 0;
+		size_t skip = wpdu_.solong;
+		while (wiov_[i].iov_len <= skip)
+			skip -= wiov_[i++].iov_len;
+		for (; i < wiovcnt_ && cnt < WRITE_IOV; i++, cnt++) {
+			v[cnt].iov_base = (char *)wiov_[i].iov_base + skip;
+			v[cnt].iov_len = wiov_[i].iov_len - skip;
+			skip = 0;
+		}
+		int n = wrv(v, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
+				wpdu_.solong = -1;
+				wpdu_.sz = 0;
+			}
+			return (errno == EAGAIN);
+		}
+		wpdu_.solong += n;
+	}
+	return true;
+}
+
+int
+connection::rd(char *b, int n)
+{
+	int r;
+	if (shm_)
+		r = shm_->read(b, n);
+	else
+		r = read(fd_, b, n);
+	if (r > 0)
+		reads_.fetch_add(1, std::memory_order_relaxed);
+	return r;
+}
+
+// like rd(), but small reads from a socket fill ra_ and are served
+// from it, so one read(2) picks up every pdu that has arrived. a shm
+// ring is already memory, and large reads go straight to b.
+int
+connection::rdahead(char *b, int n)
+{
+	if (ralen_ > 0) {
+		int k = std::min(n, ralen_);
+		memcpy(b, ra_ + raoff_, k);
+		raoff_ += k;
+		ralen_ -= k;
+		if (ralen_ == 0) {
+			rpcbuf_free(ra_);
+			ra_ = NULL;
+		}
+		return k;
+	}
+	if (shm_ || n >= READ_AHEAD)
+		return rd(b, n);
+
+	ra_ = rpcbuf_alloc(READ_AHEAD);
+	int r = rd(ra_, READ_AHEAD);
+	if (r <= 0) {
+		int e = errno;
+		rpcbuf_free(ra_);
+		ra_ = NULL;
+		errno = e;
+		return r;
+	}
+	raoff_ = 0;
+	ralen_ = r;
+	return rdahead(b, n);
+}
+
+int
+connection::wrv(const struct iovec *v, int n)
+{
+	if (shm_)
+		return shm_->writev(v, n);
+	return writev(fd_, v, n);
+}
+
+// read what is available of the current pdu.
+// returns the number of bytes read, 0 if the socket would block,
+// and -1 if the connection has failed.
+int
+connection::readpdu()
+{
+	int got = 0;
+	if (!rpdu_.sz) {
+		int sz, sz1;
+		// the size may arrive in pieces
+		int n = rdahead(hdr_ + hdrn_, sizeof(sz1) - hdrn_);
+
+		if (n == 0) {
+			return -1;
+		}
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			return -1;
+		}
+
+		hdrn_ += n;
+		got = n;
+		if (hdrn_ < (int)sizeof(sz1))
+			return got;
+		hdrn_ = 0;
+		bcopy(hdr_, &sz1, sizeof(sz1));
+		sz = ntohl(sz1);
+
+		if (sz > MAX_PDU || sz < (int)sizeof(sz)) {
+			char *tmpb = (char *)&sz1;
+			jsl_log(JSL_DBG_2, "connection::readpdu read pdu TOO BIG %d network order=%x %x %x %x %x\n", sz, sz1, tmpb[0],tmpb[1],tmpb[2],tmpb[3]);
+			return -1;
+		}
+
+		rpdu_.sz = sz;
+		VERIFY(rpdu_.buf == NULL);
+		rpdu_.buf = rpcbuf_alloc(sz);
+		bcopy(&sz1,rpdu_.buf,sizeof(sz));
+		rpdu_.solong = sizeof(sz);
+		if (rpdu_.solong == rpdu_.sz)
+			return got;
+	}
+
+	int n = rdahead(rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
+	if (n <= 0) {
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return got;
+		rpcbuf_free(rpdu_.buf);
+		rpdu_.buf = NULL;
+		rpdu_.sz = rpdu_.solong = 0;
+		return -1;
+	}
+	rpdu_.solong += n;
+	return got + n;
+}
+
+static int
+listen_on(int port, bool reuseport)
+{
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+
+	int tcp = socket(AF_INET, SOCK_STREAM, 0);
+	if (tcp < 0) {
+		perror("tcpsconn::tcpsconn accept_loop socket:");
+		VERIFY(0);
+	}
+
+	int yes = 1;
+	setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+	if (reuseport)
+		setsockopt(tcp, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+#endif
+	setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	if (bind(tcp, (sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("accept_loop tcp bind:");
+		VERIFY(0);
+	}
+
+	if (listen(tcp, SOMAXCONN) < 0) {
+		perror("tcpsconn::tcpsconn listen:");
+		VERIFY(0);
+	}
+
+	int flags = fcntl(tcp, F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(tcp, F_SETFL, flags);
+	return tcp;
+}
+
+// $RPC_SOCK_DIR, or a directory of the user's own in /tmp
+static std::string
+local_dir()
+{
+	const char *dir = getenv("RPC_SOCK_DIR");
+	if (dir)
+		return dir;
+	char p[32];
+	snprintf(p, sizeof(p), "/tmp/rpc-%u", (unsigned)geteuid());
+	return p;
+}
+
+// where the rpcs on port listens for local connections of kind
+static std::string
+local_path(int port, const char *kind)
+{
+	char p[32];
+	snprintf(p, sizeof(p), "/rpc-%d.%s", port, kind);
+	return local_dir() + p;
+}
+
+// the default directory is made private to the user. one made by
+// someone else, or open to others, is not used at all.
+static bool
+local_dir_ok()
+{
+	std::string dir = local_dir();
+	if (getenv("RPC_SOCK_DIR"))
+		return true;
+	struct stat st;
+	if ((mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) ||
+			lstat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode) ||
+			st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+		jsl_log(JSL_DBG_1, "local_dir_ok: cannot use %s\n", dir.c_str());
+		return false;
+	}
+	return true;
+}
+
+// the sockets this process listens on, removed when it exits
+static pthread_mutex_t local_m = PTHREAD_MUTEX_INITIALIZER;
+static std::set<std::string> *local_paths;
+
+static void
+unlink_local()
+{
+	ScopedLock ml(&local_m);
+	std::set<std::string>::iterator i;
+	for (i = local_paths->begin(); i != local_paths->end(); i++)
+		unlink(i->c_str());
+	local_paths->clear();
+}
+
+static void
+forget_local(const std::string &path)
+{
+	ScopedLock ml(&local_m);
+	unlink(path.c_str());
+	if (local_paths)
+		local_paths->erase(path);
+}
+
+static int
+listen_unix(const std::string &path)
+{
+	struct sockaddr_un sun;
+	if (path.size() >= sizeof(sun.sun_path)) {
+		jsl_log(JSL_DBG_1, "listen_unix: path too long %s\n", path.c_str());
+		return -1;
+	}
+	if (!local_dir_ok())
+		return -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path.c_str());
+
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0)
+		return -1;
+	unlink(path.c_str());
+	if (bind(s, (sockaddr *)&sun, sizeof(sun)) < 0 ||
+			chmod(path.c_str(), 0600) < 0 ||
+			listen(s, SOMAXCONN) < 0) {
+		jsl_log(JSL_DBG_1, "listen_unix: cannot listen on %s errno %d\n",
+				path.c_str(), errno);
+		close(s);
+		unlink(path.c_str());
+		return -1;
+	}
+	{
+		ScopedLock ml(&local_m);
+		if (!local_paths) {
+			local_paths = new std::set<std::string>;
+			atexit(unlink_local);
+		}
+		local_paths->insert(path);
+	}
+	int flags = fcntl(s, F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(s, F_SETFL, flags);
+	return s;
+}
+
+tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest)
+: unix_(-1), shm_(-1), port_(port), mgr_(m1), lossy_(lossytest), gc_size_(64)
+{
+
+	VERIFY(pthread_mutex_init(&m_,NULL) == 0);
+
+	PollMgr *pm = PollMgr::Instance();
+	int n = pm->loops();
+#ifndef SO_REUSEPORT
+	n = 1;
+#endif
+	for (int i = 0; i < n; i++) {
+		tcp_.push_back(listen_on(port_, n > 1));
+		if (port_ == 0) {
+			// the rest have to share the port picked for the first one
+			struct sockaddr_in sin;
+			socklen_t addrlen = sizeof(sin);
+			VERIFY(getsockname(tcp_[0], (sockaddr *)&sin, &addrlen) == 0);
+			port_ = ntohs(sin.sin_port);
+		}
+	}
+
+	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d with %d sockets\n",
+			port_, n);
+
+	for (int i = 0; i < n; i++)
+		pm->add_callback(tcp_[i], CB_RDONLY, this, i);
+
+	unix_path_ = local_path(port_, "sock");
+	shm_path_ = local_path(port_, "shm");
+	unix_ = listen_unix(unix_path_);
+	shm_ = listen_unix(shm_path_);
+	if (unix_ >= 0)
+		pm->add_callback(unix_, CB_RDONLY, this);
+	if (shm_ >= 0)
+		pm->add_callback(shm_, CB_RDONLY, this);
+}
+
+tcpsconn::~tcpsconn()
+{
+	for (unsigned int i = 0; i < tcp_.size(); i++) {
+		PollMgr::Instance()->block_remove_fd(tcp_[i]);
+		close(tcp_[i]);
+	}
+	if (unix_ >= 0) {
+		PollMgr::Instance()->block_remove_fd(unix_);
+		close(unix_);
+		forget_local(unix_path_);
+	}
+	if (shm_ >= 0) {
+		PollMgr::Instance()->block_remove_fd(shm_);
+		close(shm_);
+		forget_local(shm_path_);
+	}
+	// a handshake may be finishing on its loop meanwhile; whatever
+	// it has not taken out of handshakes_ is ours to close
+	std::vector<int> waiting;
+	{
+		ScopedLock ml(&m_);
+		std::map<int, unsigned long long>::iterator i;
+		for (i = handshakes_.begin(); i != handshakes_.end(); i++)
+			waiting.push_back(i->first);
+	}
+	for (unsigned int i = 0; i < waiting.size(); i++) {
+		PollMgr::Instance()->block_remove_fd(waiting[i]);
+		ScopedLock ml(&m_);
+		if (handshakes_.erase(waiting[i]))
+			close(waiting[i]);
+	}
+
+	//close all the active connections
+	{
+		ScopedLock ml(&m_);
+		std::map<int, connection *>::iterator i;
+		for (i = conns_.begin(); i != conns_.end(); i++) {
+			i->second->closeconn();
+			i->second->decref();
+		}
+	}
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+}
+
+void
+tcpsconn::process_accept(int s1, shmchan *shm)
+{
+	connection *ch = new connection(mgr_, s1, lossy_, shm);
+
+	ScopedLock ml(&m_);
+	// garbage collect all dead connections with refcount of 1, once
+	// the map has doubled since the last time
+	if (conns_.size() >= gc_size_) {
+		std::map<int, connection *>::iterator i;
+		for (i = conns_.begin(); i != conns_.end();) {
+			if (i->second->isdead() && i->second->ref() == 1) {
+				jsl_log(JSL_DBG_2, "accept_loop garbage collected fd=%d\n",
+						i->second->channo());
+				i->second->decref();
+				// Careful not to reuse i right after erase. (i++) will
+				// be evaluated before the erase call because in C++,
+				// there is a sequence point before a function call.
+				// See http://en.wikipedia.org/wiki/Sequence_point.
+				conns_.erase(i++);
+			} else
+				++i;
+		}
+		gc_size_ = conns_.size() * 2 > 64 ? conns_.size() * 2 : 64;
+	}
+
+	conns_[ch->channo()] = ch;
+}
+
+// the client sends its rings and doorbells right after connecting.
+// false if they have not come yet: this runs on a PollMgr loop, so it
+// never waits for them.
+bool
+tcpsconn::accept_shm(int s1)
+{
+	int ringsz;
+	struct iovec v = { &ringsz, sizeof(ringsz) };
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &v;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	shmchan *shm = NULL;
+	int n = recvmsg(s1, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return false;
+	struct cmsghdr *cm = n == sizeof(ringsz) ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+			cm->cmsg_len == CMSG_LEN(3 * sizeof(int))) {
+		int fds[3];
+		memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+		if (ringsz == SHM_RING) {
+			shm = shmchan::attach(fds);
+		} else {
+			for (int i = 0; i < 3; i++)
+				close(fds[i]);
+		}
+	}
+
+	// the connection takes over the fd from us
+	bool waited;
+	{
+		ScopedLock ml(&m_);
+		waited = handshakes_.erase(s1) != 0;
+	}
+	if (waited)
+		PollMgr::Instance()->block_remove_fd(s1);
+
+	if (!shm) {
+		jsl_log(JSL_DBG_1, "tcpsconn::accept_shm bad handshake on fd %d\n", s1);
+		close(s1);
+		return true;
+	}
+	jsl_log(JSL_DBG_2, "accept_loop got shm connection fd=%d\n", s1);
+	process_accept(s1, shm);
+	return true;
+}
+
+// watch s1 until its rings come, giving up on those that have kept
+// us waiting for more than a second
+void
+tcpsconn::wait_shm(int s1)
+{
+	unsigned long long now = rpc_now_us();
+	std::vector<int> expired;
+	{
+		ScopedLock ml(&m_);
+		std::map<int, unsigned long long>::iterator i;
+		for (i = handshakes_.begin(); i != handshakes_.end();) {
+			if (now - i->second > 1000000) {
+				expired.push_back(i->first);
+				handshakes_.erase(i++);
+			} else
+				++i;
+		}
+		handshakes_[s1] = now;
+	}
+	// all of them are served by this loop, the shm listener's
+	for (unsigned int i = 0; i < expired.size(); i++) {
+		jsl_log(JSL_DBG_1, "tcpsconn::wait_shm no rings on fd %d\n",
+				expired[i]);
+		PollMgr::Instance()->block_remove_fd(expired[i]);
+		close(expired[i]);
+	}
+	PollMgr::Instance()->add_callback(s1, CB_RDONLY, this);
+}
+
+// a listening socket is readable; accept everything that is queued
+void
+tcpsconn::read_cb(int s)
+{
+	bool handshake;
+	{
+		ScopedLock ml(&m_);
+		handshake = handshakes_.count(s) != 0;
+	}
+	if (handshake) {
+		accept_shm(s);
+		return;
+	}
+
+	while (1) {
+		sockaddr_in sin;
+		socklen_t slen = sizeof(sin);
+		int s1 = (s == unix_ || s == shm_) ? accept(s, NULL, NULL) :
+			accept(s, (sockaddr *)&sin, &slen);
+		if (s1 < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// most likely out of descriptors; what is left in the
+			// backlog is picked up when we try again
+			jsl_log(JSL_DBG_1, "tcpsconn::read_cb accept errno %d\n", errno);
+			PollMgr::Instance()->defer_read(s);
+			return;
+		}
+
+		if (s == shm_) {
+			if (!accept_shm(s1))
+				wait_shm(s1);
+			continue;
+		}
+		if (s == unix_) {
+			jsl_log(JSL_DBG_2, "accept_loop got unix connection fd=%d\n", s1);
+		} else {
+			jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n",
+					s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+		}
+		process_accept(s1);
+	}
+}
+
+void
+set_transport(sockaddr_in *a, rpc_transport t)
+{
+	a->sin_zero[0] = t;
+}
+
+rpc_transport
+get_transport(const sockaddr_in &a)
+{
+	return (rpc_transport)a.sin_zero[0];
+}
+
+static int
+connect_unix(const std::string &path)
+{
+	struct sockaddr_un sun;
+	if (path.size() >= sizeof(sun.sun_path))
+		return -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path.c_str());
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s >= 0 && connect(s, (sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static connection *
+connect_local(int port, rpc_transport t, chanmgr *mgr, int lossy)
+{
+	std::string path = local_path(port, t == RPC_SHM ? "shm" : "sock");
+	int s = connect_unix(path);
+	if (s < 0) {
+		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s\n", path.c_str());
+		return NULL;
+	}
+	if (t == RPC_UNIX) {
+		jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to %s\n", s, path.c_str());
+		return new connection(mgr, s, lossy);
+	}
+
+	int fds[3];
+	shmchan *shm = shmchan::create(fds);
+	if (!shm) {
+		close(s);
+		return NULL;
+	}
+	int ringsz = SHM_RING;
+	struct iovec v = { &ringsz, sizeof(ringsz) };
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &v;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	int n = sendmsg(s, &msg, MSG_NOSIGNAL);
+	close(fds[0]);
+	if (n != sizeof(ringsz)) {
+		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst cannot hand over rings to %s\n",
+				path.c_str());
+		delete shm;
+		close(s);
+		return NULL;
+	}
+	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to %s with shm rings\n",
+			s, path.c_str());
+	return new connection(mgr, s, lossy, shm);
+}
+
+connection *
+connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
+{
+	rpc_transport t = get_transport(dst);
+	if (t != RPC_TCP)
+		return connect_local(ntohs(dst.sin_port), t, mgr, lossy);
+
+	static const char *env = getenv("RPC_TRANSPORT");
+	if (env && (ntohl(dst.sin_addr.s_addr) >> 24) == 127) {
+		t = !strcmp(env, "shm") ? RPC_SHM : !strcmp(env, "unix") ? RPC_UNIX : RPC_TCP;
+		connection *c = NULL;
+		if (t != RPC_TCP && access(local_path(ntohs(dst.sin_port),
+						t == RPC_SHM ? "shm" : "sock").c_str(), F_OK) == 0)
+			c = connect_local(ntohs(dst.sin_port), t, mgr, lossy);
+		if (c)
+			return c;
+	}
+
+	int s= socket(AF_INET, SOCK_STREAM, 0);
+	int yes = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	if(connect(s, (sockaddr*)&dst, sizeof(dst)) < 0) {
+		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s:%d\n",
+				inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
+		close(s);
+		return NULL;
+	}
+	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s:%d\n",
+			s, inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
+	return new connection(mgr, s, lossy);
+}
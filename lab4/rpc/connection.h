@@ -3,15 +3,31 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <cstddef>
 
+#include <deque>
 #include <map>
+#include <string>
+#include <vector>
 
 #include "pollmgr.h"
 
 class connection;
+class shmchan;
+struct rpc_histdata;
+
+// how to reach an rpcs. make_sockaddr() takes "unix:[host:]port" and
+// "shm:[host:]port" to mean the Unix domain socket and the shared
+// memory rings of the rpcs on port of this host, and records that in
+// the otherwise unused sin_zero of the sockaddr_in. RPC_TRANSPORT set
+// to unix or shm does the same for every 127.x address whose server
+// offers it; others keep using TCP.
+enum rpc_transport { RPC_TCP = 0, RPC_UNIX, RPC_SHM };
+void set_transport(sockaddr_in *a, rpc_transport t);
+rpc_transport get_transport(const sockaddr_in &a);
 
 class chanmgr {
 	public:
@@ -29,7 +45,10 @@ class connection : public aio_callback {
 			int solong; //amount of bytes written or read so far
 		};
 
-		connection(chanmgr *m1, int f1, int lossytest=0);
+		// f1 is a connected socket. with shm, pdus go through its
+		// rings, and f1, a Unix domain socket, only tells when the
+		// peer goes away.
+		connection(chanmgr *m1, int f1, int lossytest=0, shmchan *shm=NULL);
 		~connection();
 
 		int channo() { return fd_; }
@@ -37,6 +56,13 @@ class connection : public aio_callback {
 		void closeconn();
 
 		bool send(char *b, int sz);
+		// send the pdu made of n iovecs, the first of which begins
+		// with room for the size. pdus are written in the order they
+		// are sent; with RPC_COALESCE set to n > 1, whoever writes
+		// takes up to n of the queued pdus into one writev(), and with
+		// RPC_COALESCE_US as well, waits that many microseconds for
+		// more when the last write carried several.
+		bool sendv(const struct iovec *v, int n);
 		void write_cb(int s);
 		void read_cb(int s);
 
@@ -47,15 +73,39 @@ class connection : public aio_callback {
                 int compare(connection *another);
 	private:
 
-		bool readpdu();
+		struct outpdu {
+			const struct iovec *v;
+			int n;
+			int sz;
+			int state;	// 0 queued, 1 sent, -1 failed
+		};
+
+		int readpdu();
 		bool writepdu();
+		void writebatch();
+		int rd(char *b, int n);
+		int rdahead(char *b, int n);
+		int wrv(const struct iovec *v, int n);
+		void unwatch(bool block);
 
 		chanmgr *mgr_;
 		const int fd_;
+		shmchan *shm_;
 		bool dead_;
 
-		charbuf wpdu_;
+		charbuf wpdu_;	// buf is the first iovec, while a send is on
+		const struct iovec *wiov_;
+		int wiovcnt_;
+		std::deque<outpdu *> outq_;	// waiting for a writer
+		bool writing_;
+		bool inwrite_;	// writing_ without m_; callbacks keep off wpdu_
+		int last_batch_;	// pdus in the last write
 		charbuf rpdu_;
+		char hdr_[4];	// the size of the next pdu, as far as read
+		int hdrn_;
+		char *ra_;	// read ahead of the current pdu
+		int raoff_;
+		int ralen_;
                 
                 struct timeval create_time_;
 
@@ -67,35 +117,53 @@ class connection : public aio_callback {
 		pthread_mutex_t ref_m_;
 		pthread_cond_t send_complete_;
 		pthread_cond_t send_wait_;
+		pthread_cond_t linger_c_;
 };
 
-class tcpsconn {
+// for all connections of the process: the number of pdus in each
+// write, and the pdus received and the reads it took
+void connection_stats(rpc_histdata *batch, unsigned long long *pdus_in,
+		unsigned long long *reads);
+
+// accepts connections on behalf of a chanmgr. With several PollMgr
+// loops there is one listening socket per loop, all bound to the same
+// port with SO_REUSEPORT, so the kernel spreads new connections over
+// the loops and each connection is served by the loop that accepted it.
+//
+// It also listens on two Unix domain sockets in $RPC_SOCK_DIR (by
+// default /tmp/rpc-<uid>, a directory only the user can enter),
+// rpc-<port>.sock for plain streams and rpc-<port>.shm for clients
+// that bring shared memory rings. They are mode 0600 and are removed
+// when the tcpsconn is destroyed or the process exits.
+class tcpsconn : public aio_callback {
 	public:
 		tcpsconn(chanmgr *m1, int port, int lossytest=0);
 		~tcpsconn();
 
-		void accept_conn();
+		void read_cb(int s);
+		void write_cb(int s) {}
 	private:
 
 		pthread_mutex_t m_;
-		pthread_t th_;
-		int pipe_[2];
 
-		int tcp_; //file desciptor for accepting connection
+		std::vector<int> tcp_; //file desciptors for accepting connection
+		int unix_;
+		int shm_;
+		std::string unix_path_;
+		std::string shm_path_;
+		int port_;
 		chanmgr *mgr_;
 		int lossy_;
 		std::map<int, connection *> conns_;
-
-		void process_accept();
-};
-
-struct bundle {
-	bundle(chanmgr *m, int s, int l):mgr(m),tcp(s),lossy(l) {}
-	chanmgr *mgr;
-	int tcp;
-	int lossy;
+		unsigned int gc_size_; // collect dead connections at this many
+		// shm connections whose rings have not come yet, with when
+		// they were accepted; their fds are watched by this object
+		std::map<int, unsigned long long> handshakes_;
+
+		void process_accept(int s1, shmchan *shm=NULL);
+		bool accept_shm(int s1);
+		void wait_shm(int s1);
 };
 
-void start_accept_thread(chanmgr *mgr, int port, pthread_t *th, int *fd = NULL, int lossy=0);
 connection *connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy=0);
 #endif
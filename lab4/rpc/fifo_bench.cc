@@ -0,0 +1,102 @@
+// compare fifo<T> and lfifo<T> under contention.
+// usage: fifo_bench [items] [limit]
+//
+// for each mix of producer and consumer threads, the producers enq
+// items between them and the consumers deq them all; prints items/sec.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+
+#include "fifo.h"
+#include "lfifo.h"
+#include "lang/verify.h"
+
+static long nitems = 1000000;
+static int limit = 1024;
+
+template<class Q> struct bench_arg {
+	Q *q;
+	long n;		// items for each thread
+	std::atomic<long> *sum;
+};
+
+template<class Q> void *
+producer(void *xa)
+{
+	bench_arg<Q> *a = (bench_arg<Q> *)xa;
+	for (long i = 1; i <= a->n; i++)
+		a->q->enq(i);
+	return 0;
+}
+
+template<class Q> void *
+consumer(void *xa)
+{
+	bench_arg<Q> *a = (bench_arg<Q> *)xa;
+	long sum = 0;
+	for (long i = 0; i < a->n; i++) {
+		long e;
+		a->q->deq(&e);
+		sum += e;
+	}
+	a->sum->fetch_add(sum);
+	return 0;
+}
+
+template<class Q> double
+run(int np, int nc)
+{
+	Q q(limit);
+	std::atomic<long> sum(0);
+	// round down so both sides move the same number of items
+	long total = nitems / (np * nc) * np * nc;
+	bench_arg<Q> pa = { &q, total / np, &sum };
+	bench_arg<Q> ca = { &q, total / nc, &sum };
+	std::vector<pthread_t> th(np + nc);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nc; i++)
+		VERIFY(pthread_create(&th[i], NULL, consumer<Q>, (void *)&ca) == 0);
+	for (int i = 0; i < np; i++)
+		VERIFY(pthread_create(&th[nc + i], NULL, producer<Q>, (void *)&pa) == 0);
+	for (int i = 0; i < np + nc; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	long n = pa.n;
+	VERIFY(sum.load() == np * (n * (n + 1) / 2));
+	double secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	return total / secs;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc > 1)
+		nitems = atol(argv[1]);
+	if (argc > 2)
+		limit = atoi(argv[2]);
+	if (nitems <= 0 || limit <= 0) {
+		fprintf(stderr, "usage: %s [items] [limit]\n", argv[0]);
+		exit(1);
+	}
+
+	static const int mix[][2] = {
+		{1, 1}, {1, 4}, {4, 1}, {2, 2}, {4, 4}, {8, 8},
+	};
+	printf("%ld items, limit %d\n", nitems, limit);
+	printf("prod cons %12s %12s\n", "fifo/s", "lfifo/s");
+	for (unsigned i = 0; i < sizeof(mix) / sizeof(mix[0]); i++) {
+		int np = mix[i][0], nc = mix[i][1];
+		double f = run<fifo<long> >(np, nc);
+		double l = run<lfifo<long> >(np, nc);
+		printf("%4d %4d %12.0f %12.0f\n", np, nc, f, l);
+	}
+	return 0;
+}
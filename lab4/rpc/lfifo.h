@@ -0,0 +1,231 @@
+#ifndef lfifo_h
+#define lfifo_h
+
+// lock-free bounded fifo template, with the same enq() and deq() as
+// fifo<T>. the queue is a ring of cells, each with a sequence number
+// that says whether it is ready for the next enq() or the next deq()
+// (D. Vyukov's bounded MPMC queue), so neither side takes a lock or
+// allocates. a thread parks on an eventcount only when the queue is
+// EMPTY (deq) or FULL (blocking enq).
+//
+// unlike fifo<T> the queue must be bounded; the limit is rounded up to
+// a power of two.
+
+#include <limits.h>
+#include <stdint.h>
+#include <atomic>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <pthread.h>
+#endif
+#include "lang/verify.h"
+
+// lets a thread sleep until some condition, checked without a lock,
+// may have changed:
+//	for (;;) {
+//		if (cond) break;
+//		key = ec.prepare();
+//		if (cond) { ec.cancel(); break; }
+//		ec.wait(key);
+//	}
+// and the thread that makes cond true calls notify().
+class eventcount {
+	public:
+		eventcount() : seq_(0), waiters_(0) {
+#ifndef __linux__
+			VERIFY(pthread_mutex_init(&m_, 0) == 0);
+			VERIFY(pthread_cond_init(&c_, 0) == 0);
+#endif
+		}
+		~eventcount() {
+#ifndef __linux__
+			VERIFY(pthread_mutex_destroy(&m_) == 0);
+			VERIFY(pthread_cond_destroy(&c_) == 0);
+#endif
+		}
+
+		uint32_t prepare() {
+			waiters_.fetch_add(1);
+			return seq_.load();
+		}
+		void cancel() {
+			waiters_.fetch_sub(1);
+		}
+		void wait(uint32_t key) {
+#ifdef __linux__
+			if (seq_.load() == key)
+				syscall(SYS_futex, (uint32_t *)&seq_, FUTEX_WAIT_PRIVATE,
+						key, NULL, NULL, 0);
+#else
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+			while (seq_.load() == key)
+				VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+#endif
+			waiters_.fetch_sub(1);
+		}
+		void notify(bool all = false) {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (waiters_.load(std::memory_order_relaxed) == 0)
+				return;
+#ifdef __linux__
+			seq_.fetch_add(1);
+			syscall(SYS_futex, (uint32_t *)&seq_, FUTEX_WAKE_PRIVATE,
+					all ? INT_MAX : 1, NULL, NULL, 0);
+#else
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+			seq_.fetch_add(1);
+			if (all)
+				VERIFY(pthread_cond_broadcast(&c_) == 0);
+			else
+				VERIFY(pthread_cond_signal(&c_) == 0);
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+#endif
+		}
+
+	private:
+		std::atomic<uint32_t> seq_;
+		std::atomic<int> waiters_;
+#ifndef __linux__
+		pthread_mutex_t m_;
+		pthread_cond_t c_;
+#endif
+};
+
+template<class T>
+class lfifo {
+	public:
+		lfifo(int limit);
+		~lfifo();
+		bool enq(T, bool blocking=true);
+		void deq(T *);
+		bool try_deq(T *);
+		int size();
+
+	private:
+		struct cell {
+			std::atomic<unsigned long> seq;
+			T e;
+		};
+
+		bool try_enq(const T &e);
+
+		cell *q_;
+		unsigned long mask_;
+		// enq and deq positions, on their own cache lines
+		char pad0_[64];
+		std::atomic<unsigned long> enq_;
+		char pad1_[64];
+		std::atomic<unsigned long> deq_;
+		char pad2_[64];
+		eventcount non_empty_;
+		eventcount has_space_;
+};
+
+template<class T>
+lfifo<T>::lfifo(int limit) : enq_(0), deq_(0)
+{
+	VERIFY(limit > 0);
+	unsigned long n = 1;
+	while (n < (unsigned long)limit)
+		n <<= 1;
+	mask_ = n - 1;
+	q_ = new cell[n];
+	for (unsigned long i = 0; i < n; i++)
+		q_[i].seq.store(i, std::memory_order_relaxed);
+}
+
+template<class T>
+lfifo<T>::~lfifo()
+{
+	//lfifo is to be deleted only when no threads are using it!
+	delete [] q_;
+}
+
+template<class T> int
+lfifo<T>::size()
+{
+	return enq_.load() - deq_.load();
+}
+
+template<class T> bool
+lfifo<T>::try_enq(const T &e)
+{
+	unsigned long pos = enq_.load(std::memory_order_relaxed);
+	cell *c;
+	while (1) {
+		c = &q_[pos & mask_];
+		long d = (long)(c->seq.load(std::memory_order_acquire) - pos);
+		if (d == 0) {
+			if (enq_.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed))
+				break;
+		} else if (d < 0) {
+			return false; // full
+		} else {
+			pos = enq_.load(std::memory_order_relaxed);
+		}
+	}
+	c->e = e;
+	c->seq.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+template<class T> bool
+lfifo<T>::try_deq(T *e)
+{
+	unsigned long pos = deq_.load(std::memory_order_relaxed);
+	cell *c;
+	while (1) {
+		c = &q_[pos & mask_];
+		long d = (long)(c->seq.load(std::memory_order_acquire) - (pos + 1));
+		if (d == 0) {
+			if (deq_.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed))
+				break;
+		} else if (d < 0) {
+			return false; // empty
+		} else {
+			pos = deq_.load(std::memory_order_relaxed);
+		}
+	}
+	*e = c->e;
+	c->seq.store(pos + mask_ + 1, std::memory_order_release);
+	return true;
+}
+
+template<class T> bool
+lfifo<T>::enq(T e, bool blocking)
+{
+	while (!try_enq(e)) {
+		if (!blocking)
+			return false;
+		uint32_t key = has_space_.prepare();
+		if (try_enq(e)) {
+			has_space_.cancel();
+			break;
+		}
+		has_space_.wait(key);
+	}
+	non_empty_.notify();
+	return true;
+}
+
+template<class T> void
+lfifo<T>::deq(T *e)
+{
+	while (!try_deq(e)) {
+		uint32_t key = non_empty_.prepare();
+		if (try_deq(e)) {
+			non_empty_.cancel();
+			break;
+		}
+		non_empty_.wait(key);
+	}
+	has_space_.notify();
+}
+
+#endif
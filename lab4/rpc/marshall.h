@@ -5,13 +5,16 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <list>
 #include <map>
 #include <stdlib.h>
 #include <string.h>
 #include <cstddef>
 #include <inttypes.h>
+#include <sys/uio.h>
 #include "lang/verify.h"
 #include "lang/algorithm.h"
+#include "rpcbuf.h"
 
 struct req_header {
 	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
@@ -35,6 +38,8 @@ typedef int rpc_sz_t;
 enum {
 	//size of initial buffer allocation 
 	DEFAULT_RPC_SZ = 1024,
+	//strings at least this long are sent in place instead of copied
+	MARSHALL_REF_SZ = 4096,
 #if RPC_CHECKSUMMING
 	//size of rpc_header includes a 4-byte int to be filled by tcpchan and uint64_t checksum
 	RPC_HEADER_SZ = static_max<sizeof(req_header), sizeof(reply_header)>::value + sizeof(rpc_sz_t) + sizeof(rpc_checksum_t)
@@ -43,33 +48,74 @@ enum {
 #endif
 };
 
+// a run of bytes inside an unmarshall's buffer, valid as long as the
+// unmarshall is. on the wire it is a std::string, so a handler can
+// declare a strview argument to look at a large payload without
+// copying it out of the request.
+struct strview {
+	strview(): data(NULL), size(0) {}
+	strview(const char *d, unsigned int s): data(d), size(s) {}
+	strview(const std::string &s): data(s.data()), size(s.size()) {}
+	const char *data;
+	unsigned int size;
+	std::string str() const { return std::string(data, size); }
+};
+
 class marshall {
 	private:
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
 		int _capa;      // Capacity of the buffer
 		int _ind;       // Read/write head position
 
+		// large strings are not copied into _buf. each ref puts n bytes
+		// at p on the wire after the first off bytes of _buf; p belongs
+		// to the caller, or is _own[own] if the string was handed over
+		// with take(). the caller's bytes must stay put until the
+		// marshall is sent or flattened.
+		struct ref {
+			int off;
+			const char *p;
+			int n;
+			int own;
+		};
+		std::vector<ref> _refs;
+		std::vector<std::string> _own;
+		int _refsz;     // bytes in _refs
+
+		marshall(const marshall &);
+		marshall &operator=(const marshall &);
+
 	public:
 		marshall() {
-			_buf = (char *) malloc(sizeof(char)*DEFAULT_RPC_SZ);
-			VERIFY(_buf);
-			_capa = DEFAULT_RPC_SZ;
+			_buf = rpcbuf_alloc(DEFAULT_RPC_SZ, &_capa);
 			_ind = RPC_HEADER_SZ;
+			_refsz = 0;
 		}
 
 		~marshall() { 
-			if (_buf) 
-				free(_buf); 
+			rpcbuf_free(_buf);
 		}
 
-		int size() { return _ind;}
-		char *cstr() { return _buf;}
+		int size() { return _ind + _refsz;}
+		char *cstr() { flatten(); return _buf;}
 
 		void rawbyte(unsigned char);
 		void rawbytes(const char *, int);
+		// like rawbytes, but large runs are referred to, not copied
+		void rawref(const char *, int);
+		// marshall s like a std::string, moving it in if it is large
+		void take(std::string &s);
+		// copy referred bytes into the buffer
+		void flatten();
+
+		// the whole pdu as iovecs for writev(); the first one starts
+		// with the header. they stay valid until the marshall changes.
+		int iovcnt() { return 2 * _refs.size() + 1; }
+		void iov(struct iovec *v);
 
 		// Return the current content (excluding header) as a string
 		std::string get_content() { 
+			flatten();
 			return std::string(_buf+RPC_HEADER_SZ,_ind-RPC_HEADER_SZ);
 		}
 
@@ -108,6 +154,7 @@ class marshall {
 		}
 
 		void take_buf(char **b, int *s) {
+			flatten();
 			*b = _buf;
 			*s = _ind;
 			_buf = NULL;
@@ -124,6 +171,7 @@ marshall& operator<<(marshall &, unsigned short);
 marshall& operator<<(marshall &, short);
 marshall& operator<<(marshall &, unsigned long long);
 marshall& operator<<(marshall &, const std::string &);
+marshall& operator<<(marshall &, const strview &);
 
 class unmarshall {
 	private:
@@ -140,7 +188,7 @@ class unmarshall {
 			take_content(s);
 		}
 		~unmarshall() {
-			if (_buf) free(_buf);
+			rpcbuf_free(_buf);
 		}
 
 		//take contents from another unmarshall object
@@ -149,8 +197,7 @@ class unmarshall {
 		//take the content which does not exclude a RPC header from a string
 		void take_content(const std::string &s) {
 			_sz = s.size()+RPC_HEADER_SZ;
-			_buf = (char *)realloc(_buf,_sz);
-			VERIFY(_buf);
+			_buf = rpcbuf_realloc(_buf,_sz);
 			_ind = RPC_HEADER_SZ;
 			memcpy(_buf+_ind, s.data(), s.size());
 			_ok = true;
@@ -161,6 +208,7 @@ class unmarshall {
 		bool okdone();
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
+		void rawview(strview &v, unsigned int n);
 
 		int ind() { return _ind;}
 		int size() { return _sz;}
@@ -207,9 +255,10 @@ unmarshall& operator>>(unmarshall &, unsigned int &);
 unmarshall& operator>>(unmarshall &, int &);
 unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
+unmarshall& operator>>(unmarshall &, strview &);
 
 template <class C> marshall &
-operator<<(marshall &m, std::vector<C> v)
+operator<<(marshall &m, const std::vector<C> &v)
 {
 	m << (unsigned int) v.size();
 	for(unsigned i = 0; i < v.size(); i++)
@@ -231,7 +280,7 @@ operator>>(unmarshall &u, std::vector<C> &v)
 }
 
 template <class C> marshall &
-operator<<(marshall &m, std::list<C> v)
+operator<<(marshall &m, const std::list<C> &v)
 {
 	m << (unsigned int) v.size();
 	for(auto it = v.begin(); it != v.end(); it++)
@@ -280,4 +329,26 @@ operator>>(unmarshall &u, std::map<A,B> &d) {
 	return u;
 }
 
+// marshall a value the caller is done with, such as an RPC handler's
+// reply: large strings in it are moved into m rather than copied.
+template <class R> void
+marshall_move(marshall &m, R &r)
+{
+	m << r;
+}
+
+inline void
+marshall_move(marshall &m, std::string &s)
+{
+	m.take(s);
+}
+
+template <class C> void
+marshall_move(marshall &m, std::vector<C> &v)
+{
+	m << (unsigned int) v.size();
+	for(unsigned i = 0; i < v.size(); i++)
+		marshall_move(m, v[i]);
+}
+
 #endif
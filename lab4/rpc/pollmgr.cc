@@ -0,0 +1,529 @@
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "slock.h"
+#include "jsl_log.h"
+#include "method_thread.h"
+#include "lang/verify.h"
+#include "pollmgr.h"
+
+PollMgr *PollMgr::instance = NULL;
+static pthread_once_t pollmgr_is_initialized = PTHREAD_ONCE_INIT;
+static thread_local int this_loop = -1;
+
+void
+PollMgrInit()
+{
+	int n = 1;
+	char *loops_env = getenv("RPC_POLL_LOOPS");
+	if (loops_env != NULL) {
+		n = atoi(loops_env);
+		if (n <= 0)
+			n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n <= 0)
+			n = 1;
+	}
+	PollMgr::instance = new PollMgr(n);
+}
+
+PollMgr *
+PollMgr::Instance()
+{
+	pthread_once(&pollmgr_is_initialized, PollMgrInit);
+	return instance;
+}
+
+int
+PollMgr::current_loop()
+{
+	return this_loop;
+}
+
+PollMgr::PollMgr(int nloops)
+{
+	VERIFY(nloops > 0);
+	for (int i = 0; i < POLL_MAX_CHUNKS; i++)
+		chunks_[i] = NULL;
+
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
+
+	// the table has no limit of its own, so let the process open as
+	// many descriptors as it is allowed to
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	for (int i = 0; i < nloops; i++) {
+		loop *l = new loop();
+		l->idx = i;
+#ifdef __linux__
+		l->aio = new EPollAIO();
+#else
+		l->aio = new SelectAIO();
+#endif
+		l->gen = 0;
+		l->waiting = false;
+		loops_.push_back(l);
+	}
+	for (int i = 0; i < nloops; i++) {
+		VERIFY((loops_[i]->th = method_thread(this, false, &PollMgr::wait_loop,
+						loops_[i])) != 0);
+	}
+	jsl_log(JSL_DBG_2, "PollMgr::PollMgr %d loops\n", nloops);
+}
+
+PollMgr::~PollMgr()
+{
+	//never kill me!!!
+	VERIFY(0);
+}
+
+// find fd's entry, allocating its chunk if create is set.
+// must hold m_ to create.
+PollMgr::entry *
+PollMgr::lookup(int fd, bool create)
+{
+	VERIFY(fd >= 0 && fd / POLL_CHUNK_FDS < POLL_MAX_CHUNKS);
+	int c = fd / POLL_CHUNK_FDS;
+	entry *chunk = chunks_[c].load(std::memory_order_acquire);
+	if (!chunk) {
+		if (!create)
+			return NULL;
+		chunk = new entry[POLL_CHUNK_FDS];
+		for (int i = 0; i < POLL_CHUNK_FDS; i++) {
+			chunk[i].cb = NULL;
+			chunk[i].loop = -1;
+		}
+		chunks_[c].store(chunk, std::memory_order_release);
+	}
+	return &chunk[fd % POLL_CHUNK_FDS];
+}
+
+void
+PollMgr::add_callback(int fd, poll_flag flag, aio_callback *ch, int l)
+{
+	ScopedLock ml(&m_);
+	entry *e = lookup(fd, true);
+	aio_callback *cur = e->cb.load();
+
+	VERIFY(!cur || cur==ch);
+	if (!cur) {
+		if (l < 0)
+			l = this_loop;
+		if (l < 0)
+			l = fd;
+		e->loop = l % loops_.size();
+	}
+	// the callback has to be visible before epoll can report the
+	// first edge, or that edge would be dropped
+	e->cb.store(ch);
+	loops_[e->loop]->aio->watch_fd(fd, flag);
+}
+
+//remove all callbacks related to fd
+//the return guarantees that callbacks related to fd
+//will never be called again
+void
+PollMgr::block_remove_fd(int fd)
+{
+	ScopedLock ml(&m_);
+	entry *e = lookup(fd, false);
+	if (!e || e->loop < 0)
+		return;
+
+	loop *l = loops_[e->loop];
+	l->aio->unwatch_fd(fd, CB_RDWR);
+	e->cb.store(NULL);
+	if (this_loop == l->idx) {
+		// called from one of l's callbacks; the loop reloads the
+		// table before every callback, so nothing else can run
+		return;
+	}
+
+	// wait until l has finished the iteration that might still be
+	// using the old callback
+	unsigned int gen = l->gen;
+	l->waiting = true;
+	l->aio->wakeup();
+	while (l->gen == gen)
+		VERIFY(pthread_cond_wait(&changedone_c_, &m_)==0);
+}
+
+void
+PollMgr::del_callback(int fd, poll_flag flag)
+{
+	ScopedLock ml(&m_);
+	entry *e = lookup(fd, false);
+	if (!e || !e->cb.load())
+		return;
+	if (loops_[e->loop]->aio->unwatch_fd(fd, flag)) {
+		e->cb.store(NULL);
+	}
+}
+
+int
+PollMgr::loop_of(int fd)
+{
+	ScopedLock ml(&m_);
+	entry *e = lookup(fd, false);
+	return e && e->cb.load() ? e->loop : -1;
+}
+
+bool
+PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
+{
+	ScopedLock ml(&m_);
+	entry *e = lookup(fd, false);
+	if (!e || e->cb.load() != c)
+		return false;
+
+	return loops_[e->loop]->aio->is_watched(fd, flag);
+}
+
+// call fd's read_cb again after POLL_RETRY_MS even if no new data
+// arrives, e.g. because the callback could not hand off what it read.
+void
+PollMgr::defer_read(int fd)
+{
+	ScopedLock ml(&m_);
+	entry *e = lookup(fd, false);
+	if (!e || !e->cb.load())
+		return;
+	loop *l = loops_[e->loop];
+	l->deferred.push_back(fd);
+	if (this_loop != l->idx)
+		l->aio->wakeup();
+}
+
+void
+PollMgr::wait_loop(loop *l)
+{
+	std::vector<int> readable;
+	std::vector<int> writable;
+	std::vector<int> retry;
+
+	this_loop = l->idx;
+	while (1) {
+		{
+			ScopedLock ml(&m_);
+			if (l->waiting) {
+				l->waiting = false;
+				l->gen++;
+				VERIFY(pthread_cond_broadcast(&changedone_c_)==0);
+			}
+			retry.swap(l->deferred);
+		}
+		readable.clear();
+		writable.clear();
+		l->aio->wait_ready(&readable, &writable,
+				retry.empty() ? -1 : POLL_RETRY_MS);
+
+		//no locking of m_
+		//because entries are only ever cleared while we look at
+		//them, and block_remove_fd() waits for the next iteration
+		//before its caller may free the callback
+		for (unsigned int i = 0; i < readable.size(); i++) {
+			int fd = readable[i];
+			aio_callback *cb = lookup(fd, false)->cb.load();
+			if (cb)
+				cb->read_cb(fd);
+		}
+
+		for (unsigned int i = 0; i < retry.size(); i++) {
+			int fd = retry[i];
+			aio_callback *cb = lookup(fd, false)->cb.load();
+			if (cb)
+				cb->read_cb(fd);
+		}
+		retry.clear();
+
+		for (unsigned int i = 0; i < writable.size(); i++) {
+			int fd = writable[i];
+			aio_callback *cb = lookup(fd, false)->cb.load();
+			if (cb)
+				cb->write_cb(fd);
+		}
+	}
+}
+
+SelectAIO::SelectAIO() : highfds_(0)
+{
+	FD_ZERO(&rfds_);
+	FD_ZERO(&wfds_);
+
+	VERIFY(pipe(pipefd_) == 0);
+	FD_SET(pipefd_[0], &rfds_);
+	highfds_ = pipefd_[0];
+
+	// a full pipe already means a wakeup is pending
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(pipefd_[i], F_GETFL, NULL);
+		flags |= O_NONBLOCK;
+		fcntl(pipefd_[i], F_SETFL, flags);
+	}
+
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+}
+
+SelectAIO::~SelectAIO()
+{
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+}
+
+void
+SelectAIO::watch_fd(int fd, poll_flag flag)
+{
+	// select() cannot go past FD_SETSIZE; only used where epoll is missing
+	VERIFY(fd < FD_SETSIZE);
+
+	ScopedLock ml(&m_);
+	if (highfds_ <= fd)
+		highfds_ = fd;
+
+	if (flag == CB_RDONLY) {
+		FD_SET(fd,&rfds_);
+	}else if (flag == CB_WRONLY) {
+		FD_SET(fd,&wfds_);
+	}else {
+		FD_SET(fd,&rfds_);
+		FD_SET(fd,&wfds_);
+	}
+
+	char tmp = 1;
+	VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1 || errno == EAGAIN);
+}
+
+bool
+SelectAIO::is_watched(int fd, poll_flag flag)
+{
+	ScopedLock ml(&m_);
+	if (flag == CB_RDONLY) {
+		return FD_ISSET(fd,&rfds_);
+	}else if (flag == CB_WRONLY) {
+		return FD_ISSET(fd,&wfds_);
+	}else{
+		return (FD_ISSET(fd,&rfds_) && FD_ISSET(fd,&wfds_));
+	}
+}
+
+bool
+SelectAIO::unwatch_fd(int fd, poll_flag flag)
+{
+	ScopedLock ml(&m_);
+	if (flag == CB_RDONLY) {
+		FD_CLR(fd, &rfds_);
+	}else if (flag == CB_WRONLY) {
+		FD_CLR(fd, &wfds_);
+	}else if (flag == CB_RDWR) {
+		FD_CLR(fd, &wfds_);
+		FD_CLR(fd, &rfds_);
+	}else{
+		VERIFY(0);
+	}
+
+	if (!FD_ISSET(fd,&rfds_) && !FD_ISSET(fd,&wfds_)) {
+		if (fd == highfds_) {
+			int newh = pipefd_[0];
+			for (int i = 0; i <= highfds_; i++) {
+				if (FD_ISSET(i, &rfds_)) {
+					newh = i;
+				}else if (FD_ISSET(i, &wfds_)) {
+					newh = i;
+				}
+			}
+			highfds_ = newh;
+		}
+	}
+	if (flag == CB_RDWR) {
+		char tmp = 1;
+		VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1 || errno == EAGAIN);
+	}
+	return (!FD_ISSET(fd, &rfds_) && !FD_ISSET(fd, &wfds_));
+}
+
+void
+SelectAIO::wakeup()
+{
+	char tmp = 1;
+	VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1 || errno == EAGAIN);
+}
+
+void
+SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+		int timeout)
+{
+	fd_set trfds, twfds;
+	int high;
+
+	{
+		ScopedLock ml(&m_);
+		trfds = rfds_;
+		twfds = wfds_;
+		high = highfds_;
+	}
+
+	struct timeval tv;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	int ret = select(high+1, &trfds, &twfds, NULL, timeout < 0 ? NULL : &tv);
+
+	if (ret < 0) {
+		if (errno == EINTR) {
+			return;
+		} else {
+			perror("select:");
+			jsl_log(JSL_DBG_OFF, "PollMgr::select_loop failure errno %d\n",errno);
+			VERIFY(0);
+		}
+	}
+
+	for (int fd = 0; fd <= high; fd++) {
+		if (fd == pipefd_[0] && FD_ISSET(fd, &trfds)) {
+			char tmp[64];
+			while (read(pipefd_[0], tmp, sizeof(tmp)) > 0)
+				;
+		}else {
+			if (FD_ISSET(fd, &twfds)) {
+				writable->push_back(fd);
+			}
+			if (FD_ISSET(fd, &trfds)) {
+				readable->push_back(fd);
+			}
+		}
+	}
+}
+
+#ifdef __linux__
+
+EPollAIO::EPollAIO()
+{
+	pollfd_ = epoll_create1(EPOLL_CLOEXEC);
+	VERIFY(pollfd_ >= 0);
+
+	// level-triggered, so a wakeup is never lost
+	wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	VERIFY(wakefd_ >= 0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = wakefd_;
+	VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, wakefd_, &ev) == 0);
+}
+
+EPollAIO::~EPollAIO()
+{
+	close(wakefd_);
+	close(pollfd_);
+}
+
+static inline
+int poll_flag_to_event(int flag)
+{
+	int f = EPOLLET;
+	if (flag & CB_RDONLY) {
+		f |= EPOLLIN | EPOLLRDHUP;
+	}
+	if (flag & CB_WRONLY) {
+		f |= EPOLLOUT;
+	}
+	return f;
+}
+
+void
+EPollAIO::watch_fd(int fd, poll_flag flag)
+{
+	if ((unsigned int)fd >= fdstatus_.size())
+		fdstatus_.resize(fd + POLL_CHUNK_FDS, 0);
+
+	struct epoll_event ev;
+	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	fdstatus_[fd] |= (int)flag;
+
+	ev.events = poll_flag_to_event(fdstatus_[fd]);
+	ev.data.fd = fd;
+
+	// a descriptor closed while still watched leaves epoll by itself,
+	// and its number may already belong to a new socket
+	if (epoll_ctl(pollfd_, op, fd, &ev) != 0) {
+		VERIFY(op == EPOLL_CTL_MOD && errno == ENOENT);
+		VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, fd, &ev) == 0);
+	}
+}
+
+bool
+EPollAIO::unwatch_fd(int fd, poll_flag flag)
+{
+	if ((unsigned int)fd >= fdstatus_.size() || !fdstatus_[fd])
+		return true;
+	fdstatus_[fd] &= ~(int)flag;
+
+	struct epoll_event ev;
+	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+
+	ev.events = poll_flag_to_event(fdstatus_[fd]);
+	ev.data.fd = fd;
+
+	if (flag == CB_RDWR) {
+		VERIFY(op == EPOLL_CTL_DEL);
+	}
+	// the descriptor may have been closed already, which drops it
+	// from the epoll set on its own
+	int r = epoll_ctl(pollfd_, op, fd, &ev);
+	VERIFY(r == 0 || errno == EBADF || errno == ENOENT);
+	return (op == EPOLL_CTL_DEL);
+}
+
+bool
+EPollAIO::is_watched(int fd, poll_flag flag)
+{
+	if ((unsigned int)fd >= fdstatus_.size())
+		return false;
+	return ((fdstatus_[fd] & flag) == flag);
+}
+
+void
+EPollAIO::wakeup()
+{
+	uint64_t one = 1;
+	VERIFY(write(wakefd_, &one, sizeof(one)) == sizeof(one));
+}
+
+void
+EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+		int timeout)
+{
+	int nfds = epoll_wait(pollfd_, ready_, POLL_BATCH, timeout);
+	if (nfds < 0) {
+		VERIFY(errno == EINTR);
+		return;
+	}
+	for (int i = 0; i < nfds; i++) {
+		int fd = ready_[i].data.fd;
+		if (fd == wakefd_) {
+			uint64_t n;
+			while (read(wakefd_, &n, sizeof(n)) > 0)
+				;
+			continue;
+		}
+		// errors and hangups show up as a failed read
+		if (ready_[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+			readable->push_back(fd);
+		}
+		if (ready_[i].events & EPOLLOUT) {
+			writable->push_back(fd);
+		}
+	}
+}
+
+#endif
@@ -1,14 +1,23 @@
 #ifndef pollmgr_h
-#define pollmgr_h 
+#define pollmgr_h
 
 #include <sys/select.h>
+#include <pthread.h>
+#include <atomic>
 #include <vector>
 
 #ifdef __linux__
 #include <sys/epoll.h>
 #endif
 
-#define MAX_POLL_FDS 128
+// the callback table grows in chunks of POLL_CHUNK_FDS entries, so the
+// number of descriptors is only bounded by RLIMIT_NOFILE.
+#define POLL_CHUNK_FDS 1024
+#define POLL_MAX_CHUNKS 4096
+// events handed back by one wait_ready() call
+#define POLL_BATCH 256
+// how soon a loop retries connections that asked for it with defer_read()
+#define POLL_RETRY_MS 10
 
 typedef enum {
 	CB_NONE = 0x0,
@@ -23,7 +32,11 @@ class aio_mgr {
 		virtual void watch_fd(int fd, poll_flag flag) = 0;
 		virtual bool unwatch_fd(int fd, poll_flag flag) = 0;
 		virtual bool is_watched(int fd, poll_flag flag) = 0;
-		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable) = 0;
+		// timeout is in milliseconds, -1 waits until something is ready
+		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+				int timeout) = 0;
+		// make a concurrent wait_ready() return
+		virtual void wakeup() = 0;
 		virtual ~aio_mgr() {}
 };
 
@@ -34,34 +47,64 @@ class aio_callback {
 		virtual ~aio_callback() {}
 };
 
+// PollMgr runs one or more event loops, each with its own aio_mgr and
+// thread. A descriptor belongs to one loop from add_callback() until
+// its callbacks are removed: the loop given by the caller, else the
+// loop of the calling thread (so connections accepted by a loop stay
+// on it), else fd modulo the number of loops.
+//
+// The number of loops comes from RPC_POLL_LOOPS: unset means one,
+// 0 means one per online CPU.
+//
+// On Linux the loops use edge-triggered epoll; callbacks must keep
+// reading or writing until the socket would block, and may call
+// defer_read() to have read_cb() called again shortly even if no new
+// data arrives.
 class PollMgr {
 	public:
-		PollMgr();
+		PollMgr(int nloops = 1);
 		~PollMgr();
 
 		static PollMgr *Instance();
 		static PollMgr *CreateInst();
 
-		void add_callback(int fd, poll_flag flag, aio_callback *ch);
+		void add_callback(int fd, poll_flag flag, aio_callback *ch, int loop = -1);
 		void del_callback(int fd, poll_flag flag);
 		bool has_callback(int fd, poll_flag flag, aio_callback *ch);
 		void block_remove_fd(int fd);
-		void wait_loop();
+		void defer_read(int fd);
 
+		int loops() { return loops_.size(); }
+		// the loop fd was added to, or -1
+		int loop_of(int fd);
+		// index of the loop running the calling thread, or -1
+		static int current_loop();
 
 		static PollMgr *instance;
-		static int useful;
-		static int useless;
 
 	private:
+		struct loop {
+			int idx;
+			aio_mgr *aio;
+			pthread_t th;
+			unsigned int gen;	// bumped at the top of every iteration
+			bool waiting;		// someone in block_remove_fd wants gen to move
+			std::vector<int> deferred;
+		};
+		struct entry {
+			std::atomic<aio_callback *> cb;
+			int loop;
+		};
+
+		void wait_loop(loop *l);
+		entry *lookup(int fd, bool create);
+
 		pthread_mutex_t m_;
 		pthread_cond_t changedone_c_;
-		pthread_t th_;
-
-		aio_callback *callbacks_[MAX_POLL_FDS];
-		aio_mgr *aio_;
-		bool pending_change_;
 
+		std::vector<loop *> loops_;
+		// looked up without m_ by the loops, so chunks never move
+		std::atomic<entry *> chunks_[POLL_MAX_CHUNKS];
 };
 
 class SelectAIO : public aio_mgr {
@@ -72,7 +115,9 @@ class SelectAIO : public aio_mgr {
 		void watch_fd(int fd, poll_flag flag);
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
-		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+				int timeout);
+		void wakeup();
 
 	private:
 
@@ -85,7 +130,7 @@ class SelectAIO : public aio_mgr {
 
 };
 
-#ifdef __linux__ 
+#ifdef __linux__
 class EPollAIO : public aio_mgr {
 	public:
 		EPollAIO();
@@ -93,15 +138,18 @@ class EPollAIO : public aio_mgr {
 		void watch_fd(int fd, poll_flag flag);
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
-		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+				int timeout);
+		void wakeup();
 
 	private:
 		int pollfd_;
-		struct epoll_event ready_[MAX_POLL_FDS];
-		int fdstatus_[MAX_POLL_FDS];
+		int wakefd_;
+		struct epoll_event ready_[POLL_BATCH];
+		// watched flags by fd; only touched under PollMgr's lock
+		std::vector<int> fdstatus_;
 
 };
 #endif /* __linux */
 
 #endif /* pollmgr_h */
-
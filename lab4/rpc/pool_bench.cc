@@ -0,0 +1,103 @@
+// compare job throughput of ThrPool and WsPool.
+// usage: pool_bench [workers] [producers] [jobs per producer] [spin]
+//
+// each producer thread adds its jobs as fast as the pool takes them,
+// much like the PollMgr loops feeding the rpcs dispatch pool; each job
+// spins for a little while to stand in for the handler.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+
+#include "thr_pool.h"
+#include "wspool.h"
+#include "lang/verify.h"
+
+static int nworkers = 6;
+static int nproducers = 2;
+static int njobs = 200000;
+static int spin = 100;
+
+class counter {
+	public:
+		std::atomic<long> done;
+		counter() : done(0) {}
+		void job(long n) {
+			volatile long x = 0;
+			for (long i = 0; i < n; i++)
+				x += i;
+			done.fetch_add(1, std::memory_order_relaxed);
+		}
+};
+
+template<class P> struct producer_arg {
+	P *pool;
+	counter *c;
+};
+
+template<class P> void *
+producer(void *xa)
+{
+	producer_arg<P> *a = (producer_arg<P> *)xa;
+	for (int i = 0; i < njobs; i++)
+		VERIFY(a->pool->addObjJob(a->c, &counter::job, (long)spin));
+	return 0;
+}
+
+template<class P> double
+run(P *pool)
+{
+	counter c;
+	producer_arg<P> a;
+	a.pool = pool;
+	a.c = &c;
+	std::vector<pthread_t> th(nproducers);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nproducers; i++)
+		VERIFY(pthread_create(&th[i], NULL, producer<P>, (void *)&a) == 0);
+	for (int i = 0; i < nproducers; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	while (c.done.load() < (long)nproducers * njobs)
+		sched_yield();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	return (double)nproducers * njobs / secs;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc > 1)
+		nworkers = atoi(argv[1]);
+	if (argc > 2)
+		nproducers = atoi(argv[2]);
+	if (argc > 3)
+		njobs = atoi(argv[3]);
+	if (argc > 4)
+		spin = atoi(argv[4]);
+	if (nworkers <= 0 || nproducers <= 0 || njobs <= 0 || spin < 0) {
+		fprintf(stderr, "usage: %s [workers] [producers] [jobs] [spin]\n",
+				argv[0]);
+		exit(1);
+	}
+
+	printf("%d workers, %d producers, %d jobs each, spin %d\n",
+			nworkers, nproducers, njobs, spin);
+	{
+		ThrPool p(nworkers, true);
+		printf("ThrPool: %.0f jobs/sec\n", run(&p));
+	}
+	{
+		WsPool p(nworkers, true);
+		printf("WsPool:  %.0f jobs/sec\n", run(&p));
+	}
+	return 0;
+}
@@ -0,0 +1,1526 @@
+/*
+ The rpcc class handles client-side RPC.  Each rpcc is bound to a
+ single RPC server.  The jobs of rpcc include maintaining a connection to
+ server, sending RPC requests and waiting for responses, retransmissions,
+ at-most-once delivery etc.
+
+ The rpcs class handles the server side of RPC.  Each rpcs handles multiple
+ connections from different rpcc objects.  The jobs of rpcs include accepting
+ connections, dispatching requests to registered RPC handlers, at-most-once
+ delivery etc.
+
+ Both rpcc and rpcs use the connection class as an abstraction for the
+ underlying communication channel.  To send an RPC request/reply, one calls
+ connection::send() which blocks until data is sent or the connection has failed
+ (thus the caller can free the buffer when send() returns).  When a
+ request/reply is received, connection makes a callback into the corresponding
+ rpcc or rpcs (see rpcc::got_pdu() and rpcs::got_pdu()).
+
+ Thread organization:
+ rpcc uses application threads to send RPC requests and blocks to receive the
+ reply or error. All connections use a single PollMgr object to perform async
+ socket IO.  PollMgr runs one or more event loop threads that examine the
+ readiness of socket file descriptors and inform the corresponding connection
+ whenever a socket is ready to be read or written.  (We use asynchronous socket
+ IO to reduce the number of threads needed to manage these connections; without
+ async IO, at least one thread is needed per connection to read data without
+ blocking other activities.)  Each rpcs object accepts connections from the
+ PollMgr loops and keeps a pool of threads for executing RPC requests.  The
+ thread pool allows us to control the number of threads spawned at the server
+ (spawning one thread per request will hurt when the server faces thousands of
+ requests).
+
+ In order to delete a connection object, we must maintain a reference count.
+ For rpcc,
+ multiple client threads might be invoking the rpcc::call() functions and thus
+ holding multiple references to the underlying connection object. For rpcs,
+ multiple dispatch threads might be holding references to the same connection
+ object.  A connection object is deleted only when the underlying connection is
+ dead and the reference count reaches zero.
+
+ To delete a rpcc object safely, the users of the library must ensure that
+ there are no outstanding calls on the rpcc object.
+
+ To delete a rpcs object safely, we do the following in sequence: 1. stop
+ accepting new incoming connections. 2. close existing active connections.
+ 3.  delete the dispatch thread pool which involves waiting for current active
+ RPC handlers to finish.  It is interesting how a thread pool can be deleted
+ without using thread cancellation. The trick is to inject x "poison pills" for
+ a thread pool of x threads. Upon getting a poison pill instead of a normal
+ task, a worker thread will exit (and thread pool destructor waits to join all
+ x exited worker threads).
+ */
+
+#include "rpc.h"
+#include "slock.h"
+
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "jsl_log.h"
+#include "gettime.h"
+#include "lang/verify.h"
+
+const rpcc::TO rpcc::to_max = { 120000 };
+const rpcc::TO rpcc::to_min = { 1000 };
+
+// hand m to the connection without first gathering the large strings
+// it refers to into one buffer
+static bool
+send_marshall(connection *c, marshall &m)
+{
+	struct iovec few[3];
+	if (m.iovcnt() <= 3) {
+		m.iov(few);
+		return c->sendv(few, m.iovcnt());
+	}
+	std::vector<struct iovec> v(m.iovcnt());
+	m.iov(&v[0]);
+	return c->sendv(&v[0], v.size());
+}
+
+rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
+: xid(xxid), un(xun), done(false)
+{
+	VERIFY(pthread_mutex_init(&m,0) == 0);
+	VERIFY(pthread_cond_init(&c, 0) == 0);
+}
+
+rpcc::caller::~caller()
+{
+	VERIFY(pthread_mutex_destroy(&m) == 0);
+	VERIFY(pthread_cond_destroy(&c) == 0);
+}
+
+inline
+void set_rand_seed()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	srandom((int)ts.tv_nsec^((int)getpid()));
+}
+
+rpcc::rpcc(sockaddr_in d, bool retrans) :
+	dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0),
+	retrans_(retrans), reachable_(true), big_call_(8192), destroy_wait_ (false),
+	xid_rep_done_(-1)
+{
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
+	VERIFY(pthread_cond_init(&destroy_wait_c_, 0) == 0);
+
+	if(retrans){
+		set_rand_seed();
+		clt_nonce_ = random();
+	} else {
+		// special client nonce 0 means this client does not
+		// require at-most-once logic from the server
+		// because it uses tcp and never retries a failed connection
+		clt_nonce_ = 0;
+	}
+
+	char *loss_env = getenv("RPC_LOSSY");
+	if(loss_env != NULL){
+		lossytest_ = atoi(loss_env);
+	}
+
+	int nconns = 1;
+	char *conns_env = getenv("RPC_CONNS");
+	for (char *p = conns_env; p != NULL && *p; ) {
+		char *e = p + strcspn(p, ",");
+		std::string item(p, e - p);
+		size_t eq = item.find('=');
+		if (eq == std::string::npos) {
+			if (atoi(item.c_str()) > 0)
+				nconns = atoi(item.c_str());
+		} else {
+			sockaddr_in a;
+			make_sockaddr(item.substr(0, eq).c_str(), &a);
+			if (a.sin_addr.s_addr == dst_.sin_addr.s_addr &&
+					a.sin_port == dst_.sin_port &&
+					atoi(item.c_str() + eq + 1) > 0) {
+				nconns = atoi(item.c_str() + eq + 1);
+				break;
+			}
+		}
+		p = *e ? e + 1 : e;
+	}
+	set_conns(nconns);
+	char *big_env = getenv("RPC_BIG_CALL");
+	if (big_env != NULL && atoi(big_env) > 0)
+		big_call_ = atoi(big_env);
+
+	// xid starts with 1 and latest received reply starts with 0
+	xid_rep_window_.push_back(0);
+
+	jsl_log(JSL_DBG_2, "rpcc::rpcc cltn_nonce is %d lossy %d\n",
+			clt_nonce_, lossytest_);
+}
+
+// IMPORTANT: destruction should happen only when no external threads
+// are blocked inside rpcc or will use rpcc in the future
+rpcc::~rpcc()
+{
+	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n",
+			clt_nonce_, chans_[0]?chans_[0]->channo():-1);
+	for (unsigned i = 0; i < chans_.size(); i++) {
+		if(chans_[i]){
+			chans_[i]->closeconn();
+			chans_[i]->decref();
+		}
+	}
+	VERIFY(calls_.size() == 0);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+	VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+	VERIFY(pthread_cond_destroy(&destroy_wait_c_) == 0);
+}
+
+int
+rpcc::bind(TO to)
+{
+	int r;
+	int ret = call(rpc_const::bind, 0, r, to);
+	if(ret == 0){
+		ScopedLock ml(&m_);
+		bind_done_ = true;
+		srv_nonce_ = r;
+	} else {
+		jsl_log(JSL_DBG_2, "rpcc::bind %s failed %d\n",
+				inet_ntoa(dst_.sin_addr), ret);
+	}
+	return ret;
+};
+
+// Cancel all outstanding calls
+void
+rpcc::cancel(void)
+{
+	ScopedLock ml(&m_);
+	jsl_log(JSL_DBG_2, "rpcc::cancel: force callers to fail\n");
+	std::map<int,caller*>::iterator iter;
+	for(iter = calls_.begin(); iter != calls_.end(); iter++){
+		caller *ca = iter->second;
+
+		jsl_log(JSL_DBG_2, "rpcc::cancel: force caller to fail\n");
+		{
+			ScopedLock cl(&ca->m);
+			ca->done = true;
+			ca->intret = rpc_const::cancel_failure;
+			VERIFY(pthread_cond_signal(&ca->c) == 0);
+		}
+	}
+
+	while (calls_.size () > 0){
+		destroy_wait_ = true;
+		VERIFY(pthread_cond_wait(&destroy_wait_c_,&m_) == 0);
+	}
+	jsl_log(JSL_DBG_2, "rpcc::cancel: done\n");
+}
+
+int
+rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
+		TO to)
+{
+	call_state cs(&rep);
+	int ret = start_call(proc, req, cs, to);
+	if (ret < 0)
+		return ret;
+	return finish_call(req, cs);
+}
+
+// registers the call so got_pdu can complete it, and sends it once.
+// returns < 0 if it could not be made at all.
+int
+rpcc::start_call(unsigned int proc, marshall &req, call_state &cs, TO to)
+{
+	caller &ca = cs.ca;
+	{
+		ScopedLock ml(&m_);
+
+		if((proc != rpc_const::bind && !bind_done_) ||
+				(proc == rpc_const::bind && bind_done_)){
+			jsl_log(JSL_DBG_1, "rpcc::call1 rpcc has not been bound to dst or binding twice\n");
+			return rpc_const::bind_failure;
+		}
+
+		if(destroy_wait_){
+			return rpc_const::cancel_failure;
+		}
+
+		ca.xid = xid_++;
+		calls_[ca.xid] = &ca;
+
+		req_header h(ca.xid, proc, clt_nonce_, srv_nonce_,
+				xid_rep_window_.front());
+		req.pack_req_header(h);
+		cs.xid_rep = xid_rep_window_.front();
+	}
+	cs.proc = proc;
+
+	// this rpcc's statistics, and the process's
+	cs.ps[0] = stats_.proc(proc);
+	cs.ps[1] = rpc_client_stats().proc(proc);
+	cs.start = rpc_now_us();
+	for (int i = 0; i < 2; i++)
+		cs.ps[i]->inflight++;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	add_timespec(now, to.to, &cs.finaldeadline);
+	cs.curr_to.to = to_min.to;
+
+	cs.ci = pick_chan(proc, req.size());
+	transmit(req, cs);
+	return 0;
+}
+
+// sends the call on its channel, connecting first if need be
+void
+rpcc::transmit(marshall &req, call_state &cs)
+{
+	get_refconn(&cs.ch, cs.ci);
+	if(cs.ch){
+		if(reachable_) {
+			request forgot;
+			{
+				ScopedLock ml(&m_);
+				if (dup_req_.isvalid() && xid_rep_done_ > dup_req_.xid) {
+					forgot = dup_req_;
+					dup_req_.clear();
+				}
+			}
+			if (forgot.isvalid())
+				cs.ch->send((char *)forgot.buf.c_str(), forgot.buf.size());
+			send_marshall(cs.ch, req);
+		}
+		else jsl_log(JSL_DBG_1, "not reachable\n");
+		jsl_log(JSL_DBG_2,
+				"rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
+				clt_nonce_, cs.proc, cs.ca.xid, clt_nonce_);
+	}
+}
+
+// waits until got_pdu completes the call or it times out, then
+// unregisters it. returns the server's reply code or < 0.
+int
+rpcc::finish_call(marshall &req, call_state &cs)
+{
+	caller &ca = cs.ca;
+	struct timespec now, nextdeadline;
+
+	// an async call's connection may have died while nobody waited
+	if(retrans_ && (!cs.ch || cs.ch->isdead())){
+		bool done;
+		{
+			ScopedLock cal(&ca.m);
+			done = ca.done;
+		}
+		if(!done)
+			transmit(req, cs);
+	}
+
+	while (1){
+		if(!cs.finaldeadline.tv_sec)
+			break;
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		add_timespec(now, cs.curr_to.to, &nextdeadline);
+		if(cmp_timespec(nextdeadline,cs.finaldeadline) > 0){
+			nextdeadline = cs.finaldeadline;
+			cs.finaldeadline.tv_sec = 0;
+		}
+
+		{
+			ScopedLock cal(&ca.m);
+			while (!ca.done){
+				jsl_log(JSL_DBG_2, "rpcc:call1: wait\n");
+				if(pthread_cond_timedwait(&ca.c, &ca.m,
+							&nextdeadline) == ETIMEDOUT){
+					jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
+					break;
+				}
+			}
+			if(ca.done){
+				jsl_log(JSL_DBG_2, "rpcc::call1: reply received\n");
+				break;
+			}
+		}
+
+		if(retrans_ && (!cs.ch || cs.ch->isdead())){
+			// since connection is dead, retransmit
+			// on the new connection
+			transmit(req, cs);
+		}
+		cs.curr_to.to <<= 1;
+	}
+
+	{
+		// no locking of ca.m since only this thread changes ca.xid
+		ScopedLock ml(&m_);
+		calls_.erase(ca.xid);
+		// may need to update the xid again here, in case the
+		// packet times out before it's even sent by the channel.
+		// I don't think there's any harm in possibly doing it twice
+		update_xid_rep(ca.xid);
+
+		if(destroy_wait_){
+			VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
+		}
+	}
+
+	if (ca.done && lossytest_)
+	{
+		ScopedLock ml(&m_);
+		if (!dup_req_.isvalid()) {
+			dup_req_.buf.assign(req.cstr(), req.size());
+			dup_req_.xid = ca.xid;
+		}
+		if (cs.xid_rep > xid_rep_done_)
+			xid_rep_done_ = cs.xid_rep;
+	}
+
+	ScopedLock cal(&ca.m);
+
+	jsl_log(JSL_DBG_2,
+			"rpcc::call1 %u call done for req proc %x xid %u %s:%d done? %d ret %d \n",
+			clt_nonce_, cs.proc, ca.xid, inet_ntoa(dst_.sin_addr),
+			ntohs(dst_.sin_port), ca.done, ca.intret);
+
+	if(cs.ch)
+		cs.ch->decref();
+	done_chan(cs.ci);
+
+	int ret = ca.done? ca.intret : rpc_const::timeout_failure;
+	unsigned long long lat = rpc_now_us() - cs.start;
+	for (int i = 0; i < 2; i++) {
+		cs.ps[i]->calls++;
+		if (ret < 0)
+			cs.ps[i]->errors++;
+		cs.ps[i]->bytes_out += req.size();
+		if (ca.done)
+			cs.ps[i]->bytes_in += ca.un->size();
+		cs.ps[i]->call.record(lat);
+		cs.ps[i]->inflight--;
+	}
+
+	// destruction of req automatically frees its buffer
+	return ret;
+}
+
+void
+rpcc::get_refconn(connection **ch, int i)
+{
+	ScopedLock ml(&chan_m_);
+	// set_conns() may have taken the call's connection away
+	i %= chans_.size();
+	if(!chans_[i] || chans_[i]->isdead()){
+		if(chans_[i])
+			chans_[i]->decref();
+		chans_[i] = connect_to_dst(dst_, this, lossytest_);
+	}
+	if(ch && chans_[i]){
+		if(*ch){
+			(*ch)->decref();
+		}
+		*ch = chans_[i];
+		(*ch)->incref();
+	}
+}
+
+void
+rpcc::set_conns(int n)
+{
+	ScopedLock ml(&chan_m_);
+	if (n < 1)
+		n = 1;
+	if (n > RPC_MAX_CONNS)
+		n = RPC_MAX_CONNS;
+	for (unsigned i = n; i < chans_.size(); i++) {
+		// calls still on it hold their own references
+		if (chans_[i])
+			chans_[i]->decref();
+	}
+	chans_.resize(n, NULL);
+	outstanding_.resize(n, 0);
+}
+
+int
+rpcc::conns()
+{
+	ScopedLock ml(&chan_m_);
+	return chans_.size();
+}
+
+// the connection for a call of proc with a request of sz bytes
+int
+rpcc::pick_chan(unsigned int proc, int sz)
+{
+	ScopedLock ml(&chan_m_);
+	int best = 0;
+	int n = chans_.size();
+	if (n > 1) {
+		rpc_procstat *ps = stats_.proc(proc);
+		unsigned long long calls = ps->calls;
+		unsigned long long expect = sz + (calls ? ps->bytes_in / calls : 0);
+		if (expect >= (unsigned long long)big_call_) {
+			best = 1;
+			for (int i = 2; i < n; i++) {
+				if (outstanding_[i] < outstanding_[best])
+					best = i;
+			}
+		}
+	}
+	outstanding_[best]++;
+	return best;
+}
+
+void
+rpcc::done_chan(int i)
+{
+	ScopedLock ml(&chan_m_);
+	if (i < (int)outstanding_.size() && outstanding_[i] > 0)
+		outstanding_[i]--;
+}
+
+// PollMgr's thread is being used to
+// make this upcall from connection object to rpcc.
+// this funtion must not block.
+//
+// this function keeps no reference for connection *c
+bool
+rpcc::got_pdu(connection *c, char *b, int sz)
+{
+	unmarshall rep(b, sz);
+	reply_header h;
+	rep.unpack_reply_header(&h);
+
+	if(!rep.ok()){
+		jsl_log(JSL_DBG_1, "rpcc:got_pdu unmarshall header failed!!!\n");
+		return true;
+	}
+
+	ScopedLock ml(&m_);
+
+	update_xid_rep(h.xid);
+
+	if(calls_.find(h.xid) == calls_.end()){
+		jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
+		return true;
+	}
+	caller *ca = calls_[h.xid];
+
+	ScopedLock cl(&ca->m);
+	if(!ca->done){
+		ca->un->take_in(rep);
+		ca->intret = h.ret;
+		if(ca->intret < 0){
+			jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
+					h.xid, ca->intret);
+		}
+		ca->done = 1;
+	}
+	VERIFY(pthread_cond_broadcast(&ca->c) == 0);
+	return true;
+}
+
+// assumes thread holds mutex m
+void
+rpcc::update_xid_rep(unsigned int xid)
+{
+	std::list<unsigned int>::iterator it;
+
+	if(xid <= xid_rep_window_.front()){
+		return;
+	}
+
+	for (it = xid_rep_window_.begin(); it != xid_rep_window_.end(); it++){
+		if(*it > xid){
+			xid_rep_window_.insert(it, xid);
+			goto compress;
+		}
+	}
+	xid_rep_window_.push_back(xid);
+
+compress:
+	it = xid_rep_window_.begin();
+	for (it++; it != xid_rep_window_.end(); it++){
+		while (xid_rep_window_.front() + 1 == *it)
+			xid_rep_window_.pop_front();
+	}
+}
+
+
+rpcs::rpcs(unsigned int p1, int count)
+  : port_(p1), reply_bytes_(0), reply_max_bytes_(64 << 20),
+	reply_max_slots_(1024), reply_forgotten_(0), reply_swept_(0),
+	conns_gc_(64),
+	counting_(count), curr_counts_(count), lossytest_(0),
+	reachable_ (true), queued_(0)
+{
+	VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&count_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&reply_window_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&conss_m_, 0) == 0);
+
+	set_rand_seed();
+	nonce_ = random();
+	jsl_log(JSL_DBG_2, "rpcs::rpcs created with nonce %d\n", nonce_);
+
+	char *loss_env = getenv("RPC_LOSSY");
+	if(loss_env != NULL){
+		lossytest_ = atoi(loss_env);
+	}
+
+	// RPC_REPLY_WINDOW bounds the requests remembered per client (it
+	// is rounded up to a power of two), and RPC_REPLY_BYTES the bytes
+	// of replies remembered for all clients
+	char *window_env = getenv("RPC_REPLY_WINDOW");
+	if (window_env != NULL && atoi(window_env) > 0) {
+		reply_max_slots_ = 1;
+		while (reply_max_slots_ < (unsigned int)atoi(window_env))
+			reply_max_slots_ *= 2;
+	}
+	char *bytes_env = getenv("RPC_REPLY_BYTES");
+	if (bytes_env != NULL && atoll(bytes_env) > 0)
+		reply_max_bytes_ = atoll(bytes_env);
+
+	// RPC_DISPATCH_THREADS sets the number of dispatch threads, and
+	// RPC_DISPATCH_CPUS, a comma-separated list, the cpus they run on
+	int nthreads = 6;
+	char *threads_env = getenv("RPC_DISPATCH_THREADS");
+	if (threads_env != NULL && atoi(threads_env) > 0)
+		nthreads = atoi(threads_env);
+	std::vector<int> cpus;
+	char *cpus_env = getenv("RPC_DISPATCH_CPUS");
+	for (char *p = cpus_env; p != NULL && *p; ) {
+		char *e;
+		long cpu = strtol(p, &e, 10);
+		if (e == p)
+			break;
+		cpus.push_back(cpu);
+		p = *e == ',' ? e + 1 : e;
+	}
+
+	reg(rpc_const::bind, this, &rpcs::rpcbind);
+	reg(rpc_const::stats, this, &rpcs::rpcstats);
+	dispatchpool_ = new WsPool(nthreads, false, cpus);
+
+	listener_ = new tcpsconn(this, port_, lossytest_);
+}
+
+rpcs::~rpcs()
+{
+	// must delete listener before dispatchpool
+	delete listener_;
+	delete dispatchpool_;
+	free_reply_window();
+
+	std::map<unsigned int, connection *>::iterator i;
+	for (i = conns_.begin(); i != conns_.end(); i++)
+		i->second->decref();
+}
+
+bool
+rpcs::got_pdu(connection *c, char *b, int sz)
+{
+	if(!reachable_){
+		jsl_log(JSL_DBG_1, "rpcss::got_pdu: not reachable\n");
+		return true;
+	}
+
+	djob_t *j = new djob_t(c, b, sz);
+	c->incref();
+	queued_++;
+	bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
+	if(!succ || !reachable_){
+		queued_--;
+		c->decref();
+		delete j;
+	}
+	return succ;
+}
+
+void
+rpcs::reg1(unsigned int proc, handler *h)
+{
+	ScopedLock pl(&procs_m_);
+	VERIFY(procs_.count(proc) == 0);
+	procs_[proc] = h;
+	VERIFY(procs_.count(proc) >= 1);
+}
+
+void
+rpcs::updatestat(unsigned int proc)
+{
+	ScopedLock cl(&count_m_);
+	counts_[proc]++;
+	curr_counts_--;
+	if(curr_counts_ == 0){
+		std::map<int, int>::iterator i;
+		printf("RPC STATS: ");
+		for (i = counts_.begin(); i != counts_.end(); i++){
+			printf("%x:%d ", i->first, i->second);
+		}
+		printf("\n");
+
+		ScopedLock rwl(&reply_window_m_);
+		std::map<unsigned int, window_t>::iterator clt;
+
+		unsigned int maxslots = 0;
+		for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
+			if(clt->second.slots.size() > maxslots)
+				maxslots = clt->second.slots.size();
+		}
+		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %d reply bytes %llu max slots per client %u forgotten %llu\n",
+				(int) reply_window_.size(), reply_bytes_, maxslots,
+				reply_forgotten_);
+
+		rpcbuf_stats bs;
+		rpcbuf_getstats(&bs);
+		unsigned long long all = bs.hits + bs.refills + bs.misses;
+		jsl_log(JSL_DBG_1, "BUFFERS: %llu allocated, %llu%% from thread caches, %llu%% from the depot, %llu malloc'd\n",
+				all, all ? 100 * bs.hits / all : 0, all ? 100 * bs.refills / all : 0, bs.misses);
+		curr_counts_ = counting_;
+	}
+}
+
+void
+rpcs::dispatch(djob_t *j)
+{
+	connection *c = j->conn;
+	unmarshall req(j->buf, j->sz);
+	unsigned long long arrived = j->arrived;
+	unsigned long long now = rpc_now_us();
+	delete j;
+	queued_--;
+
+	req_header h;
+	req.unpack_req_header(&h);
+	int proc = h.proc;
+
+	if(!req.ok()){
+		jsl_log(JSL_DBG_1, "rpcs:dispatch unmarshall header failed!!!\n");
+		c->decref();
+		return;
+	}
+
+	jsl_log(JSL_DBG_2,
+			"rpcs::dispatch: rpc %u (proc %x, last_rep %u) from clt %u for srv instance %u \n",
+			h.xid, proc, h.xid_rep, h.clt_nonce, h.srv_nonce);
+
+	rpc_procstat *ps = stats_.proc(proc);
+	ps->queue.record(now - arrived);
+	ps->bytes_in += req.size();
+
+	marshall rep;
+	std::shared_ptr<marshall> rp;
+	reply_header rh(h.xid,0);
+
+	// is client sending to an old instance of server?
+	if(h.srv_nonce != 0 && h.srv_nonce != nonce_){
+		jsl_log(JSL_DBG_2,
+				"rpcs::dispatch: rpc for an old server instance %u (current %u) proc %x\n",
+				h.srv_nonce, nonce_, h.proc);
+		rh.ret = rpc_const::oldsrv_failure;
+		rep.pack_reply_header(rh);
+		c->send(rep.cstr(),rep.size());
+		c->decref();
+		ps->errors++;
+		return;
+	}
+
+	handler *f;
+	// is RPC proc a registered procedure?
+	{
+		ScopedLock pl(&procs_m_);
+		if(procs_.count(proc) < 1){
+			fprintf(stderr, "rpcs::dispatch: unknown proc %x.\n",
+					proc);
+			c->decref();
+			VERIFY(0);
+			return;
+		}
+
+		f = procs_[proc];
+	}
+
+	rpcs::rpcstate_t stat;
+
+	if(h.clt_nonce){
+		// save the latest good connection to the client
+		{
+			ScopedLock rwl(&conss_m_);
+			if(conns_.find(h.clt_nonce) == conns_.end()){
+				if(conns_.size() >= conns_gc_)
+					gc_conns();
+				c->incref();
+				conns_[h.clt_nonce] = c;
+			} else if(conns_[h.clt_nonce]->compare(c) < 0){
+				conns_[h.clt_nonce]->decref();
+				c->incref();
+				conns_[h.clt_nonce] = c;
+			}
+		}
+
+		stat = checkduplicate_and_update(h.clt_nonce, h.xid,
+				h.xid_rep, &rp);
+	} else {
+		// this client does not require at most once logic
+		stat = NEW;
+	}
+
+	ps->inflight++;
+	switch (stat){
+		case NEW: // new request
+			if(counting_){
+				updatestat(proc);
+			}
+
+			rp.reset(new marshall);
+			now = rpc_now_us();
+			rh.ret = f->fn(req, *rp);
+			ps->handler.record(rpc_now_us() - now);
+			ps->calls++;
+			if (rh.ret == rpc_const::unmarshal_args_failure) {
+				fprintf(stderr, "rpcs::dispatch: failed to"
+						" unmarshall the arguments. You are"
+						" probably calling RPC 0x%x with wrong"
+						" types of arguments.\n", proc);
+				VERIFY(0);
+			}
+			VERIFY(rh.ret >= 0);
+
+			rp->pack_reply_header(rh);
+
+			jsl_log(JSL_DBG_2,
+					"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
+					rp->size(), h.xid, proc, rh.ret, h.clt_nonce);
+
+			if(h.clt_nonce > 0){
+				// only record replies for clients that require at-most-once logic
+				if (!add_reply(h.clt_nonce, h.xid, rp))
+					jsl_log(JSL_DBG_2, "rpcs::dispatch: reply %u of clt %u not kept\n",
+							h.xid, h.clt_nonce);
+
+				// get the latest connection to the client
+				ScopedLock rwl(&conss_m_);
+				std::map<unsigned int, connection *>::iterator ci =
+					conns_.find(h.clt_nonce);
+				if(c->isdead() && ci != conns_.end() && c != ci->second){
+					c->decref();
+					c = ci->second;
+					c->incref();
+				}
+			}
+
+			ps->bytes_out += rp->size();
+			now = rpc_now_us();
+			send_marshall(c, *rp);
+			ps->reply.record(rpc_now_us() - now);
+			break;
+		case INPROGRESS: // server is working on this request
+			ps->dups++;
+			break;
+		case DONE: // duplicate and we still have the response
+			ps->dups++;
+			ps->bytes_out += rp->size();
+			now = rpc_now_us();
+			send_marshall(c, *rp);
+			ps->reply.record(rpc_now_us() - now);
+			break;
+		case FORGOTTEN: // very old request and we don't have the response anymore
+			jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n",
+					h.xid, h.clt_nonce);
+			rh.ret = rpc_const::atmostonce_failure;
+			rep.pack_reply_header(rh);
+			c->send(rep.cstr(),rep.size());
+			ps->errors++;
+			break;
+	}
+	ps->call.record(rpc_now_us() - arrived);
+	ps->inflight--;
+	c->decref();
+}
+
+// forget the connections of clients that have gone away, so their
+// descriptors can be closed. runs once conns_ has doubled since the
+// last time. assumes conss_m_ is held.
+void
+rpcs::gc_conns()
+{
+	std::map<unsigned int, connection *>::iterator i;
+	for (i = conns_.begin(); i != conns_.end();) {
+		if (i->second->isdead()) {
+			i->second->decref();
+			conns_.erase(i++);
+		} else
+			++i;
+	}
+	conns_gc_ = conns_.size() * 2 > 64 ? conns_.size() * 2 : 64;
+}
+
+// rpcs::dispatch calls this when an RPC request arrives.
+//
+// checks to see if an RPC with xid from clt_nonce has already been received.
+// if not, remembers the request in reply_window_.
+//
+// deletes remembered requests with XIDs <= xid_rep; the client
+// says it has received a reply for every RPC up through xid_rep.
+// frees the reply_t::rep of each such request.
+//
+// returns one of:
+//   NEW: never seen this xid before.
+//   INPROGRESS: seen this xid, and still processing it.
+//   DONE: seen this xid, previous reply returned in *rep.
+//   FORGOTTEN: might have seen this xid, but deleted previous reply.
+//
+// a request is found in its slot, so this takes constant time apart
+// from freeing the slots xid_rep acknowledges.
+rpcs::rpcstate_t
+rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
+		unsigned int xid_rep, std::shared_ptr<marshall> *rep)
+{
+	ScopedLock rwl(&reply_window_m_);
+
+	unsigned long long now = rpc_now_us();
+	if (now - reply_swept_ > (unsigned long long)rpcc::to_max.to * 1000)
+		drop_idle_windows(now);
+
+	std::map<unsigned int, window_t>::iterator wi =
+		reply_window_.find(clt_nonce);
+	if (wi == reply_window_.end()) {
+		wi = reply_window_.insert(std::make_pair(clt_nonce, window_t())).first;
+		wi->second.slots.resize(16);
+		jsl_log(JSL_DBG_2, "rpcs::checkduplicate_and_update: new client %u, total clients %d\n",
+				clt_nonce, (int)reply_window_.size());
+	}
+	window_t &w = wi->second;
+	w.used = now;
+
+	if (xid_rep > w.base)
+		forget_upto(w, xid_rep);
+
+	if (xid <= w.base)
+		return FORGOTTEN;
+
+	if (xid - w.base > w.slots.size()) {
+		// grow the ring, or if it cannot grow, give up on the oldest
+		unsigned int n = w.slots.size();
+		while (n < reply_max_slots_ && xid - w.base > n)
+			n *= 2;
+		if (n != w.slots.size()) {
+			std::vector<reply_t> slots(n);
+			for (unsigned int i = 0; i < w.slots.size(); i++) {
+				if (w.slots[i].xid)
+					slots[w.slots[i].xid % n] = w.slots[i];
+			}
+			w.slots.swap(slots);
+		}
+		if (xid - w.base > n)
+			forget_upto(w, xid - n);
+	}
+
+	reply_t &r = w.slots[xid % w.slots.size()];
+	if (r.xid == xid) {
+		if (r.state == DONE)
+			*rep = r.rep;
+		return r.state;
+	}
+	VERIFY(r.xid == 0);
+	r.xid = xid;
+	r.state = INPROGRESS;
+	return NEW;
+}
+
+// free the slots of w for xids up through xid, and move w's base there.
+// assumes reply_window_m_ is held.
+void
+rpcs::forget_upto(window_t &w, unsigned int xid)
+{
+	unsigned int n = w.slots.size();
+	unsigned int end = xid - w.base > n ? w.base + n : xid;
+	for (unsigned int x = w.base + 1; x <= end; x++) {
+		reply_t &r = w.slots[x % n];
+		if (r.xid == 0)
+			continue;
+		if (r.rep) {
+			unsigned long long sz = r.rep->size();
+			w.bytes -= sz;
+			reply_bytes_ -= sz;
+		}
+		r = reply_t();
+	}
+	w.base = xid;
+}
+
+// rpcs::dispatch calls add_reply when it is sending a reply to an RPC,
+// and passes the marshalled reply in rep.
+// add_reply() should remember rep, and returns false if it could not
+// because the request has since been forgotten.
+// free_reply_window() and checkduplicate_and_update are responsible for
+// dropping rep.
+bool
+rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
+		const std::shared_ptr<marshall> &rep)
+{
+	ScopedLock rwl(&reply_window_m_);
+
+	std::map<unsigned int, window_t>::iterator wi =
+		reply_window_.find(clt_nonce);
+	if (wi == reply_window_.end())
+		return false;
+	window_t &w = wi->second;
+	// the client gave up on this xid while we were working on it,
+	// or the window slid past it
+	if (xid <= w.base || xid - w.base > w.slots.size())
+		return false;
+	reply_t &r = w.slots[xid % w.slots.size()];
+	if (r.xid != xid)
+		return false;
+
+	r.rep = rep;
+	r.state = DONE;
+	unsigned long long sz = rep->size();
+	w.bytes += sz;
+	reply_bytes_ += sz;
+	if (w.inlru)
+		reply_lru_.erase(w.lru);
+	w.lru = reply_lru_.insert(reply_lru_.end(), clt_nonce);
+	w.inlru = true;
+
+	// over the cap: forget the replies of the clients we have not
+	// replied to for longest, but not the one just added
+	while (reply_bytes_ > reply_max_bytes_) {
+		unsigned int victim = reply_lru_.front();
+		forget_replies(victim, victim == clt_nonce ? xid : 0);
+		if (victim == clt_nonce)
+			break;
+	}
+	return true;
+}
+
+// drop the replies of a client, apart from that of xid keep, so a
+// retransmission of those requests gets FORGOTTEN, and take the
+// client off reply_lru_ if it has none left.
+// assumes reply_window_m_ is held.
+void
+rpcs::forget_replies(unsigned int clt_nonce, unsigned int keep)
+{
+	window_t &w = reply_window_[clt_nonce];
+	for (unsigned int i = 0; i < w.slots.size(); i++) {
+		reply_t &r = w.slots[i];
+		if (r.state != DONE || r.xid == keep)
+			continue;
+		unsigned long long sz = r.rep->size();
+		w.bytes -= sz;
+		reply_bytes_ -= sz;
+		r.rep.reset();
+		r.state = FORGOTTEN;
+		reply_forgotten_++;
+	}
+	if (w.bytes == 0 && w.inlru) {
+		reply_lru_.erase(w.lru);
+		w.inlru = false;
+	}
+}
+
+// forget the windows of clients that have sent nothing for twice
+// rpcc::to_max. an rpcc gives up on a call after to_max, so none of
+// their requests can come again; one that does is taken for new.
+// windows with a request still being served are kept.
+// assumes reply_window_m_ is held.
+void
+rpcs::drop_idle_windows(unsigned long long now)
+{
+	reply_swept_ = now;
+	unsigned long long idle = 2ULL * rpcc::to_max.to * 1000;
+	std::map<unsigned int, window_t>::iterator wi;
+	for (wi = reply_window_.begin(); wi != reply_window_.end();) {
+		window_t &w = wi->second;
+		bool busy = false;
+		for (unsigned int i = 0; i < w.slots.size() && !busy; i++)
+			busy = w.slots[i].state == INPROGRESS;
+		if (busy || now - w.used <= idle) {
+			++wi;
+			continue;
+		}
+		jsl_log(JSL_DBG_2, "rpcs::drop_idle_windows: client %u\n", wi->first);
+		reply_bytes_ -= w.bytes;
+		if (w.inlru)
+			reply_lru_.erase(w.lru);
+		reply_window_.erase(wi++);
+	}
+}
+
+void
+rpcs::free_reply_window(void)
+{
+	ScopedLock rwl(&reply_window_m_);
+	reply_window_.clear();
+	reply_lru_.clear();
+	reply_bytes_ = 0;
+}
+
+// rpc handler
+int
+rpcs::rpcbind(int a, int &r)
+{
+	jsl_log(JSL_DBG_2, "rpcs::rpcbind called return nonce %u\n", nonce_);
+	r = nonce_;
+	return 0;
+}
+
+// rpc handler
+int
+rpcs::rpcstats(int a, rpc_stats_reply &r)
+{
+	r.queued = queued_;
+	{
+		ScopedLock rwl(&reply_window_m_);
+		r.clients = reply_window_.size();
+		r.reply_bytes = reply_bytes_;
+		r.forgotten = reply_forgotten_;
+	}
+	stats_.get(&r.server);
+	rpc_client_stats().get(&r.client);
+	connection_stats(&r.batch, &r.pdus_in, &r.reads);
+	return 0;
+}
+
+void
+marshall::rawbyte(unsigned char x)
+{
+	if(_ind >= _capa){
+		VERIFY (_buf != NULL);
+		_buf = rpcbuf_realloc(_buf, 2*_capa, &_capa);
+	}
+	_buf[_ind++] = x;
+}
+
+void
+marshall::rawbytes(const char *p, int n)
+{
+	if((_ind+n) > _capa){
+		_capa = _capa > n? 2*_capa:(_capa+n);
+		VERIFY (_buf != NULL);
+		_buf = rpcbuf_realloc(_buf, _capa, &_capa);
+	}
+	memcpy(_buf+_ind, p, n);
+	_ind += n;
+}
+
+void
+marshall::rawref(const char *p, int n)
+{
+	if(n < MARSHALL_REF_SZ){
+		rawbytes(p, n);
+		return;
+	}
+	ref r = { _ind, p, n, -1 };
+	_refs.push_back(r);
+	_refsz += n;
+}
+
+void
+marshall::take(std::string &s)
+{
+	*this << (unsigned int) s.size();
+	if(s.size() < MARSHALL_REF_SZ){
+		rawbytes(s.data(), s.size());
+		return;
+	}
+	ref r = { _ind, NULL, (int) s.size(), (int) _own.size() };
+	_own.push_back(std::string());
+	_own.back().swap(s);
+	_refs.push_back(r);
+	_refsz += r.n;
+}
+
+void
+marshall::flatten()
+{
+	if(_refs.empty())
+		return;
+	int sz = _ind + _refsz;
+	if(sz > _capa)
+		_buf = rpcbuf_realloc(_buf, sz, &_capa);
+	// move the marshalled bytes apart from the back, so each
+	// run of _buf is moved once
+	int end = sz;
+	int tail = _ind;
+	for(int i = _refs.size() - 1; i >= 0; i--){
+		ref &r = _refs[i];
+		const char *p = r.own >= 0 ? _own[r.own].data() : r.p;
+		end -= tail - r.off;
+		memmove(_buf + end, _buf + r.off, tail - r.off);
+		end -= r.n;
+		memcpy(_buf + end, p, r.n);
+		tail = r.off;
+	}
+	VERIFY(end == tail);
+	_ind = sz;
+	_refs.clear();
+	_own.clear();
+	_refsz = 0;
+}
+
+void
+marshall::iov(struct iovec *v)
+{
+	int done = 0;
+	for(unsigned i = 0; i < _refs.size(); i++){
+		ref &r = _refs[i];
+		v->iov_base = _buf + done;
+		v->iov_len = r.off - done;
+		v++;
+		v->iov_base = (void *)(r.own >= 0 ? _own[r.own].data() : r.p);
+		v->iov_len = r.n;
+		v++;
+		done = r.off;
+	}
+	v->iov_base = _buf + done;
+	v->iov_len = _ind - done;
+}
+
+marshall &
+operator<<(marshall &m, bool x)
+{
+	m.rawbyte(x);
+	return m;
+}
+
+marshall &
+operator<<(marshall &m, unsigned char x)
+{
+	m.rawbyte(x);
+	return m;
+}
+
+marshall &
+operator<<(marshall &m, char x)
+{
+	m << (unsigned char) x;
+	return m;
+}
+
+
+marshall &
+operator<<(marshall &m, unsigned short x)
+{
+	m.rawbyte((x >> 8) & 0xff);
+	m.rawbyte(x & 0xff);
+	return m;
+}
+
+marshall &
+operator<<(marshall &m, short x)
+{
+	m << (unsigned short) x;
+	return m;
+}
+
+marshall &
+operator<<(marshall &m, unsigned int x)
+{
+	// network order is big-endian
+	m.rawbyte((x >> 24) & 0xff);
+	m.rawbyte((x >> 16) & 0xff);
+	m.rawbyte((x >> 8) & 0xff);
+	m.rawbyte(x & 0xff);
+	return m;
+}
+
+marshall &
+operator<<(marshall &m, int x)
+{
+	m << (unsigned int) x;
+	return m;
+}
+
+marshall &
+operator<<(marshall &m, const std::string &s)
+{
+	m << (unsigned int) s.size();
+	m.rawref(s.data(), s.size());
+	return m;
+}
+
+marshall &
+operator<<(marshall &m, const strview &v)
+{
+	m << v.size;
+	m.rawref(v.data, v.size);
+	return m;
+}
+
+marshall &
+operator<<(marshall &m, unsigned long long x)
+{
+	m << (unsigned int) (x >> 32);
+	m << (unsigned int) x;
+	return m;
+}
+
+void
+marshall::pack(int x)
+{
+	rawbyte((x >> 24) & 0xff);
+	rawbyte((x >> 16) & 0xff);
+	rawbyte((x >> 8) & 0xff);
+	rawbyte(x & 0xff);
+}
+
+void
+unmarshall::unpack(int *x)
+{
+	(*x) = (rawbyte() & 0xff) << 24;
+	(*x) |= (rawbyte() & 0xff) << 16;
+	(*x) |= (rawbyte() & 0xff) << 8;
+	(*x) |= rawbyte() & 0xff;
+}
+
+// take the contents from another unmarshall object
+void
+unmarshall::take_in(unmarshall &another)
+{
+	rpcbuf_free(_buf);
+	another.take_buf(&_buf, &_sz);
+	_ind = RPC_HEADER_SZ;
+	_ok = _sz >= RPC_HEADER_SZ?true:false;
+}
+
+bool
+unmarshall::okdone()
+{
+	if(ok() && _ind == _sz){
+		return true;
+	} else {
+		return false;
+	}
+}
+
+unsigned int
+unmarshall::rawbyte()
+{
+	char c = 0;
+	if(_ind >= _sz)
+		_ok = false;
+	else
+		c = _buf[_ind++];
+	return c;
+}
+
+unmarshall &
+operator>>(unmarshall &u, bool &x)
+{
+	x = (bool) u.rawbyte() ;
+	return u;
+}
+
+unmarshall &
+operator>>(unmarshall &u, unsigned char &x)
+{
+	x = (unsigned char) u.rawbyte() ;
+	return u;
+}
+
+unmarshall &
+operator>>(unmarshall &u, char &x)
+{
+	x = (char) u.rawbyte();
+	return u;
+}
+
+
+unmarshall &
+operator>>(unmarshall &u, unsigned short &x)
+{
+	x = (u.rawbyte() & 0xff) << 8;
+	x |= u.rawbyte() & 0xff;
+	return u;
+}
+
+unmarshall &
+operator>>(unmarshall &u, short &x)
+{
+	x = (u.rawbyte() & 0xff) << 8;
+	x |= u.rawbyte() & 0xff;
+	return u;
+}
+
+unmarshall &
+operator>>(unmarshall &u, unsigned int &x)
+{
+	x = (u.rawbyte() & 0xff) << 24;
+	x |= (u.rawbyte() & 0xff) << 16;
+	x |= (u.rawbyte() & 0xff) << 8;
+	x |= u.rawbyte() & 0xff;
+	return u;
+}
+
+unmarshall &
+operator>>(unmarshall &u, int &x)
+{
+	x = (u.rawbyte() & 0xff) << 24;
+	x |= (u.rawbyte() & 0xff) << 16;
+	x |= (u.rawbyte() & 0xff) << 8;
+	x |= u.rawbyte() & 0xff;
+	return u;
+}
+
+unmarshall &
+operator>>(unmarshall &u, unsigned long long &x)
+{
+	unsigned int h, l;
+	u >> h;
+	u >> l;
+	x = l | ((unsigned long long) h << 32);
+	return u;
+}
+
+unmarshall &
+operator>>(unmarshall &u, std::string &s)
+{
+	unsigned sz;
+	u >> sz;
+	if(u.ok())
+		u.rawbytes(s, sz);
+	return u;
+}
+
+unmarshall &
+operator>>(unmarshall &u, strview &v)
+{
+	unsigned sz;
+	u >> sz;
+	if(u.ok())
+		u.rawview(v, sz);
+	return u;
+}
+
+void
+unmarshall::rawbytes(std::string &ss, unsigned int n)
+{
+	if((_ind+n) > (unsigned)_sz){
+		_ok = false;
+	} else {
+		std::string tmps = std::string(_buf+_ind, n);
+		swap(ss, tmps);
+		VERIFY(ss.size() == n);
+		_ind += n;
+	}
+}
+
+void
+unmarshall::rawview(strview &v, unsigned int n)
+{
+	if((_ind+n) > (unsigned)_sz){
+		_ok = false;
+	} else {
+		v = strview(_buf+_ind, n);
+		_ind += n;
+	}
+}
+
+bool operator<(const sockaddr_in &a, const sockaddr_in &b){
+	return ((a.sin_addr.s_addr < b.sin_addr.s_addr) ||
+			((a.sin_addr.s_addr == b.sin_addr.s_addr) &&
+			 ((a.sin_port < b.sin_port))));
+}
+
+/*---------------auxilary function--------------*/
+void
+make_sockaddr(const char *hostandport, struct sockaddr_in *dst){
+
+	char host[200];
+	const char *localhost = "127.0.0.1";
+	rpc_transport t = RPC_TCP;
+	if (strncmp(hostandport, "unix:", 5) == 0) {
+		t = RPC_UNIX;
+		hostandport += 5;
+	} else if (strncmp(hostandport, "shm:", 4) == 0) {
+		t = RPC_SHM;
+		hostandport += 4;
+	}
+	const char *port = index(hostandport, ':');
+	if(port == NULL){
+		memcpy(host, localhost, strlen(localhost)+1);
+		port = hostandport;
+	} else {
+		memcpy(host, hostandport, port-hostandport);
+		host[port-hostandport] = '\0';
+		port++;
+	}
+
+	make_sockaddr(host, port, dst);
+	set_transport(dst, t);
+}
+
+void
+make_sockaddr(const char *host, const char *port, struct sockaddr_in *dst){
+
+	in_addr_t a;
+
+	bzero(dst, sizeof(*dst));
+	dst->sin_family = AF_INET;
+
+	a = inet_addr(host);
+	if(a != INADDR_NONE){
+		dst->sin_addr.s_addr = a;
+	} else {
+		struct hostent *hp = gethostbyname(host);
+		if(hp == 0 || hp->h_length != 4){
+			fprintf(stderr, "cannot find host name %s\n", host);
+			exit(1);
+		}
+		dst->sin_addr.s_addr = ((struct in_addr *)(hp->h_addr))->s_addr;
+	}
+	dst->sin_port = htons(atoi(port));
+}
+
+int
+cmp_timespec(const struct timespec &a, const struct timespec &b)
+{
+	if(a.tv_sec > b.tv_sec)
+		return 1;
+	else if(a.tv_sec < b.tv_sec)
+		return -1;
+	else {
+		if(a.tv_nsec > b.tv_nsec)
+			return 1;
+		else if(a.tv_nsec < b.tv_nsec)
+			return -1;
+		else
+			return 0;
+	}
+}
+
+void
+add_timespec(const struct timespec &a, int b, struct timespec *result)
+{
+	// convert to millisec, add timeout, convert back
+	result->tv_sec = a.tv_sec + b/1000;
+	result->tv_nsec = a.tv_nsec + (b % 1000) * 1000000;
+	VERIFY(result->tv_nsec >= 0);
+	while (result->tv_nsec > 1000000000){
+		result->tv_sec++;
+		result->tv_nsec-=1000000000;
+	}
+}
+
+int
+diff_timespec(const struct timespec &end, const struct timespec &start)
+{
+	int diff = (end.tv_sec > start.tv_sec)?(end.tv_sec-start.tv_sec)*1000:0;
+	VERIFY(diff || end.tv_sec == start.tv_sec);
+	if(end.tv_nsec > start.tv_nsec){
+		diff += (end.tv_nsec-start.tv_nsec)/1000000;
+	} else {
+		diff -= (start.tv_nsec-end.tv_nsec)/1000000;
+	}
+	return diff;
+}
@@ -3,11 +3,19 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <future>
 #include <list>
 #include <map>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <stdio.h>
 
 #include "thr_pool.h"
+#include "wspool.h"
+#include "rpc_stats.h"
 #include "marshall.h"
 #include "connection.h"
 
@@ -18,6 +26,7 @@
 class rpc_const {
 	public:
 		static const unsigned int bind = 1;   // handler number reserved for bind
+		static const unsigned int stats = 2;  // and for rpcs statistics
 		static const int timeout_failure = -1;
 		static const int unmarshal_args_failure = -2;
 		static const int unmarshal_reply_failure = -3;
@@ -27,9 +36,28 @@ class rpc_const {
 		static const int cancel_failure = -7;
 };
 
+// compile-time description of an RPC: its number, its reply type and
+// its argument types, in order. protocols declare one per procedure,
+// e.g.
+//   typedef rpc_proc<extent_protocol::get, std::string,
+//           extent_protocol::extentid_t> get;
+// and pass it in place of the number to rpcc::call and rpcs::reg.
+template<unsigned int P, class R, class... A> struct rpc_proc {
+	enum { proc = P };
+};
+
+#define RPC_MAX_CONNS 16	// connections one rpcc may have to its server
+
 // rpc client endpoint.
 // manages a xid space per destination socket
 // threaded: multiple threads can be sending RPCs,
+//
+// an rpcc may spread its calls over several connections to the server
+// (see set_conns()), so bulk transfers do not hold up small calls
+// behind them. the first connection carries the calls expected to be
+// small: a request and a mean reply for the procedure of less than
+// RPC_BIG_CALL bytes (default 8192). the rest take the others, each
+// call going to the one with the fewest calls outstanding.
 class rpcc : public chanmgr {
 
 	private:
@@ -47,7 +75,9 @@ class rpcc : public chanmgr {
 			pthread_cond_t c;
 		};
 
-		void get_refconn(connection **ch);
+		void get_refconn(connection **ch, int i);
+		int pick_chan(unsigned int proc, int sz);
+		void done_chan(int i);
 		void update_xid_rep(unsigned int xid);
 
 
@@ -60,7 +90,10 @@ class rpcc : public chanmgr {
 		bool retrans_;
 		bool reachable_;
 
-		connection *chan_;
+		// made when first used
+		std::vector<connection *> chans_;
+		std::vector<int> outstanding_;	// calls on each
+		int big_call_;
 
 		pthread_mutex_t m_; // protect insert/delete to calls[]
 		pthread_mutex_t chan_m_;
@@ -80,6 +113,8 @@ class rpcc : public chanmgr {
                 };
                 struct request dup_req_;
                 int xid_rep_done_;
+
+		rpc_stats stats_;
 	public:
 
 		rpcc(sockaddr_in d, bool retrans=true);
@@ -92,12 +127,60 @@ class rpcc : public chanmgr {
 		static const TO to_min;
 		static TO to(int x) { TO t; t.to = x; return t;}
 
+	private:
+		// a call from when it is sent until its reply is taken:
+		// start_call() registers and sends it, got_pdu completes it,
+		// and finish_call() waits for that, retransmitting if the
+		// connection dies, and unregisters it.
+		struct call_state {
+			call_state(unmarshall *rep) : ca(0, rep), ch(NULL) {}
+			caller ca;
+			unsigned int proc;
+			int xid_rep;
+			int ci;
+			connection *ch;
+			rpc_procstat *ps[2];
+			unsigned long long start;
+			TO curr_to;
+			struct timespec finaldeadline;
+		};
+		int start_call(unsigned int proc, marshall &req, call_state &cs, TO to);
+		void transmit(marshall &req, call_state &cs);
+		int finish_call(marshall &req, call_state &cs);
+
+		// an asynchronous call. if its future is dropped without get(),
+		// the call is still waited for, so it never outlives the rpcc.
+		struct async_call {
+			async_call(rpcc *c) : c(c), cs(&rep), started(false), finished(false) {}
+			~async_call() { if (started && !finished) c->finish_call(req, cs); }
+			rpcc *c;
+			marshall req;
+			unmarshall rep;
+			call_state cs;
+			bool started;
+			bool finished;
+		};
+
+		template<class R>
+			static int take_reply(unsigned int proc, int intret, unmarshall &u, R &r);
+
+	public:
+
 		unsigned int id() { return clt_nonce_; }
 
+		// latency and bytes of the calls made through this rpcc
+		rpc_stats &stats() { return stats_; }
+
 		int bind(TO to = to_max);
 
 		void set_reachable(bool r) { reachable_ = r; }
 
+		// use n connections (1 to RPC_MAX_CONNS) from now on. the
+		// default comes from RPC_CONNS: a count for all destinations,
+		// and host:port=count for particular ones, separated by commas.
+		void set_conns(int n);
+		int conns();
+
 		void cancel();
                 
                 int islossy() { return lossytest_ > 0; }
@@ -111,32 +194,37 @@ class rpcc : public chanmgr {
 		template<class R>
 			int call_m(unsigned int proc, marshall &req, R & r, TO to);
 
+		// call(proc, a1, ..., an, r [, to]) marshalls each argument as
+		// whatever type it has at the call site.
+		template<class... Args>
+			int call(unsigned int proc, Args&&... args);
+		// call(rpc_proc<...>(), a1, ..., an, r [, to]) converts each
+		// argument to the type the descriptor gives it, and will only
+		// compile with the right number of arguments and reply type.
+		template<unsigned int P, class R, class... A, class... Args>
+			int call(rpc_proc<P, R, A...>, Args&&... args);
+
+		// call_async(rpc_proc<...>(), a1, ..., an, r [, to]) sends the
+		// call and returns without waiting for it. got_pdu completes it
+		// when the reply arrives, and get() on the future then only
+		// unmarshalls the reply into r, which must outlive the future.
+		// a get() before the reply waits for it, as call() would. the
+		// arguments are copied, so they may go away at once.
+		template<unsigned int P, class R, class... A, class... Args>
+			std::future<int> call_async(rpc_proc<P, R, A...>, Args&&... args);
 		template<class R>
-			int call(unsigned int proc, R & r, TO to = to_max); 
-		template<class R, class A1>
-			int call(unsigned int proc, const A1 & a1, R & r, TO to = to_max); 
-		template<class R, class A1, class A2>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, R & r, 
-					TO to = to_max); 
-		template<class R, class A1, class A2, class A3>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, R & r, TO to = to_max);
-		template<class R, class A1, class A2, class A3, class A4, class A5>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, const A5 & a5, R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5,
-			class A6>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 & a6,
-						R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5, 
-			class A6, class A7>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 &a6, const A7 &a7,
-						R & r, TO to = to_max); 
+			std::future<int> call_async_m(unsigned int proc,
+					std::shared_ptr<async_call> a, R &r, TO to);
+
+		template<class R>
+			int call_args(unsigned int proc, marshall &m, R &r)
+			{ return call_m(proc, m, r, to_max); }
+		template<class R>
+			int call_args(unsigned int proc, marshall &m, R &r, TO to)
+			{ return call_m(proc, m, r, to); }
+		template<class A, class... Rest>
+			int call_args(unsigned int proc, marshall &m, const A &a, Rest&&... rest)
+			{ m << a; return call_args(proc, m, std::forward<Rest>(rest)...); } 
 
 };
 
@@ -145,6 +233,12 @@ rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to)
 {
 	unmarshall u;
 	int intret = call1(proc, req, u, to);
+	return take_reply(proc, intret, u, r);
+}
+
+template<class R> int
+rpcc::take_reply(unsigned int proc, int intret, unmarshall &u, R &r)
+{
 	if (intret < 0) return intret;
 	u >> r;
 	if(u.okdone() != true) {
@@ -157,99 +251,95 @@ rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to)
 	return intret;
 }
 
-template<class R> int
-rpcc::call(unsigned int proc, R & r, TO to) 
+template<class... Args> int
+rpcc::call(unsigned int proc, Args&&... args)
 {
 	marshall m;
-	return call_m(proc, m, r, to);
+	return call_args(proc, m, std::forward<Args>(args)...);
 }
 
-template<class R, class A1> int
-rpcc::call(unsigned int proc, const A1 & a1, R & r, TO to) 
-{
-	marshall m;
-	m << a1;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		R & r, TO to) 
-{
-	marshall m;
-	m << a1;
-	m << a2;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2, class A3> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, R & r, TO to) 
-{
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	return call_m(proc, m, r, to);
-}
+// marshalls the arguments of a typed call one at a time, each as the
+// next of the descriptor's argument types A...
+template<class R, class... A> struct rpc_typed_args;
+
+template<class R> struct rpc_typed_args<R> {
+	static int call(rpcc *c, unsigned int proc, marshall &m, R &r,
+			rpcc::TO to = rpcc::to_max)
+	{
+		return c->call_m(proc, m, r, to);
+	}
+	template<class AC>
+	static std::future<int> call_async(rpcc *c, unsigned int proc,
+			std::shared_ptr<AC> a, R &r, rpcc::TO to = rpcc::to_max)
+	{
+		return c->call_async_m(proc, a, r, to);
+	}
+};
 
-template<class R, class A1, class A2, class A3, class A4> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, R & r, TO to) 
-{
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	return call_m(proc, m, r, to);
-}
+template<class R, class A, class... Rest> struct rpc_typed_args<R, A, Rest...> {
+	template<class X, class... Tail>
+	static int call(rpcc *c, unsigned int proc, marshall &m, const X &x,
+			Tail&&... tail)
+	{
+		// a converted argument lives until the call returns, so the
+		// marshall may refer to it
+		const A &a = x;
+		m << a;
+		return rpc_typed_args<R, Rest...>::call(c, proc, m,
+				std::forward<Tail>(tail)...);
+	}
+	template<class AC, class X, class... Tail>
+	static std::future<int> call_async(rpcc *c, unsigned int proc,
+			std::shared_ptr<AC> ac, const X &x, Tail&&... tail)
+	{
+		const A &a = x;
+		ac->req << a;
+		return rpc_typed_args<R, Rest...>::call_async(c, proc, ac,
+				std::forward<Tail>(tail)...);
+	}
+};
 
-template<class R, class A1, class A2, class A3, class A4, class A5> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, R & r, TO to) 
+template<unsigned int P, class R, class... A, class... Args> int
+rpcc::call(rpc_proc<P, R, A...>, Args&&... args)
 {
+	static_assert(sizeof...(Args) == sizeof...(A) + 1 ||
+			sizeof...(Args) == sizeof...(A) + 2,
+			"wrong number of arguments for this RPC");
 	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	return call_m(proc, m, r, to);
+	return rpc_typed_args<R, A...>::call(this, P, m,
+			std::forward<Args>(args)...);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, R & r, TO to) 
+template<unsigned int P, class R, class... A, class... Args> std::future<int>
+rpcc::call_async(rpc_proc<P, R, A...>, Args&&... args)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
-	return call_m(proc, m, r, to);
+	static_assert(sizeof...(Args) == sizeof...(A) + 1 ||
+			sizeof...(Args) == sizeof...(A) + 2,
+			"wrong number of arguments for this RPC");
+	std::shared_ptr<async_call> a(new async_call(this));
+	return rpc_typed_args<R, A...>::call_async(this, P, a,
+			std::forward<Args>(args)...);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6, class A7> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, const A7 & a7,
-		R & r, TO to) 
+template<class R> std::future<int>
+rpcc::call_async_m(unsigned int proc, std::shared_ptr<async_call> a, R &r,
+		TO to)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
-	m << a7;
-	return call_m(proc, m, r, to);
+	// the request must not refer to the caller's arguments once
+	// call_async returns
+	a->req.flatten();
+	int ret = start_call(proc, a->req, a->cs, to);
+	if (ret < 0) {
+		std::promise<int> failed;
+		failed.set_value(ret);
+		return failed.get_future();
+	}
+	a->started = true;
+	return std::async(std::launch::deferred, [a, proc, &r]() {
+		int intret = a->c->finish_call(a->req, a->cs);
+		a->finished = true;
+		return take_reply(proc, intret, a->rep, r);
+	});
 }
 
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
@@ -275,20 +365,29 @@ class rpcs : public chanmgr {
 	private:
 
         // state about an in-progress or completed RPC, for at-most-once.
-        // if cb_present is true, then the RPC is complete and a reply
-        // has been sent; in that case buf points to a copy of the reply,
-        // and sz holds the size of the reply.
+        // state is INPROGRESS until the reply has been sent, then DONE
+        // with rep the reply, kept as it was marshalled so that large
+        // results are not copied again; FORGOTTEN once rep has been
+        // dropped to stay under the memory cap. xid 0 is a free slot.
 	struct reply_t {
-		reply_t (unsigned int _xid) {
-			xid = _xid;
-			cb_present = false;
-			buf = NULL;
-			sz = 0;
-		}
+		reply_t () : xid(0), state(NEW) {}
 		unsigned int xid;
-		bool cb_present; // whether the reply buffer is valid
-		char *buf;      // the reply buffer
-		int sz;         // the size of reply buffer
+		rpcstate_t state;
+		std::shared_ptr<marshall> rep;  // the reply
+	};
+
+	// one client's window: the requests with xids in (base, base +
+	// slots.size()], each in slot xid % slots.size(). the ring
+	// starts small and doubles up to RPC_REPLY_WINDOW slots; a
+	// request beyond that slides the window, forgetting the oldest.
+	struct window_t {
+		window_t() : base(0), bytes(0), inlru(false), used(0) {}
+		unsigned int base;	// highest xid_rep the client has told us
+		std::vector<reply_t> slots;
+		unsigned long long bytes;	// in the replies kept
+		bool inlru;
+		std::list<unsigned int>::iterator lru;
+		unsigned long long used;	// rpc_now_us() of the last request
 	};
 
 	int port_;
@@ -297,19 +396,34 @@ class rpcs : public chanmgr {
 	// provide at most once semantics by maintaining a window of replies
 	// per client that that client hasn't acknowledged receiving yet.
         // indexed by client nonce.
-	std::map<unsigned int, std::list<reply_t> > reply_window_;
+	std::map<unsigned int, window_t> reply_window_;
+	// clients with replies kept, least recently replied to first.
+	// when the replies of all clients pass reply_max_bytes_, those
+	// of the clients at the front are forgotten.
+	std::list<unsigned int> reply_lru_;
+	unsigned long long reply_bytes_;
+	unsigned long long reply_max_bytes_;
+	unsigned int reply_max_slots_;
+	unsigned long long reply_forgotten_;
+	unsigned long long reply_swept_;	// when idle windows were last dropped
 
 	void free_reply_window(void);
-	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+	void drop_idle_windows(unsigned long long now);
+	bool add_reply(unsigned int clt_nonce, unsigned int xid,
+			const std::shared_ptr<marshall> &rep);
 
 	rpcstate_t checkduplicate_and_update(unsigned int clt_nonce, 
 			unsigned int xid, unsigned int rep_xid,
-			char **b, int *sz);
+			std::shared_ptr<marshall> *rep);
+	void forget_upto(window_t &w, unsigned int xid);
+	void forget_replies(unsigned int clt_nonce, unsigned int keep);
 
 	void updatestat(unsigned int proc);
 
 	// latest connection to the client
 	std::map<unsigned int, connection *> conns_;
+	unsigned int conns_gc_;
+	void gc_conns();
 
 	// counting
 	const int counting_;
@@ -331,288 +445,95 @@ class rpcs : public chanmgr {
 	protected:
 
 	struct djob_t {
-		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c) {}
+		djob_t (connection *c, char *b, int bsz)
+			: buf(b),sz(bsz),conn(c),arrived(rpc_now_us()) {}
 		char *buf;
 		int sz;
 		connection *conn;
+		unsigned long long arrived;
 	};
 	void dispatch(djob_t *);
 
 	// internal handler registration
 	void reg1(unsigned int proc, handler *);
 
-	ThrPool* dispatchpool_;
+	WsPool* dispatchpool_;
 	tcpsconn* listener_;
 
+	rpc_stats stats_;
+	std::atomic<int> queued_; // requests waiting for dispatchpool_
+
 	public:
 	rpcs(unsigned int port, int counts=0);
 	~rpcs();
 
 	//RPC handler for clients binding
 	int rpcbind(int a, int &r);
+	//RPC handler for rpc/rpcstat
+	int rpcstats(int a, rpc_stats_reply &r);
 
 	void set_reachable(bool r) { reachable_ = r; }
 
 	bool got_pdu(connection *c, char *b, int sz);
 
-	// register a handler
-	template<class S, class A1, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, R & r));
-	template<class S, class A1, class A2, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, const A2, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, const A5, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class A7, class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, const A7,
-						R & r));
+	// register a handler: a method taking the arguments by value
+	// and the reply by reference
+	template<class S, class... P>
+		void reg(unsigned int proc, S*, int (S::*meth)(P...));
+	// register a handler that must match a descriptor
+	template<unsigned int N, class R, class... A, class S, class... P>
+		void reg(rpc_proc<N, R, A...>, S*, int (S::*meth)(P...));
 };
 
-template<class S, class A1, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				R r;
-				args >> a1;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				R r;
-				args >> a1;
-				args >> a2;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, R & r))
-				: sob(xsob), meth(xmeth)  { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+template <unsigned int...> struct rpc_indices {};
+template <unsigned int N, unsigned int... I> struct rpc_make_indices
+	: rpc_make_indices<N - 1, N - 1, I...> {};
+template <unsigned int... I> struct rpc_make_indices<0, I...> {
+	typedef rpc_indices<I...> type;
+};
 
-template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+// unmarshalls the arguments of S::*meth into a tuple whose last
+// element is the reply, calls meth, and marshalls the reply
+template<class S, class... P> class rpc_handler : public handler {
+	private:
+		typedef std::tuple<typename std::decay<P>::type...> values;
+		enum { nargs = sizeof...(P) - 1 };
+		S *sob;
+		int (S::*meth)(P...);
+
+		template<unsigned int... I>
+		int run(unmarshall &args, marshall &ret, values &v, rpc_indices<I...>) {
+			int unpacked[] = { 0, ((args >> std::get<I>(v)), 0)... };
+			(void) unpacked;
+			if(!args.okdone())
+				return rpc_const::unmarshal_args_failure;
+			int b = (sob->*meth)(std::move(std::get<I>(v))...,
+					std::get<nargs>(v));
+			marshall_move(ret, std::get<nargs>(v));
+			return b;
+		}
+	public:
+		rpc_handler(S *xsob, int (S::*xmeth)(P...))
+			: sob(xsob), meth(xmeth) { }
+		int fn(unmarshall &args, marshall &ret) {
+			values v;
+			return run(args, ret, v, typename rpc_make_indices<nargs>::type());
+		}
+};
 
-template<class S, class A1, class A2, class A3, class A4, class A5, class A6, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6, 
-			R & r))
+template<class S, class... P> void
+rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(P...))
 {
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
+	static_assert(sizeof...(P) > 0, "an RPC handler needs a reply argument");
+	reg1(proc, new rpc_handler<S, P...>(sob, meth));
 }
 
-template<class S, class A1, class A2, class A3, class A4, class A5, 
-	class A6, class A7, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6,
-			const A7 a7, R & r))
+template<unsigned int N, class R, class... A, class S, class... P> void
+rpcs::reg(rpc_proc<N, R, A...>, S *sob, int (S::*meth)(P...))
 {
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, const A7 a7, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6,
-						const A7 a7, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				A7 a7;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				args >> a7;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, a7, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
+	static_assert(std::is_same<void (*)(P...), void (*)(A..., R &)>::value,
+			"handler does not match the RPC's descriptor");
+	reg(N, sob, meth);
 }
 
 
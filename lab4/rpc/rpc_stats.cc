@@ -0,0 +1,268 @@
+#include <time.h>
+
+#include "rpc_stats.h"
+#include "slock.h"
+#include "gettime.h"
+#include "lang/verify.h"
+
+unsigned long long
+rpc_now_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (unsigned long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+unsigned int
+rpc_histdata::bucket(unsigned long long v)
+{
+	if (v < (1 << RPC_HIST_SUB))
+		return v;
+	int e = 63 - __builtin_clzll(v);
+	if (e >= RPC_HIST_MAXLOG)
+		return RPC_HIST_BUCKETS - 1;
+	return ((e - RPC_HIST_SUB + 1) << RPC_HIST_SUB) +
+		((v >> (e - RPC_HIST_SUB)) & ((1 << RPC_HIST_SUB) - 1));
+}
+
+unsigned long long
+rpc_histdata::bucket_max(unsigned int i)
+{
+	if (i < (1 << RPC_HIST_SUB))
+		return i;
+	int shift = (i >> RPC_HIST_SUB) - 1;
+	unsigned long long lo = (unsigned long long)((1 << RPC_HIST_SUB) +
+			(i & ((1 << RPC_HIST_SUB) - 1))) << shift;
+	return lo + (1ULL << shift) - 1;
+}
+
+unsigned long long
+rpc_histdata::percentile(double p) const
+{
+	if (count == 0)
+		return 0;
+	unsigned long long want = (unsigned long long)(p / 100 * count + 0.5);
+	if (want < 1)
+		want = 1;
+	unsigned long long seen = 0;
+	std::map<unsigned int, unsigned long long>::const_iterator i;
+	for (i = b.begin(); i != b.end(); i++) {
+		seen += i->second;
+		if (seen >= want)
+			break;
+	}
+	if (i == b.end())
+		return max;
+	unsigned long long v = bucket_max(i->first);
+	return v < max ? v : max;
+}
+
+void
+rpc_histdata::since(const rpc_histdata &prev)
+{
+	count -= prev.count;
+	sum -= prev.sum;
+	std::map<unsigned int, unsigned long long>::const_iterator i;
+	for (i = prev.b.begin(); i != prev.b.end(); i++) {
+		b[i->first] -= i->second;
+		if (b[i->first] == 0)
+			b.erase(i->first);
+	}
+}
+
+rpc_hist::rpc_hist() : count_(0), sum_(0), max_(0)
+{
+	for (int i = 0; i < RPC_HIST_BUCKETS; i++)
+		b_[i].store(0, std::memory_order_relaxed);
+}
+
+void
+rpc_hist::record(unsigned long long us)
+{
+	b_[rpc_histdata::bucket(us)].fetch_add(1, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(us, std::memory_order_relaxed);
+	unsigned long long m = max_.load(std::memory_order_relaxed);
+	while (us > m && !max_.compare_exchange_weak(m, us,
+				std::memory_order_relaxed))
+		;
+}
+
+// not an atomic snapshot: calls recorded meanwhile may show up in
+// some of the numbers only
+void
+rpc_hist::get(rpc_histdata *d)
+{
+	d->b.clear();
+	for (int i = 0; i < RPC_HIST_BUCKETS; i++) {
+		unsigned long long n = b_[i].load(std::memory_order_relaxed);
+		if (n)
+			d->b[i] = n;
+	}
+	d->count = count_.load(std::memory_order_relaxed);
+	d->sum = sum_.load(std::memory_order_relaxed);
+	d->max = max_.load(std::memory_order_relaxed);
+}
+
+void
+rpc_procstat::get(rpc_procdata *d)
+{
+	d->calls = calls.load(std::memory_order_relaxed);
+	d->dups = dups.load(std::memory_order_relaxed);
+	d->errors = errors.load(std::memory_order_relaxed);
+	d->bytes_in = bytes_in.load(std::memory_order_relaxed);
+	d->bytes_out = bytes_out.load(std::memory_order_relaxed);
+	d->inflight = inflight.load(std::memory_order_relaxed);
+	call.get(&d->call);
+	queue.get(&d->queue);
+	handler.get(&d->handler);
+	reply.get(&d->reply);
+}
+
+rpc_stats::rpc_stats()
+{
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	for (int i = 0; i < SLOTS; i++)
+		slots_[i].store(NULL, std::memory_order_relaxed);
+}
+
+rpc_stats::~rpc_stats()
+{
+	std::map<unsigned int, rpc_procstat *>::iterator i;
+	for (i = procs_.begin(); i != procs_.end(); i++)
+		delete i->second;
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+}
+
+unsigned int
+rpc_stats::slot(unsigned int proc)
+{
+	return (proc * 2654435761u) >> 24 & (SLOTS - 1);
+}
+
+rpc_procstat *
+rpc_stats::proc(unsigned int proc)
+{
+	unsigned int i = slot(proc);
+	for (int n = 0; n < SLOTS; n++, i = (i + 1) & (SLOTS - 1)) {
+		rpc_procstat *s = slots_[i].load(std::memory_order_acquire);
+		if (!s)
+			break;
+		if (s->proc == proc)
+			return s;
+	}
+
+	ScopedLock ml(&m_);
+	rpc_procstat *&s = procs_[proc];
+	if (s)
+		return s;	// created meanwhile, or the index is full
+	s = new rpc_procstat(proc);
+	i = slot(proc);
+	for (int n = 0; n < SLOTS; n++, i = (i + 1) & (SLOTS - 1)) {
+		if (!slots_[i].load(std::memory_order_relaxed)) {
+			slots_[i].store(s, std::memory_order_release);
+			break;
+		}
+	}
+	return s;
+}
+
+void
+rpc_stats::get(std::map<unsigned int, rpc_procdata> *m)
+{
+	ScopedLock ml(&m_);
+	m->clear();
+	std::map<unsigned int, rpc_procstat *>::iterator i;
+	for (i = procs_.begin(); i != procs_.end(); i++)
+		i->second->get(&(*m)[i->first]);
+}
+
+rpc_stats &
+rpc_client_stats()
+{
+	// never destroyed, so rpccs may still use it during exit
+	static rpc_stats *s = new rpc_stats;
+	return *s;
+}
+
+marshall &
+operator<<(marshall &m, const rpc_histdata &d)
+{
+	m << d.count;
+	m << d.sum;
+	m << d.max;
+	m << d.b;
+	return m;
+}
+
+unmarshall &
+operator>>(unmarshall &u, rpc_histdata &d)
+{
+	u >> d.count;
+	u >> d.sum;
+	u >> d.max;
+	u >> d.b;
+	return u;
+}
+
+marshall &
+operator<<(marshall &m, const rpc_procdata &d)
+{
+	m << d.calls;
+	m << d.dups;
+	m << d.errors;
+	m << d.bytes_in;
+	m << d.bytes_out;
+	m << d.inflight;
+	m << d.call;
+	m << d.queue;
+	m << d.handler;
+	m << d.reply;
+	return m;
+}
+
+unmarshall &
+operator>>(unmarshall &u, rpc_procdata &d)
+{
+	u >> d.calls;
+	u >> d.dups;
+	u >> d.errors;
+	u >> d.bytes_in;
+	u >> d.bytes_out;
+	u >> d.inflight;
+	u >> d.call;
+	u >> d.queue;
+	u >> d.handler;
+	u >> d.reply;
+	return u;
+}
+
+marshall &
+operator<<(marshall &m, const rpc_stats_reply &r)
+{
+	m << r.queued;
+	m << r.clients;
+	m << r.reply_bytes;
+	m << r.forgotten;
+	m << r.server;
+	m << r.client;
+	m << r.batch;
+	m << r.pdus_in;
+	m << r.reads;
+	return m;
+}
+
+unmarshall &
+operator>>(unmarshall &u, rpc_stats_reply &r)
+{
+	u >> r.queued;
+	u >> r.clients;
+	u >> r.reply_bytes;
+	u >> r.forgotten;
+	u >> r.server;
+	u >> r.client;
+	u >> r.batch;
+	u >> r.pdus_in;
+	u >> r.reads;
+	return u;
+}
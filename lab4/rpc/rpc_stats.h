@@ -0,0 +1,140 @@
+#ifndef rpc_stats_h
+#define rpc_stats_h
+
+// per-procedure RPC statistics: call and byte counters, an in-flight
+// gauge, and latency histograms.
+//
+// histograms are HDR-style: values (microseconds) below 8 get a bucket
+// each, and every power of two above that is split into 8 buckets, so
+// a bucket is within 12.5% of any value in it. recording is a few
+// relaxed atomic adds and takes no lock.
+//
+// rpcs keeps one rpc_stats for the requests it serves, rpcc one for
+// the calls it makes, and rpc_client_stats() adds up the calls of all
+// rpccs in the process. rpcs answers rpc_const::stats with both the
+// server's and the process's client statistics; rpc/rpcstat prints them.
+
+#include <pthread.h>
+#include <atomic>
+#include <map>
+
+#include "marshall.h"
+
+#define RPC_HIST_SUB 3		// log2 of buckets per power of two
+#define RPC_HIST_MAXLOG 36	// values from 2^36 us (19 hours) are clipped
+#define RPC_HIST_BUCKETS ((RPC_HIST_MAXLOG - RPC_HIST_SUB + 1) << RPC_HIST_SUB)
+
+unsigned long long rpc_now_us();
+
+// a copy of a histogram, as sent by the stats RPC: the non-empty
+// buckets, by index
+struct rpc_histdata {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	std::map<unsigned int, unsigned long long> b;
+
+	rpc_histdata() : count(0), sum(0), max(0) {}
+	// the highest value in the bucket that holds the p'th percentile
+	// (0 < p <= 100)
+	unsigned long long percentile(double p) const;
+	unsigned long long mean() const { return count ? sum / count : 0; }
+	// what was recorded since prev, a earlier copy of the same
+	// histogram; max stays the all-time max
+	void since(const rpc_histdata &prev);
+
+	static unsigned int bucket(unsigned long long v);
+	static unsigned long long bucket_max(unsigned int i);
+};
+
+class rpc_hist {
+	public:
+		rpc_hist();
+		void record(unsigned long long us);
+		void get(rpc_histdata *d);
+
+	private:
+		std::atomic<unsigned long long> b_[RPC_HIST_BUCKETS];
+		std::atomic<unsigned long long> count_;
+		std::atomic<unsigned long long> sum_;
+		std::atomic<unsigned long long> max_;
+};
+
+struct rpc_procdata {
+	unsigned long long calls;
+	unsigned long long dups;	// retransmissions answered from the reply window
+	unsigned long long errors;	// rpc_const failures
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	int inflight;
+	rpc_histdata call;	// from arrival (rpcs) or call (rpcc) to reply
+	rpc_histdata queue;	// rpcs: waiting for a dispatch thread
+	rpc_histdata handler;	// rpcs: running the handler
+	rpc_histdata reply;	// rpcs: sending the reply
+};
+
+struct rpc_procstat {
+	std::atomic<unsigned long long> calls;
+	std::atomic<unsigned long long> dups;
+	std::atomic<unsigned long long> errors;
+	std::atomic<unsigned long long> bytes_in;
+	std::atomic<unsigned long long> bytes_out;
+	std::atomic<int> inflight;
+	rpc_hist call;
+	rpc_hist queue;
+	rpc_hist handler;
+	rpc_hist reply;
+
+	const unsigned int proc;
+
+	rpc_procstat(unsigned int p) : calls(0), dups(0), errors(0),
+		bytes_in(0), bytes_out(0), inflight(0), proc(p) {}
+	void get(rpc_procdata *d);
+};
+
+class rpc_stats {
+	public:
+		rpc_stats();
+		~rpc_stats();
+		// the statistics of proc, created on first use; they live as
+		// long as this object. Only the first use takes a lock.
+		rpc_procstat *proc(unsigned int proc);
+		void get(std::map<unsigned int, rpc_procdata> *m);
+
+	private:
+		enum { SLOTS = 256 };	// power of two
+		pthread_mutex_t m_;
+		std::map<unsigned int, rpc_procstat *> procs_;
+		// open-addressed index of procs_, filled under m_ and
+		// read without it; a slot once set never changes
+		std::atomic<rpc_procstat *> slots_[SLOTS];
+		static unsigned int slot(unsigned int proc);
+};
+
+rpc_stats &rpc_client_stats();
+
+// reply of rpc_const::stats
+struct rpc_stats_reply {
+	int queued;	// requests waiting for a dispatch thread
+	int clients;	// with an at-most-once reply window
+	unsigned long long reply_bytes;	// in the replies kept for them
+	unsigned long long forgotten;	// replies dropped to stay under the cap
+	std::map<unsigned int, rpc_procdata> server;
+	std::map<unsigned int, rpc_procdata> client;
+	// of all the process's connections (see connection_stats())
+	rpc_histdata batch;	// pdus per write
+	unsigned long long pdus_in;
+	unsigned long long reads;
+
+	rpc_stats_reply() : queued(0), clients(0), reply_bytes(0),
+		forgotten(0), pdus_in(0), reads(0) {}
+};
+
+marshall &operator<<(marshall &m, const rpc_histdata &d);
+unmarshall &operator>>(unmarshall &u, rpc_histdata &d);
+marshall &operator<<(marshall &m, const rpc_procdata &d);
+unmarshall &operator>>(unmarshall &u, rpc_procdata &d);
+marshall &operator<<(marshall &m, const rpc_stats_reply &r);
+unmarshall &operator>>(unmarshall &u, rpc_stats_reply &r);
+
+#endif
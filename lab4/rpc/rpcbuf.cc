@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#include "rpcbuf.h"
+#include "slock.h"
+#include "lang/verify.h"
+
+#define RPCBUF_CLASSES (RPCBUF_MAX_SHIFT - RPCBUF_MIN_SHIFT + 1)
+
+// every buffer starts with one of these; the caller gets what follows.
+// it is padded so the caller's bytes stay as aligned as malloc's.
+struct bufhdr {
+	int cls;	// size class, or -1 if the buffer is not pooled
+	int capa;	// usable bytes
+	char pad[8];
+};
+
+static pthread_mutex_t depot_m = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<bufhdr *> depot[RPCBUF_CLASSES];
+
+static std::atomic<unsigned long long> nhits(0), nrefills(0), nmisses(0);
+
+namespace {
+	struct bufcache {
+		std::vector<bufhdr *> free[RPCBUF_CLASSES];
+		~bufcache();
+	};
+}
+
+static thread_local bufcache cache;
+
+// move l down to keep buffers, handing the rest to the depot
+static void
+spill(int cls, std::vector<bufhdr *> &l, unsigned keep)
+{
+	ScopedLock ml(&depot_m);
+	while (l.size() > keep) {
+		if (depot[cls].size() < RPCBUF_DEPOT)
+			depot[cls].push_back(l.back());
+		else
+			::free(l.back());
+		l.pop_back();
+	}
+}
+
+bufcache::~bufcache()
+{
+	for (int c = 0; c < RPCBUF_CLASSES; c++)
+		spill(c, free[c], 0);
+}
+
+static int
+size_class(int sz)
+{
+	int c = 0;
+	while (c < RPCBUF_CLASSES && (1 << (RPCBUF_MIN_SHIFT + c)) < sz)
+		c++;
+	return c < RPCBUF_CLASSES ? c : -1;
+}
+
+char *
+rpcbuf_alloc(int sz, int *capa)
+{
+	bufhdr *h;
+	int c = size_class(sz);
+	if (c < 0) {
+		h = (bufhdr *)malloc(sizeof(bufhdr) + sz);
+		VERIFY(h);
+		h->cls = -1;
+		h->capa = sz;
+		nmisses.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		std::vector<bufhdr *> &l = cache.free[c];
+		if (!l.empty()) {
+			nhits.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			ScopedLock ml(&depot_m);
+			while (!depot[c].empty() && l.size() < RPCBUF_CACHE / 2) {
+				l.push_back(depot[c].back());
+				depot[c].pop_back();
+			}
+			if (!l.empty())
+				nrefills.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (!l.empty()) {
+			h = l.back();
+			l.pop_back();
+		} else {
+			h = (bufhdr *)malloc(sizeof(bufhdr) + (1 << (RPCBUF_MIN_SHIFT + c)));
+			VERIFY(h);
+			h->cls = c;
+			h->capa = 1 << (RPCBUF_MIN_SHIFT + c);
+			nmisses.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	if (capa)
+		*capa = h->capa;
+	return (char *)(h + 1);
+}
+
+char *
+rpcbuf_realloc(char *b, int sz, int *capa)
+{
+	if (!b)
+		return rpcbuf_alloc(sz, capa);
+	bufhdr *h = (bufhdr *)b - 1;
+	if (sz <= h->capa) {
+		if (capa)
+			*capa = h->capa;
+		return b;
+	}
+	if (h->cls < 0 && size_class(sz) < 0) {
+		h = (bufhdr *)realloc(h, sizeof(bufhdr) + sz);
+		VERIFY(h);
+		h->capa = sz;
+		if (capa)
+			*capa = sz;
+		return (char *)(h + 1);
+	}
+	char *nb = rpcbuf_alloc(sz, capa);
+	memcpy(nb, b, h->capa);
+	rpcbuf_free(b);
+	return nb;
+}
+
+void
+rpcbuf_free(char *b)
+{
+	if (!b)
+		return;
+	bufhdr *h = (bufhdr *)b - 1;
+	if (h->cls < 0) {
+		::free(h);
+		return;
+	}
+	std::vector<bufhdr *> &l = cache.free[h->cls];
+	l.push_back(h);
+	if (l.size() > RPCBUF_CACHE)
+		spill(h->cls, l, RPCBUF_CACHE / 2);
+}
+
+void
+rpcbuf_getstats(rpcbuf_stats *s)
+{
+	s->hits = nhits.load(std::memory_order_relaxed);
+	s->refills = nrefills.load(std::memory_order_relaxed);
+	s->misses = nmisses.load(std::memory_order_relaxed);
+}
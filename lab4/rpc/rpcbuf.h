@@ -0,0 +1,33 @@
+#ifndef rpcbuf_h
+#define rpcbuf_h
+
+// Buffers for marshalled pdus. Sizes are rounded up to a power of two
+// between 1 << RPCBUF_MIN_SHIFT and 1 << RPCBUF_MAX_SHIFT, and freed
+// buffers of those sizes are kept in a small per-thread cache. A cache
+// that overflows spills into a shared depot and an empty one refills
+// from it, so buffers freed by dispatch threads are reused by the poll
+// loops that read the next pdus. Larger buffers come from malloc.
+//
+// marshall, unmarshall and connection allocate all pdus here; a buffer
+// handed over with take_buf() or to unmarshall(char *, int) must come
+// from and go back to rpcbuf.
+
+#define RPCBUF_MIN_SHIFT 10	// 1 KB, DEFAULT_RPC_SZ
+#define RPCBUF_MAX_SHIFT 17	// 128 KB
+#define RPCBUF_CACHE 16		// buffers per size a thread keeps
+#define RPCBUF_DEPOT 256	// buffers per size kept in the depot
+
+// *capa, if given, is set to the usable size, which may exceed sz
+char *rpcbuf_alloc(int sz, int *capa = 0);
+// like realloc(3); b may be NULL
+char *rpcbuf_realloc(char *b, int sz, int *capa = 0);
+void rpcbuf_free(char *b);
+
+struct rpcbuf_stats {
+	unsigned long long hits;	// from the calling thread's cache
+	unsigned long long refills;	// from the depot
+	unsigned long long misses;	// from malloc
+};
+void rpcbuf_getstats(rpcbuf_stats *s);
+
+#endif
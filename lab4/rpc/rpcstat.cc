@@ -0,0 +1,164 @@
+// print the RPC statistics of a running rpcs.
+// usage: rpcstat [-i seconds] [-n count] [host:]port
+//
+// first the requests waiting for dispatch and the at-most-once reply
+// windows: clients, bytes of replies kept, and replies forgotten to
+// stay under RPC_REPLY_BYTES. then, for each procedure the server has
+// seen, calls, duplicates, failures, bytes, calls in flight, and
+// latency percentiles (in microseconds) of the whole call, of waiting
+// for a dispatch thread, of the handler and of sending the reply; then
+// the same for the calls the server's process made as a client, if
+// any. procedures are sorted by 99th percentile call latency, slowest
+// first. last, how many pdus the process's connections wrote per
+// write (see RPC_COALESCE) and received per read.
+//
+// with -i, polls every so many seconds and prints what happened since
+// the previous poll; max is still the all-time max.
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "rpc.h"
+#include "jsl_log.h"
+
+typedef std::map<unsigned int, rpc_procdata> procmap;
+
+static void
+since(procmap &cur, const procmap &prev)
+{
+	procmap::iterator i;
+	for (i = cur.begin(); i != cur.end(); i++) {
+		procmap::const_iterator p = prev.find(i->first);
+		if (p == prev.end())
+			continue;
+		i->second.calls -= p->second.calls;
+		i->second.dups -= p->second.dups;
+		i->second.errors -= p->second.errors;
+		i->second.bytes_in -= p->second.bytes_in;
+		i->second.bytes_out -= p->second.bytes_out;
+		i->second.call.since(p->second.call);
+		i->second.queue.since(p->second.queue);
+		i->second.handler.since(p->second.handler);
+		i->second.reply.since(p->second.reply);
+	}
+}
+
+static void
+print_hist(const char *name, const rpc_histdata &d)
+{
+	printf("  %-8s %8llu %8llu %8llu %8llu %8llu\n", name,
+			d.percentile(50), d.percentile(99), d.percentile(99.9),
+			d.max, d.mean());
+}
+
+static bool
+slower(const procmap::value_type *a, const procmap::value_type *b)
+{
+	return a->second.call.percentile(99) > b->second.call.percentile(99);
+}
+
+static void
+print_procs(const char *title, const procmap &m, bool server)
+{
+	if (m.empty())
+		return;
+	std::vector<const procmap::value_type *> v;
+	for (procmap::const_iterator i = m.begin(); i != m.end(); i++)
+		v.push_back(&*i);
+	std::stable_sort(v.begin(), v.end(), slower);
+
+	printf("%s\n", title);
+	for (unsigned i = 0; i < v.size(); i++) {
+		const rpc_procdata &d = v[i]->second;
+		printf("%-8x calls %llu dups %llu errors %llu in %llu out %llu inflight %d\n",
+				v[i]->first, d.calls, d.dups, d.errors, d.bytes_in,
+				d.bytes_out, d.inflight);
+		printf("  %-8s %8s %8s %8s %8s %8s\n", "us", "p50", "p99",
+				"p99.9", "max", "mean");
+		print_hist("call", d.call);
+		if (server) {
+			print_hist("queue", d.queue);
+			print_hist("handler", d.handler);
+			print_hist("reply", d.reply);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int interval = 0;
+	int count = -1;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "i:n:")) != -1) {
+		switch (ch) {
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-i seconds] [-n count] [host:]port\n",
+						argv[0]);
+				exit(1);
+		}
+	}
+	if (optind != argc - 1 || interval < 0) {
+		fprintf(stderr, "usage: %s [-i seconds] [-n count] [host:]port\n",
+				argv[0]);
+		exit(1);
+	}
+	if (!interval)
+		count = 1;
+
+	jsl_set_debug(JSL_DBG_OFF);
+	sockaddr_in dst;
+	make_sockaddr(argv[optind], &dst);
+	rpcc cl(dst);
+	if (cl.bind() < 0) {
+		fprintf(stderr, "rpcstat: cannot bind to %s\n", argv[optind]);
+		exit(1);
+	}
+
+	rpc_stats_reply prev;
+	for (int n = 0; count < 0 || n < count; n++) {
+		if (n > 0)
+			sleep(interval);
+		rpc_stats_reply r;
+		int ret = cl.call(rpc_const::stats, 0, r);
+		if (ret != 0) {
+			fprintf(stderr, "rpcstat: stats RPC failed %d\n", ret);
+			exit(1);
+		}
+		rpc_stats_reply d = r;
+		if (n > 0) {
+			since(d.server, prev.server);
+			since(d.client, prev.client);
+			d.batch.since(prev.batch);
+			d.pdus_in -= prev.pdus_in;
+			d.reads -= prev.reads;
+			d.forgotten -= prev.forgotten;
+			printf("\n");
+		}
+		printf("%s: %d requests queued; %d clients, %llu bytes of replies kept, %llu forgotten\n",
+				argv[optind], d.queued, d.clients, d.reply_bytes,
+				d.forgotten);
+		print_procs("served:", d.server, true);
+		print_procs("called:", d.client, false);
+		printf("writes %llu pdus out %llu per write %.2f max %llu; "
+				"reads %llu pdus in %llu per read %.2f\n",
+				d.batch.count, d.batch.sum,
+				d.batch.count ? (double)d.batch.sum / d.batch.count : 0.0,
+				d.batch.max, d.reads, d.pdus_in,
+				d.reads ? (double)d.pdus_in / d.reads : 0.0);
+		fflush(stdout);
+		prev = r;
+	}
+	return 0;
+}
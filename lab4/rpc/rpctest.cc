@@ -0,0 +1,346 @@
+// RPC microbenchmarks and load generator.
+// usage: rpctest [-s | -c] [-t threads,...] [-n calls] [-k clients]
+//                [-l loss] [host:]port
+//
+// with neither -s nor -c, runs an rpcs on port and the clients in the
+// same process. -s only serves (until killed), and -c only runs the
+// clients, against a rpctest -s on host:port.
+//
+// the tests, in order:
+//   null     one thread, -n calls of a procedure that does nothing:
+//            round-trip latency.
+//   threads  for each count in -t (default 1,2,4,8,16,32), that many
+//            threads making null calls through -k rpccs (default 1,
+//            so they share a connection): throughput.
+//   put/get  one thread sending, then receiving, payloads of 64 bytes
+//            to 1MB in steps of 4x: latency and bandwidth.
+//   mixed    one thread making null calls while another fetches 1MB
+//            after 1MB through the same rpcc: how much bulk transfers
+//            hold up small calls (compare RPC_CONNS=1 and 2).
+//   lossy    with -l, null and 4KB put calls again with RPC_LOSSY set
+//            to loss, checking every reply. in-process this runs a
+//            second lossy rpcs on port+1; with -c only the client's
+//            side loses, so start the server with RPC_LOSSY as well.
+//
+// each result is printed as one line of JSON, with latencies in
+// microseconds.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "rpc.h"
+#include "jsl_log.h"
+#include "lang/verify.h"
+
+class rpctest_protocol {
+	public:
+		enum rpc_numbers {
+			null = 0x7001,
+			put,
+			get,
+		};
+};
+
+class rpctest_rpc {
+	public:
+		typedef rpctest_protocol P;
+		typedef rpc_proc<P::null, int, int> null;
+		typedef rpc_proc<P::put, unsigned int, strview> put;
+		typedef rpc_proc<P::get, std::string, unsigned int> get;
+};
+
+class srv {
+	public:
+		int null(int a, int &r) { r = a; return 0; }
+		int put(strview s, unsigned int &r) { r = s.size; return 0; }
+		int get(unsigned int n, std::string &r) {
+			r.assign(n, 'g');
+			return 0;
+		}
+};
+
+static srv service;
+static sockaddr_in dst;
+static int ncalls = 10000;
+static int nclients = 1;
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static rpcs *
+start_server(int port)
+{
+	rpcs *s = new rpcs(port);
+	s->reg(rpctest_rpc::null(), &service, &srv::null);
+	s->reg(rpctest_rpc::put(), &service, &srv::put);
+	s->reg(rpctest_rpc::get(), &service, &srv::get);
+	return s;
+}
+
+static rpcc *
+client()
+{
+	rpcc *c = new rpcc(dst);
+	if (c->bind() < 0) {
+		fprintf(stderr, "rpctest: cannot bind to port %d\n",
+				ntohs(dst.sin_port));
+		exit(1);
+	}
+	return c;
+}
+
+// what one test run measured
+struct result {
+	rpc_hist lat;
+	std::atomic<unsigned long long> failures;
+	double secs;
+	result() : failures(0), secs(0) {}
+};
+
+static void
+report(const char *test, int threads, unsigned int size, result &r)
+{
+	rpc_histdata d;
+	r.lat.get(&d);
+	printf("{\"test\": \"%s\", \"threads\": %d, \"clients\": %d, "
+			"\"size\": %u, \"calls\": %llu, \"failures\": %llu, "
+			"\"secs\": %.3f, \"calls_per_sec\": %.0f, \"mb_per_sec\": %.2f, "
+			"\"p50_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, "
+			"\"max_us\": %llu, \"mean_us\": %llu}\n",
+			test, threads, nclients, size, d.count, r.failures.load(), r.secs,
+			r.secs > 0 ? d.count / r.secs : 0.0,
+			r.secs > 0 ? d.count * (double)size / r.secs / (1 << 20) : 0.0,
+			d.percentile(50), d.percentile(99), d.percentile(99.9),
+			d.max, d.mean());
+	fflush(stdout);
+}
+
+enum op { NULLCALL, PUT, GET };
+
+struct worker_arg {
+	rpcc *c;
+	op o;
+	int n;
+	unsigned int size;
+	const std::string *payload;
+	result *r;
+	std::atomic<bool> *stop;	// if not NULL, run until it is set
+};
+
+static void *
+worker(void *xa)
+{
+	worker_arg *a = (worker_arg *)xa;
+	for (int i = 0; a->stop ? !a->stop->load() : i < a->n; i++) {
+		unsigned long long start = rpc_now_us();
+		int ret;
+		bool ok;
+		if (a->o == NULLCALL) {
+			int r = -1;
+			ret = a->c->call(rpctest_rpc::null(), i, r);
+			ok = r == i;
+		} else if (a->o == PUT) {
+			unsigned int r = 0;
+			ret = a->c->call(rpctest_rpc::put(), *a->payload, r);
+			ok = r == a->size;
+		} else {
+			std::string r;
+			ret = a->c->call(rpctest_rpc::get(), a->size, r);
+			ok = r.size() == a->size;
+		}
+		a->r->lat.record(rpc_now_us() - start);
+		if (ret != 0 || !ok)
+			a->r->failures++;
+	}
+	return 0;
+}
+
+// n calls in all, spread over threads and the rpccs in cl; reported
+// as test unless that is NULL
+static void
+run(const char *test, std::vector<rpcc *> &cl, int threads, op o,
+		unsigned int size, int n)
+{
+	std::string payload(o == PUT ? size : 0, 'p');
+	result r;
+	std::vector<worker_arg> a(threads);
+	std::vector<pthread_t> th(threads);
+
+	double start = now();
+	for (int i = 0; i < threads; i++) {
+		a[i].c = cl[i % cl.size()];
+		a[i].o = o;
+		a[i].n = n / threads + (i < n % threads ? 1 : 0);
+		a[i].size = size;
+		a[i].payload = &payload;
+		a[i].r = &r;
+		a[i].stop = NULL;
+		VERIFY(pthread_create(&th[i], NULL, worker, (void *)&a[i]) == 0);
+	}
+	for (int i = 0; i < threads; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	r.secs = now() - start;
+	if (test)
+		report(test, threads, size, r);
+}
+
+static void
+run_tests(const std::vector<int> &threads)
+{
+	std::vector<rpcc *> cl;
+	for (int i = 0; i < nclients; i++)
+		cl.push_back(client());
+
+	// warm up the connections and buffer caches
+	run(NULL, cl, 1, NULLCALL, 0, ncalls / 10 + 1);
+
+	run("null", cl, 1, NULLCALL, 0, ncalls);
+	for (unsigned i = 0; i < threads.size(); i++)
+		run("threads", cl, threads[i], NULLCALL, 0, ncalls);
+	for (unsigned int sz = 64; sz <= (1 << 20); sz *= 4) {
+		// about 64MB per size, but at least 20 calls
+		int n = ncalls;
+		if ((long)n * sz > (64 << 20))
+			n = (64 << 20) / sz > 20 ? (64 << 20) / sz : 20;
+		run("put", cl, 1, PUT, sz, n);
+		run("get", cl, 1, GET, sz, n);
+	}
+
+	std::atomic<bool> stop(false);
+	std::string none;
+	result bulk;
+	worker_arg b;
+	b.c = cl[0];
+	b.o = GET;
+	b.n = 0;
+	b.size = 1 << 20;
+	b.payload = &none;
+	b.r = &bulk;
+	b.stop = &stop;
+	pthread_t th;
+	VERIFY(pthread_create(&th, NULL, worker, (void *)&b) == 0);
+	run("mixed", cl, 1, NULLCALL, 0, ncalls);
+	stop = true;
+	VERIFY(pthread_join(th, NULL) == 0);
+
+	for (unsigned i = 0; i < cl.size(); i++)
+		delete cl[i];
+}
+
+static void
+run_lossy(const char *loss)
+{
+	std::vector<rpcc *> cl;
+	// rpcc and rpcs read RPC_LOSSY when they are made
+	setenv("RPC_LOSSY", loss, 1);
+	for (int i = 0; i < nclients; i++)
+		cl.push_back(client());
+	unsetenv("RPC_LOSSY");
+
+	// a lost request or reply costs a retransmission timeout
+	int n = ncalls / 100 > 50 ? ncalls / 100 : 50;
+	run("lossy_null", cl, 1, NULLCALL, 0, n);
+	run("lossy_put", cl, 1, PUT, 4096, n);
+
+	for (unsigned i = 0; i < cl.size(); i++)
+		delete cl[i];
+}
+
+static void
+usage(const char *me)
+{
+	fprintf(stderr, "usage: %s [-s | -c] [-t threads,...] [-n calls] "
+			"[-k clients] [-l loss] [host:]port\n", me);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	bool serve = false, call = false;
+	const char *loss = NULL;
+	std::vector<int> threads;
+	int ch;
+
+	jsl_set_debug(JSL_DBG_OFF);
+
+	while ((ch = getopt(argc, argv, "sct:n:k:l:")) != -1) {
+		switch (ch) {
+			case 's':
+				serve = true;
+				break;
+			case 'c':
+				call = true;
+				break;
+			case 't':
+				for (char *p = optarg; *p; ) {
+					char *e;
+					long t = strtol(p, &e, 10);
+					if (e == p || t <= 0)
+						usage(argv[0]);
+					threads.push_back(t);
+					p = *e == ',' ? e + 1 : e;
+				}
+				break;
+			case 'n':
+				ncalls = atoi(optarg);
+				break;
+			case 'k':
+				nclients = atoi(optarg);
+				break;
+			case 'l':
+				loss = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || (serve && call) || ncalls <= 0 ||
+			nclients <= 0)
+		usage(argv[0]);
+	if (threads.empty()) {
+		for (int t = 1; t <= 32; t *= 2)
+			threads.push_back(t);
+	}
+
+	make_sockaddr(argv[optind], &dst);
+	int port = ntohs(dst.sin_port);
+
+	if (serve) {
+		start_server(port);
+		while (1)
+			sleep(1000);
+	}
+
+	rpcs *s = NULL, *ls = NULL;
+	if (!call)
+		s = start_server(port);
+
+	run_tests(threads);
+
+	if (loss) {
+		if (!call) {
+			setenv("RPC_LOSSY", loss, 1);
+			ls = start_server(port + 1);
+			unsetenv("RPC_LOSSY");
+			dst.sin_port = htons(port + 1);
+		}
+		run_lossy(loss);
+	}
+
+	delete ls;
+	delete s;
+	return 0;
+}
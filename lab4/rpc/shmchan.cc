@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "shmchan.h"
+#include "jsl_log.h"
+#include "lang/verify.h"
+
+#ifdef __linux__
+
+shmchan *
+shmchan::create(int fds[3])
+{
+	size_t sz = 2 * sizeof(ring);
+	int mfd = memfd_create("rpc-shmchan", MFD_CLOEXEC);
+	if (mfd < 0) {
+		jsl_log(JSL_DBG_1, "shmchan::create memfd_create errno %d\n", errno);
+		return NULL;
+	}
+	void *base;
+	if (ftruncate(mfd, sz) < 0 || (base = mmap(NULL, sz,
+					PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0)) == MAP_FAILED) {
+		jsl_log(JSL_DBG_1, "shmchan::create cannot map %lu bytes errno %d\n",
+				(unsigned long)sz, errno);
+		close(mfd);
+		return NULL;
+	}
+
+	shmchan *c = new shmchan;
+	c->base_ = base;
+	c->tx_ = (ring *)base;
+	c->rx_ = (ring *)base + 1;
+	for (int i = 0; i < 2; i++) {
+		ring *r = (ring *)base + i;
+		r->head.store(0);
+		r->tail.store(0);
+		// nobody has looked yet, so the first bytes ring the doorbell
+		r->reader_waits.store(1);
+		r->writer_waits.store(0);
+	}
+	c->in_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	c->out_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (c->in_ < 0 || c->out_ < 0) {
+		jsl_log(JSL_DBG_1, "shmchan::create eventfd errno %d\n", errno);
+		close(mfd);
+		delete c;
+		return NULL;
+	}
+	fds[0] = mfd;
+	fds[1] = c->in_;
+	fds[2] = c->out_;
+	return c;
+}
+
+shmchan *
+shmchan::attach(int fds[3])
+{
+	size_t sz = 2 * sizeof(ring);
+	struct stat st;
+	void *base = MAP_FAILED;
+	if (fstat(fds[0], &st) == 0 && (size_t)st.st_size == sz)
+		base = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	shmchan *c = new shmchan;
+	// the client's rings, the other way round
+	c->in_ = fds[2];
+	c->out_ = fds[1];
+	if (base == MAP_FAILED) {
+		jsl_log(JSL_DBG_1, "shmchan::attach bad region errno %d\n", errno);
+		delete c;
+		return NULL;
+	}
+	c->base_ = base;
+	c->tx_ = (ring *)base + 1;
+	c->rx_ = (ring *)base;
+	return c;
+}
+
+#else
+
+shmchan *
+shmchan::create(int fds[3])
+{
+	jsl_log(JSL_DBG_1, "shmchan::create not supported\n");
+	return NULL;
+}
+
+shmchan *
+shmchan::attach(int fds[3])
+{
+	for (int i = 0; i < 3; i++)
+		close(fds[i]);
+	return NULL;
+}
+
+#endif
+
+shmchan::~shmchan()
+{
+	if (base_)
+		VERIFY(munmap(base_, 2 * sizeof(ring)) == 0);
+	if (in_ >= 0)
+		close(in_);
+	if (out_ >= 0)
+		close(out_);
+}
+
+void
+shmchan::ring_peer()
+{
+	uint64_t one = 1;
+	// a full counter is still readable, so EAGAIN is fine
+	if (::write(out_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		jsl_log(JSL_DBG_1, "shmchan::ring_peer errno %d\n", errno);
+}
+
+void
+shmchan::drain()
+{
+	uint64_t v;
+	while (::read(in_, &v, sizeof(v)) < 0 && errno == EINTR)
+		;
+}
+
+int
+shmchan::read(char *b, int n)
+{
+	unsigned int h = rx_->head.load(std::memory_order_relaxed);
+	unsigned int t = rx_->tail.load(std::memory_order_acquire);
+	if (t == h) {
+		// tell the writer to ring, then look again in case it wrote
+		// before it could see the flag
+		rx_->reader_waits.store(1);
+		t = rx_->tail.load();
+		if (t == h) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	if (t - h > SHM_RING) {
+		errno = EIO;
+		return -1;
+	}
+
+	int len = t - h < (unsigned int)n ? t - h : n;
+	unsigned int off = h & (SHM_RING - 1);
+	int first = SHM_RING - off < (unsigned int)len ? SHM_RING - off : len;
+	memcpy(b, rx_->data + off, first);
+	memcpy(b + first, rx_->data, len - first);
+	rx_->head.store(h + len);
+
+	if (rx_->writer_waits.load() && rx_->writer_waits.exchange(0))
+		ring_peer();
+	return len;
+}
+
+int
+shmchan::writev(const struct iovec *v, int n)
+{
+	unsigned int total = 0;
+	for (int i = 0; i < n; i++)
+		total += v[i].iov_len;
+	unsigned int need = total < 4 ? total : 4;
+
+	unsigned int t = tx_->tail.load(std::memory_order_relaxed);
+	unsigned int h = tx_->head.load(std::memory_order_acquire);
+	if (t - h > SHM_RING) {
+		errno = EIO;
+		return -1;
+	}
+	if (SHM_RING - (t - h) < need) {
+		tx_->writer_waits.store(1);
+		h = tx_->head.load();
+		if (SHM_RING - (t - h) < need) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	unsigned int room = SHM_RING - (t - h);
+	unsigned int len = total < room ? total : room;
+	unsigned int done = 0;
+	for (int i = 0; i < n && done < len; i++) {
+		const char *p = (const char *)v[i].iov_base;
+		unsigned int m = v[i].iov_len < len - done ? v[i].iov_len : len - done;
+		while (m > 0) {
+			unsigned int off = (t + done) & (SHM_RING - 1);
+			unsigned int k = SHM_RING - off < m ? SHM_RING - off : m;
+			memcpy(tx_->data + off, p, k);
+			p += k;
+			m -= k;
+			done += k;
+		}
+	}
+	tx_->tail.store(t + len);
+
+	if (tx_->reader_waits.load() && tx_->reader_waits.exchange(0))
+		ring_peer();
+	return len;
+}
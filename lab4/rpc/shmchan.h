@@ -0,0 +1,68 @@
+#ifndef shmchan_h
+#define shmchan_h
+
+// a byte stream between two processes on the same host made of two
+// rings in a shared memory region, one per direction, so sending a pdu
+// is a copy into the ring instead of a trip through the TCP stack.
+//
+// each side has an eventfd, its doorbell, that the other side rings
+// when it adds bytes while this side is waiting for some, or frees room
+// while this side is waiting for it. the doorbell is only rung when the
+// flag saying so is set; a busy stream runs without system calls.
+//
+// the client makes the region and both doorbells and hands them to the
+// server over a Unix domain socket (see connect_to_dst() and tcpsconn),
+// which is kept open: the ring never reports end of file, so a closed
+// socket is how each side learns that the other has gone away.
+
+#include <sys/uio.h>
+#include <atomic>
+
+#define SHM_RING (256<<10)	// bytes in each direction, a power of two
+
+class shmchan {
+	public:
+		// make a new region and doorbells; fds gets the three
+		// descriptors to send to the server: the region, which the
+		// caller closes once sent, and the client's and the server's
+		// doorbells, which stay the shmchan's. NULL on failure.
+		static shmchan *create(int fds[3]);
+		// map the region and doorbells received from a client, taking
+		// over the descriptors. NULL on failure.
+		static shmchan *attach(int fds[3]);
+		~shmchan();
+
+		// like read(2) and writev(2) on a non-blocking socket:
+		// return -1 with errno EAGAIN if nothing can be done now,
+		// and never 0. writev() moves nothing until min(the total,
+		// 4) bytes fit, so a pdu's size is never split.
+		int read(char *b, int n);
+		int writev(const struct iovec *v, int n);
+
+		// the descriptor that becomes readable when the doorbell rings
+		int doorbell() { return in_; }
+		// reset the doorbell; call before read() and writev()
+		void drain();
+
+	private:
+		struct ring {
+			std::atomic<unsigned int> head;	// next byte to read
+			std::atomic<int> reader_waits;	// ring in_ of the reader
+			char pad0[56];
+			std::atomic<unsigned int> tail;	// next byte to write
+			std::atomic<int> writer_waits;	// ring in_ of the writer
+			char pad1[56];
+			char data[SHM_RING];
+		};
+
+		shmchan() : base_(0), tx_(0), rx_(0), in_(-1), out_(-1) {}
+		void ring_peer();
+
+		void *base_;
+		ring *tx_;
+		ring *rx_;
+		int in_;	// our doorbell
+		int out_;	// the peer's
+};
+
+#endif
@@ -4,7 +4,7 @@
 #include <pthread.h>
 #include <vector>
 
-#include "fifo.h"
+#include "lfifo.h"
 
 class ThrPool {
 
@@ -28,7 +28,7 @@ class ThrPool {
 		bool blockadd_;
 
 
-		fifo<job_t> jobq_;
+		lfifo<job_t> jobq_;
 		std::vector<pthread_t> th_;
 
 		bool addJob(void *(*f)(void *), void *a);
@@ -0,0 +1,251 @@
+#include <sched.h>
+#include <stdio.h>
+
+#include "wspool.h"
+#include "slock.h"
+#include "jsl_log.h"
+
+// the worker, if any, that the calling thread is
+static thread_local void *self;
+
+WsPool::WsPool(int nworkers, bool blocking, const std::vector<int> &cpus)
+	: blocking_(blocking), max_(100 * nworkers), pending_(0), idle_(0),
+	stop_(false), room_waiters_(0)
+{
+	VERIFY(nworkers > 0);
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	VERIFY(pthread_cond_init(&work_c_, 0) == 0);
+	VERIFY(pthread_cond_init(&room_c_, 0) == 0);
+
+	for (int i = 0; i < nworkers; i++) {
+		worker *w = new worker;
+		w->pool = this;
+		w->idx = i;
+		w->cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+		w->top.store(0);
+		w->bottom.store(0);
+		VERIFY(pthread_mutex_init(&w->inbox_m, 0) == 0);
+		w->inbox_head = 0;
+		w->inbox_n.store(0);
+		workers_.push_back(w);
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 128<<10);
+	for (int i = 0; i < nworkers; i++)
+		VERIFY(pthread_create(&workers_[i]->th, &attr, worker_main,
+					(void *)workers_[i]) == 0);
+	VERIFY(pthread_attr_destroy(&attr) == 0);
+}
+
+//IMPORTANT: this function can be called only when no external thread
+//will ever add to this pool again or is currently blocking on it
+WsPool::~WsPool()
+{
+	{
+		ScopedLock ml(&m_);
+		stop_ = true;
+		VERIFY(pthread_cond_broadcast(&work_c_) == 0);
+	}
+	for (unsigned i = 0; i < workers_.size(); i++)
+		VERIFY(pthread_join(workers_[i]->th, NULL) == 0);
+	for (unsigned i = 0; i < workers_.size(); i++) {
+		VERIFY(pthread_mutex_destroy(&workers_[i]->inbox_m) == 0);
+		delete workers_[i];
+	}
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+	VERIFY(pthread_cond_destroy(&work_c_) == 0);
+	VERIFY(pthread_cond_destroy(&room_c_) == 0);
+}
+
+bool
+WsPool::add(const job &j)
+{
+	// reserve room first, so that the inboxes can never be full:
+	// they hold more than max_ between them
+	while (pending_.fetch_add(1) >= max_) {
+		pending_.fetch_sub(1);
+		if (!blocking_)
+			return false;
+		ScopedLock ml(&m_);
+		room_waiters_++;
+		while (pending_.load() >= max_)
+			VERIFY(pthread_cond_wait(&room_c_, &m_) == 0);
+		room_waiters_--;
+	}
+
+	worker *w = (worker *)self;
+	if (!w || w->pool != this || !push(w, j)) {
+		static thread_local unsigned int next;
+		bool placed = false;
+		for (unsigned i = 0; !placed && i < workers_.size(); i++) {
+			worker *v = workers_[next++ % workers_.size()];
+			ScopedLock il(&v->inbox_m);
+			int n = v->inbox_n.load(std::memory_order_relaxed);
+			if (n < WSPOOL_INBOX) {
+				v->inbox[(v->inbox_head + n) % WSPOOL_INBOX] = j;
+				v->inbox_n.store(n + 1, std::memory_order_release);
+				placed = true;
+			}
+		}
+		VERIFY(placed);
+	}
+
+	if (idle_.load() > 0) {
+		ScopedLock ml(&m_);
+		VERIFY(pthread_cond_signal(&work_c_) == 0);
+	}
+	return true;
+}
+
+// Chase-Lev: only the owner pushes and takes at the bottom; thieves
+// take from the top, and the owner races them with a CAS for the
+// last job.
+bool
+WsPool::push(worker *w, const job &j)
+{
+	long b = w->bottom.load(std::memory_order_relaxed);
+	long t = w->top.load(std::memory_order_acquire);
+	if (b - t >= WSPOOL_DEQUE)
+		return false;
+	slot &s = w->deque[b & (WSPOOL_DEQUE - 1)];
+	for (int i = 0; i < WSPOOL_WORDS; i++)
+		s.w[i].store(j.w[i], std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	w->bottom.store(b + 1, std::memory_order_relaxed);
+	return true;
+}
+
+bool
+WsPool::take(worker *w, job *j)
+{
+	long b = w->bottom.load(std::memory_order_relaxed) - 1;
+	w->bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long t = w->top.load(std::memory_order_relaxed);
+	if (t > b) {
+		w->bottom.store(b + 1, std::memory_order_relaxed);
+		return false;
+	}
+	slot &s = w->deque[b & (WSPOOL_DEQUE - 1)];
+	for (int i = 0; i < WSPOOL_WORDS; i++)
+		j->w[i] = s.w[i].load(std::memory_order_relaxed);
+	if (t < b)
+		return true;
+	bool won = w->top.compare_exchange_strong(t, t + 1,
+			std::memory_order_seq_cst, std::memory_order_relaxed);
+	w->bottom.store(b + 1, std::memory_order_relaxed);
+	return won;
+}
+
+bool
+WsPool::steal(worker *v, job *j)
+{
+	long t = v->top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long b = v->bottom.load(std::memory_order_acquire);
+	if (t >= b)
+		return false;
+	slot &s = v->deque[t & (WSPOOL_DEQUE - 1)];
+	for (int i = 0; i < WSPOOL_WORDS; i++)
+		j->w[i] = s.w[i].load(std::memory_order_relaxed);
+	return v->top.compare_exchange_strong(t, t + 1,
+			std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+// take the oldest job in v's inbox. when v is the caller, the rest of
+// the inbox moves into its deque, where other workers can steal it.
+bool
+WsPool::from_inbox(worker *v, job *j, bool all)
+{
+	if (v->inbox_n.load(std::memory_order_acquire) == 0)
+		return false;
+	if (all)
+		VERIFY(pthread_mutex_lock(&v->inbox_m) == 0);
+	else if (pthread_mutex_trylock(&v->inbox_m) != 0)
+		return false;
+
+	int n = v->inbox_n.load(std::memory_order_relaxed);
+	bool got = n > 0;
+	if (got) {
+		*j = v->inbox[v->inbox_head];
+		v->inbox_head = (v->inbox_head + 1) % WSPOOL_INBOX;
+		n--;
+		while (all && n > 0 && push(v, v->inbox[v->inbox_head])) {
+			v->inbox_head = (v->inbox_head + 1) % WSPOOL_INBOX;
+			n--;
+		}
+		v->inbox_n.store(n, std::memory_order_relaxed);
+	}
+	VERIFY(pthread_mutex_unlock(&v->inbox_m) == 0);
+	return got;
+}
+
+bool
+WsPool::find(worker *w, job *j)
+{
+	if (take(w, j) || from_inbox(w, j, true))
+		return true;
+	for (unsigned i = 1; i < workers_.size(); i++) {
+		worker *v = workers_[(w->idx + i) % workers_.size()];
+		if (steal(v, j) || from_inbox(v, j, false))
+			return true;
+	}
+	return false;
+}
+
+void
+WsPool::loop(worker *w)
+{
+	job j;
+	while (1) {
+		if (find(w, &j)) {
+			pending_.fetch_sub(1);
+			if (room_waiters_ > 0) {
+				ScopedLock ml(&m_);
+				VERIFY(pthread_cond_broadcast(&room_c_) == 0);
+			}
+			void (*run)(void *);
+			memcpy(&run, &j.w[0], sizeof(run));
+			run(&j);
+			continue;
+		}
+
+		// count ourselves idle before the last look at pending_: add
+		// bumps pending_ before it looks at idle_, so at least one of
+		// us sees the other, and its signal needs m_, which we hold
+		// until we wait.
+		ScopedLock ml(&m_);
+		idle_++;
+		if (pending_.load() > 0) {
+			idle_--;
+			continue; // added but not yet visible; look again
+		}
+		if (stop_) {
+			idle_--;
+			break;
+		}
+		VERIFY(pthread_cond_wait(&work_c_, &m_) == 0);
+		idle_--;
+	}
+}
+
+void *
+WsPool::worker_main(void *arg)
+{
+	worker *w = (worker *)arg;
+	self = w;
+#ifdef __linux__
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			jsl_log(JSL_DBG_1, "WsPool: cannot pin worker %d to cpu %d\n",
+					w->idx, w->cpu);
+	}
+#endif
+	w->pool->loop(w);
+	return NULL;
+}
@@ -0,0 +1,116 @@
+#ifndef wspool_h
+#define wspool_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <type_traits>
+#include <vector>
+#include <string.h>
+
+#include "lang/verify.h"
+
+// A thread pool in which every worker owns a Chase-Lev deque. Jobs
+// added by a worker go to the bottom of its own deque; jobs added by
+// other threads (the PollMgr loops, for rpcs) go to one of the
+// workers' inboxes, spread round-robin. A worker runs jobs from its
+// own deque, then moves its inbox into it, then steals from the top of
+// the other deques and inboxes, and sleeps only when all are empty.
+//
+// Jobs are stored inline in the deques: addObjJob() copies the object,
+// method and argument into the slot, so nothing is allocated per job.
+// The argument has to be trivially copyable and small.
+
+#define WSPOOL_DEQUE 1024	// jobs per worker deque, a power of two
+#define WSPOOL_INBOX 256	// jobs per worker inbox
+#define WSPOOL_WORDS 6		// words of inline job storage
+
+class WsPool {
+	public:
+		// nworkers threads; cpus, if given, pins worker i to
+		// cpus[i % cpus.size()]. if blocking, addObjJob() waits for
+		// room instead of returning false when the pool is full.
+		WsPool(int nworkers, bool blocking = true,
+				const std::vector<int> &cpus = std::vector<int>());
+		// runs the jobs already added, then stops the workers
+		~WsPool();
+
+		template<class C, class A> bool addObjJob(C *o, void (C::*m)(A), A a);
+
+		int workers() { return workers_.size(); }
+
+	private:
+		struct job {
+			uint64_t w[WSPOOL_WORDS];	// w[0] runs the job on the rest
+		};
+		// slots are read by thieves while the owner may reuse them, so
+		// they are copied a word at a time
+		struct slot {
+			std::atomic<uint64_t> w[WSPOOL_WORDS];
+		};
+		struct worker {
+			WsPool *pool;
+			int idx;
+			int cpu;
+			pthread_t th;
+			std::atomic<long> top;
+			std::atomic<long> bottom;
+			slot deque[WSPOOL_DEQUE];
+
+			pthread_mutex_t inbox_m;
+			job inbox[WSPOOL_INBOX];
+			int inbox_head;
+			std::atomic<int> inbox_n;
+		};
+
+		template<class C, class A> struct objjob {
+			void (*run)(void *);
+			C *o;
+			void (C::*m)(A);
+			A a;
+			static void go(void *p) {
+				objjob *j = (objjob *)p;
+				((j->o)->*(j->m))(j->a);
+			}
+		};
+
+		bool add(const job &j);
+		bool push(worker *w, const job &j);
+		bool take(worker *w, job *j);
+		bool steal(worker *w, job *j);
+		bool from_inbox(worker *w, job *j, bool all);
+		bool find(worker *w, job *j);
+		void loop(worker *w);
+		static void *worker_main(void *);
+
+		std::vector<worker *> workers_;
+		bool blocking_;
+		int max_;			// jobs queued before add refuses or blocks
+		std::atomic<int> pending_;	// jobs added and not yet taken
+		std::atomic<int> idle_;		// workers asleep or about to be
+		bool stop_;
+
+		pthread_mutex_t m_;
+		pthread_cond_t work_c_;
+		pthread_cond_t room_c_;
+		std::atomic<int> room_waiters_;	// adders blocked for room
+};
+
+template<class C, class A> bool
+WsPool::addObjJob(C *o, void (C::*m)(A), A a)
+{
+	static_assert(sizeof(objjob<C, A>) <= sizeof(job) &&
+			std::is_trivially_copyable<A>::value,
+			"WsPool jobs are stored inline and must be small and copyable");
+	objjob<C, A> x;
+	x.run = &objjob<C, A>::go;
+	x.o = o;
+	x.m = m;
+	x.a = a;
+	job j;
+	memset(&j, 0, sizeof(j));
+	memcpy(&j, &x, sizeof(x));
+	return add(j);
+}
+
+#endif
@@ -1,6 +1,7 @@
 // yfs client.  implements FS operations using extent and lock server
 #include "yfs_client.h"
 #include "extent_client.h"
+#include "extent_client_cache.h"
 #include "lock_client_cache.h"
 #include <sstream>
 #include <iostream>
@@ -9,13 +10,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include "alog.h"
 
 
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst)
 {
-    ec = new extent_client(extent_dst);
+    extent_client_cache *cache = new extent_client_cache(extent_dst);
+    ec = cache;
     //lc = new lock_client(lock_dst);
-    lc = new lock_client_cache(lock_dst);
+    lc = new lock_client_cache(lock_dst, cache);
 }
 
 yfs_client::yfs_client(extent_client * nec, lock_client* nlc){
@@ -48,21 +51,21 @@ yfs_client::isfile(inum inum)
     extent_protocol::attr a;
     lc->acquire(inum);
     if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("error getting attr\n");
+        alog(JSL_DBG_2, "error getting attr\n");
         lc->release(inum);
         return false;
     }
 
     if (a.type == extent_protocol::T_FILE) {
-        printf("isfile: %lld is a file\n", inum);
+        alog(JSL_DBG_4, "isfile: %lld is a file\n", inum);
         lc->release(inum);
         return true;
     }else if (a.type == extent_protocol::T_SYMLK) {
-        printf("isfile: %lld is a symlink\n", inum);
+        alog(JSL_DBG_4, "isfile: %lld is a symlink\n", inum);
         lc->release(inum);
         return false;
     } 
-    printf("isfile: %lld is a dir\n", inum);
+    alog(JSL_DBG_4, "isfile: %lld is a dir\n", inum);
     lc->release(inum);
     return false;
 }
@@ -77,17 +80,17 @@ yfs_client::issymlink(inum inum)
     extent_protocol::attr a;
     lc->acquire(inum);
     if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("error getting attr\n");
+        alog(JSL_DBG_2, "error getting attr\n");
         lc->release(inum);
         return false;
     }
 
     if (a.type == extent_protocol::T_SYMLK) {
-        printf("isfile: %lld is a symlink\n", inum);
+        alog(JSL_DBG_4, "isfile: %lld is a symlink\n", inum);
         lc->release(inum);
         return true;
     } 
-    printf("isfile: %lld is not a symlink\n", inum);
+    alog(JSL_DBG_4, "isfile: %lld is not a symlink\n", inum);
     lc->release(inum);
     return false;
 }
@@ -99,17 +102,17 @@ yfs_client::isdir(inum inum)
     extent_protocol::attr a;
     lc->acquire(inum);
     if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("error getting attr\n");
+        alog(JSL_DBG_2, "error getting attr\n");
         lc->release(inum);
         return false;
     }
 
     if (a.type == extent_protocol::T_DIR) {
-        printf("isfile: %lld is a dir\n", inum);
+        alog(JSL_DBG_4, "isfile: %lld is a dir\n", inum);
         lc->release(inum);
         return true;
     } 
-    printf("isfile: %lld is not a dir\n", inum);
+    alog(JSL_DBG_4, "isfile: %lld is not a dir\n", inum);
     lc->release(inum);
     return false;
 }
@@ -119,7 +122,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
 {
     int r = OK;
     lc->acquire(inum);
-    printf("getfile %016llx\n", inum);
+    alog(JSL_DBG_4, "getfile %016llx\n", inum);
     extent_protocol::attr a;
     if (ec->getattr(inum, a) != extent_protocol::OK) {
         r = IOERR;
@@ -130,7 +133,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
     fin.mtime = a.mtime;
     fin.ctime = a.ctime;
     fin.size = a.size;
-    printf("getfile %016llx -> sz %llu\n", inum, fin.size);
+    alog(JSL_DBG_4, "getfile %016llx -> sz %llu\n", inum, fin.size);
 
 release:
     lc->release(inum);
@@ -142,7 +145,7 @@ yfs_client::getsymlink(inum inum, symlinkinfo &sin1)
 {
     int r = OK;
     lc->acquire(inum);
-    printf("getlink %016llx\n", inum);
+    alog(JSL_DBG_4, "getlink %016llx\n", inum);
     extent_protocol::attr a;
     if (ec->getattr(inum, a) != extent_protocol::OK) {
         r = IOERR;
@@ -152,7 +155,7 @@ yfs_client::getsymlink(inum inum, symlinkinfo &sin1)
     sin1.mtime = a.mtime;
     sin1.ctime = a.ctime;
     sin1.size = a.size;
-    printf("getlink %016llx -> sz %llu\n", inum, sin1.size);
+    alog(JSL_DBG_4, "getlink %016llx -> sz %llu\n", inum, sin1.size);
 release:
     lc->release(inum);
     return r;
@@ -163,7 +166,7 @@ yfs_client::getdir(inum inum, dirinfo &din)
 {
     int r = OK;
     lc->acquire(inum);
-    printf("getdir %016llx\n", inum);
+    alog(JSL_DBG_4, "getdir %016llx\n", inum);
     extent_protocol::attr a;
     if (ec->getattr(inum, a) != extent_protocol::OK) {
         r = IOERR;
@@ -181,7 +184,7 @@ release:
 
 #define EXT_RPC(xx) do { \
     if ((xx) != extent_protocol::OK) { \
-        printf("EXT_RPC Error: %s:%d \n", __FILE__, __LINE__); \
+        alog(JSL_DBG_2, "EXT_RPC Error: %s:%d \n", __FILE__, __LINE__); \
         r = IOERR; \
         goto release; \
     } \
@@ -191,17 +194,11 @@ release:
 int
 yfs_client::setattr(inum ino, size_t size)
 {
-    #if DB
-    std::cout << "setattr:" << ino << " size:" << size << std::endl;
-    std::cout.flush();
-    #endif
+    alog(JSL_DBG_4, "setattr:%llu size:%zu\n", ino, size);
 
     lc->acquire(ino);
     int r = OK;
-    std::string buf;
-    r = ec->get(ino, buf);
-    buf.resize(size);
-    ec->put(ino, buf);
+    r = ec->truncate(ino, size);
     lc->release(ino);
     return r;
 }
@@ -209,15 +206,12 @@ yfs_client::setattr(inum ino, size_t size)
 int
 yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
-    #if DB
-    std::cout << "create:" << name << " parent:" << parent << std::endl;
-    std::cout.flush();
-    #endif
+    alog(JSL_DBG_4, "create:%s parent:%llu\n", name, parent);
   
     int r = OK;
     bool found = false;
     lc->acquire(parent);
-    lookup(parent, name, found, ino_out);
+    lookup_nolock(parent, name, found, ino_out);
     if (found == true){
         lc->release(parent);
         return EXIST;
@@ -237,14 +231,11 @@ yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 int
 yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
-    #if DB
-    std::cout << "mkdir:" << name << " parent:" << parent << std::endl;
-    std::cout.flush();
-    #endif
+    alog(JSL_DBG_4, "mkdir:%s parent:%llu\n", name, parent);
 
     lc->acquire(parent);
     bool found = false;
-    lookup(parent, name, found, ino_out);
+    lookup_nolock(parent, name, found, ino_out);
     if (found == true){
         lc->release(parent);
         return EXIST;
@@ -265,15 +256,22 @@ yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
 
 int
 yfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
+{
+    lc->acquire(parent);
+    int r = lookup_nolock(parent, name, found, ino_out);
+    lc->release(parent);
+    return r;
+}
+
+// lookup with the lock on parent already held by the caller.
+int
+yfs_client::lookup_nolock(inum parent, const char *name, bool &found, inum &ino_out)
 {
     int r = OK;
     std::string buf;
     r = ec->get(parent, buf);
 
-    #if DB
-    std::cout << "lookup:" << name << " buf:" << buf << std::endl;
-    std::cout.flush();
-    #endif
+    alog(JSL_DBG_4, "lookup:%s dir size:%zu\n", name, buf.size());
     
     int pos = 0;
     while(pos < buf.size()){
@@ -332,16 +330,26 @@ int
 yfs_client::write(inum ino, size_t size, off_t off, const char *data,
         size_t &bytes_written)
 {
-    #if DB
-    std::cout << "write:" << ino  << std::endl;
-    std::cout.flush();
-    #endif
+    alog(JSL_DBG_4, "write:%llu\n", ino);
 
     lc->acquire(ino);
 
     int r = OK;
     std::string buf;
     bytes_written = 0;
+
+    // writes at or past the end only need the new bytes shipped.
+    extent_protocol::attr a;
+    r = ec->getattr(ino, a);
+    if (r == OK && off >= a.size) {
+        buf.assign(off - a.size, 0);
+        buf.append(data, size);
+        r = ec->append(ino, buf);
+        if (r == OK)
+            bytes_written = buf.size();
+        lc->release(ino);
+        return r;
+    }
     r = ec->get(ino, buf);
 
     std::string temp(size, 0);
@@ -359,7 +367,10 @@ yfs_client::write(inum ino, size_t size, off_t off, const char *data,
     }
     
     bytes_written += size;
-    ec->put(ino, buf);
+    if (r == OK)
+        r = ec->put(ino, buf);
+    if (r != OK)
+        bytes_written = 0;
 
     lc->release(ino);
     return r;
@@ -406,7 +417,7 @@ int yfs_client::symlink(const char *link, inum parent, const char *name, inum &i
 
     lc->acquire(parent);
     bool found = false;
-    lookup(parent, name, found, inode);
+    lookup_nolock(parent, name, found, inode);
     if (found == true)
     {
         lc->release(parent);
@@ -420,7 +431,9 @@ int yfs_client::symlink(const char *link, inum parent, const char *name, inum &i
     *(uint32_t *)(buf.c_str()+buf.size()-4) = ino;
     
     ec->put(parent, buf);
+    lc->acquire(ino);
     ec->put(ino, link);
+    lc->release(ino);
 
     lc->release(parent);
     return r;
@@ -429,6 +442,32 @@ int yfs_client::symlink(const char *link, inum parent, const char *name, inum &i
 int yfs_client::readlink(inum ino, std::string &result)
 {
     int r = OK;
+    lc->acquire(ino);
     ec->get(ino, result);
+    lc->release(ino);
+    return r;
+}
+
+// Copy len bytes of src at src_off to dst at dst_off without moving
+// the data through this client.
+int yfs_client::copy_range(inum src, off_t src_off, inum dst, off_t dst_off,
+        size_t len, size_t &copied)
+{
+    int r = OK;
+    uint32_t n = 0;
+
+    copied = 0;
+    lc->acquire(src < dst ? src : dst);
+    if (src != dst)
+        lc->acquire(src < dst ? dst : src);
+    extent_protocol::status ret = ec->copy_range(src, src_off, dst, dst_off, len, n);
+    if (ret == extent_protocol::NOENT)
+        r = NOENT;
+    else if (ret != extent_protocol::OK)
+        r = IOERR;
+    copied = n;
+    if (src != dst)
+        lc->release(src < dst ? dst : src);
+    lc->release(src < dst ? src : dst);
     return r;
 }
@@ -48,6 +48,7 @@ class yfs_client {
  private:
   static std::string filename(inum);
   static inum n2i(std::string);
+  int lookup_nolock(inum, const char *, bool &, inum &);
 
  public:
   yfs_client(std::string, std::string);
@@ -71,6 +72,7 @@ class yfs_client {
   int mkdir(inum , const char *, mode_t , inum &);
   int symlink(const char *, inum, const char *, inum &);
   int readlink(inum, std::string &);
+  int copy_range(inum, off_t, inum, off_t, size_t, size_t &);
   int pathToInum(const char *, inum);
   int allPath(const char *, inum);
 };